@@ -0,0 +1,389 @@
+/*
+    Microbenchmarks for the OrderBook operations on the matching thread's hot
+    path. Each one runs against a book prefilled to a given number of price
+    levels per side and reports the time and the heap allocations per
+    operation; refilling and clearing the book between batches is left out of
+    both.
+*/
+
+#include "matching_engine.h"
+
+#include <benchmark/benchmark.h>
+#include <cstdlib>
+#include <random>
+
+const Price BENCHMARK_MID_PRICE = 100000; // best ask, the best bid sits one tick below
+const Quantity BENCHMARK_ORDER_QUANTITY = 10;
+const int BENCHMARK_ORDERS_PER_LEVEL = 4;
+const size_t BENCHMARK_BATCH_SIZE = 4096;
+const AccountId BENCHMARK_ACCOUNTS = 64;
+const uint64_t BENCHMARK_SEED = 42;
+
+// every allocation while a benchmark is timing is counted, the setup between batches is not
+std::atomic<uint64_t> allocation_count{0};
+thread_local bool counting_allocations = false;
+
+void *operator new(size_t size)
+{
+    if (counting_allocations)
+    {
+        allocation_count.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (void *memory = std::malloc(size == 0 ? 1 : size))
+    {
+        return memory;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *memory) noexcept { std::free(memory); }
+
+void operator delete(void *memory, size_t) noexcept { std::free(memory); }
+
+// where passive orders are placed, as a distance in levels from the touch
+enum class PriceDistribution
+{
+    uniform, // evenly across the book's depth
+    touch,   // geometric, most of them at the best few levels
+    zipf     // the level n away from the touch is picked in proportion to 1 / (n + 1)
+};
+
+class AllocationCounter
+{
+public:
+    explicit AllocationCounter(benchmark::State &state) : state(state) {}
+
+    void resume()
+    {
+        state.ResumeTiming();
+        counting_allocations = true;
+    }
+
+    void pause()
+    {
+        counting_allocations = false;
+        state.PauseTiming();
+    }
+
+    ~AllocationCounter()
+    {
+        counting_allocations = false;
+        state.counters["allocs/op"] = benchmark::Counter(static_cast<double>(allocation_count.load(std::memory_order_relaxed) - first), benchmark::Counter::kAvgIterations);
+    }
+
+private:
+    benchmark::State &state;
+    uint64_t first = allocation_count.load(std::memory_order_relaxed);
+};
+
+// level offsets from the touch, each below `depth`
+std::vector<int> price_offsets(PriceDistribution distribution, int depth, size_t count, std::mt19937_64 &random)
+{
+    std::vector<int> offsets;
+    offsets.reserve(count);
+    std::uniform_int_distribution<int> uniform(0, depth - 1);
+    std::geometric_distribution<int> touch(0.3);
+    std::vector<double> weights;
+    for (int n = 0; n < depth; n++)
+    {
+        weights.push_back(1.0 / (n + 1));
+    }
+    std::discrete_distribution<int> zipf(weights.begin(), weights.end());
+    for (size_t i = 0; i < count; i++)
+    {
+        switch (distribution)
+        {
+        case PriceDistribution::uniform:
+            offsets.push_back(uniform(random));
+            break;
+        case PriceDistribution::touch:
+            offsets.push_back(std::min(touch(random), depth - 1));
+            break;
+        case PriceDistribution::zipf:
+            offsets.push_back(zipf(random));
+            break;
+        }
+    }
+    return offsets;
+}
+
+Price passive_price(bool is_buy, int offset) { return is_buy ? BENCHMARK_MID_PRICE - 1 - offset : BENCHMARK_MID_PRICE + offset; }
+
+// one shard's worth of book and balances, with every account funded and holding coin
+struct BenchmarkBook
+{
+    BenchmarkBook() : cash_ledger(BENCHMARK_ACCOUNTS), ledger(cash_ledger), coin_balances(BENCHMARK_ACCOUNTS, std::numeric_limits<Quantity>::max() / 4), last_transactions(BENCHMARK_ACCOUNTS, 0)
+    {
+        journal.open("", FsyncPolicy::none);
+        for (AccountId account_id = 0; account_id < BENCHMARK_ACCOUNTS; account_id++)
+        {
+            ledger.open_account(account_id);
+        }
+    }
+
+    Order make_order(AccountId account_id, bool is_buy, Quantity quantity, Price price, OrderType type = OrderType::limit) const
+    {
+        return order_book.construct_order(account_id, is_buy ? Side::buy : Side::sell, quantity, price, 0, type);
+    }
+
+    // tops each of the best `depth` levels of a side up to BENCHMARK_ORDERS_PER_LEVEL orders
+    void fill_side(bool is_buy, int depth)
+    {
+        std::vector<Level_Summary> levels;
+        order_book.snapshot_levels(is_buy, levels);
+        for (int offset = 0; offset < depth; offset++)
+        {
+            Price price = passive_price(is_buy, offset);
+            auto level = std::find_if(levels.begin(), levels.end(), [price](const Level_Summary &summary)
+                                      { return summary.price == price; });
+            for (int n = level == levels.end() ? 0 : level->order_count; n < BENCHMARK_ORDERS_PER_LEVEL; n++)
+            {
+                auto order = make_order(static_cast<AccountId>(n % BENCHMARK_ACCOUNTS), is_buy, BENCHMARK_ORDER_QUANTITY, price);
+                order_book.add_order(order);
+            }
+        }
+        settle();
+    }
+
+    // drops what the engine would have published and recorded once per batch
+    void settle()
+    {
+        order_book.collect_level_updates(updates);
+        journal.truncate(0);
+        std::fill(last_transactions.begin(), last_transactions.end(), 0);
+    }
+
+    OrderBook order_book;
+    CashLedger cash_ledger;
+    ShardLedger ledger;
+    std::vector<Quantity> coin_balances;
+    std::vector<uint32_t> last_transactions;
+    TradeJournal journal;
+    std::vector<LevelUpdate> updates;
+};
+
+// args: depth, price distribution
+void BM_AddOrder(benchmark::State &state)
+{
+    int depth = static_cast<int>(state.range(0));
+    auto distribution = static_cast<PriceDistribution>(state.range(1));
+    BenchmarkBook book;
+    book.fill_side(true, depth);
+    book.fill_side(false, depth);
+    std::mt19937_64 random(BENCHMARK_SEED);
+    std::vector<Order> orders;
+    for (auto offset : price_offsets(distribution, depth, BENCHMARK_BATCH_SIZE, random))
+    {
+        bool is_buy = orders.size() % 2 == 0;
+        orders.push_back(book.make_order(static_cast<AccountId>(orders.size() % BENCHMARK_ACCOUNTS), is_buy, BENCHMARK_ORDER_QUANTITY, passive_price(is_buy, offset)));
+    }
+
+    AllocationCounter allocations(state);
+    size_t next = 0;
+    counting_allocations = true;
+    for (auto _ : state)
+    {
+        book.order_book.add_order(orders[next++]);
+        if (next == orders.size())
+        {
+            allocations.pause();
+            for (auto &order : orders)
+            {
+                book.order_book.remove_order(order.id);
+            }
+            book.settle();
+            next = 0;
+            allocations.resume();
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+// args: depth, price distribution
+void BM_RemoveOrder(benchmark::State &state)
+{
+    int depth = static_cast<int>(state.range(0));
+    auto distribution = static_cast<PriceDistribution>(state.range(1));
+    BenchmarkBook book;
+    book.fill_side(true, depth);
+    book.fill_side(false, depth);
+    std::mt19937_64 random(BENCHMARK_SEED);
+    std::vector<Order> orders;
+    for (auto offset : price_offsets(distribution, depth, BENCHMARK_BATCH_SIZE, random))
+    {
+        bool is_buy = orders.size() % 2 == 0;
+        orders.push_back(book.make_order(static_cast<AccountId>(orders.size() % BENCHMARK_ACCOUNTS), is_buy, BENCHMARK_ORDER_QUANTITY, passive_price(is_buy, offset)));
+    }
+    // cancels arrive in no particular order
+    std::vector<OrderId> cancels;
+    for (auto &order : orders)
+    {
+        cancels.push_back(order.id);
+    }
+    std::shuffle(cancels.begin(), cancels.end(), random);
+
+    AllocationCounter allocations(state);
+    size_t next = cancels.size();
+    counting_allocations = true;
+    for (auto _ : state)
+    {
+        if (next == cancels.size())
+        {
+            allocations.pause();
+            book.settle();
+            for (auto &order : orders)
+            {
+                book.order_book.add_order(order);
+            }
+            next = 0;
+            allocations.resume();
+        }
+        book.order_book.remove_order(cancels[next++]);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+// args: depth, levels each aggressive order sweeps
+void BM_MatchOrder(benchmark::State &state)
+{
+    int depth = static_cast<int>(state.range(0));
+    int swept = static_cast<int>(state.range(1));
+    BenchmarkBook book;
+    book.fill_side(true, depth);
+    book.fill_side(false, depth);
+    Quantity quantity = BENCHMARK_ORDER_QUANTITY * BENCHMARK_ORDERS_PER_LEVEL * swept;
+
+    // the book is topped back up to `depth` levels before a sweep would leave it under half
+    AllocationCounter allocations(state);
+    int remaining = depth;
+    size_t sweeps = 0;
+    counting_allocations = true;
+    for (auto _ : state)
+    {
+        if (remaining - swept < depth / 2 || remaining < swept)
+        {
+            allocations.pause();
+            book.fill_side(true, depth);
+            remaining = depth;
+            allocations.resume();
+        }
+        auto order = book.make_order(BENCHMARK_ACCOUNTS - 1, false, quantity, 1);
+        benchmark::DoNotOptimize(book.order_book.match_order(order, 0, book.ledger, book.coin_balances, book.journal, book.last_transactions));
+        remaining -= swept;
+        if (++sweeps % BENCHMARK_BATCH_SIZE == 0)
+        {
+            allocations.pause();
+            book.settle();
+            allocations.resume();
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * swept * BENCHMARK_ORDERS_PER_LEVEL);
+}
+
+// args: depth, order type; fill-or-kill walks the levels it would take, post-only looks at the touch
+void BM_IsAllowedOrder(benchmark::State &state)
+{
+    int depth = static_cast<int>(state.range(0));
+    auto type = static_cast<OrderType>(state.range(1));
+    BenchmarkBook book;
+    book.fill_side(true, depth);
+    book.fill_side(false, depth);
+    // a buy for the whole ask side at the worst ask, so fill-or-kill has to walk all of it
+    auto order = book.make_order(BENCHMARK_ACCOUNTS - 1, true, BENCHMARK_ORDER_QUANTITY * BENCHMARK_ORDERS_PER_LEVEL * depth, passive_price(false, depth - 1), type);
+    if (type == OrderType::post_only)
+    {
+        order.price = passive_price(true, 0);
+    }
+
+    AllocationCounter allocations(state);
+    RejectReason reason;
+    counting_allocations = true;
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(book.order_book.is_allowed_order(order, book.coin_balances, reason));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+void BM_ConstructOrder(benchmark::State &state)
+{
+    BenchmarkBook book;
+    AllocationCounter allocations(state);
+    counting_allocations = true;
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(book.make_order(1, true, BENCHMARK_ORDER_QUANTITY, BENCHMARK_MID_PRICE));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+// args: depth, cancel percentage; every other operation adds a passive order placed by `touch`
+void BM_OrderFlow(benchmark::State &state)
+{
+    int depth = static_cast<int>(state.range(0));
+    int cancel_percentage = static_cast<int>(state.range(1));
+    BenchmarkBook book;
+    book.fill_side(true, depth);
+    book.fill_side(false, depth);
+    std::mt19937_64 random(BENCHMARK_SEED);
+    auto offsets = price_offsets(PriceDistribution::touch, depth, BENCHMARK_BATCH_SIZE, random);
+    std::vector<bool> cancels;
+    std::uniform_int_distribution<int> percent(0, 99);
+    for (size_t i = 0; i < BENCHMARK_BATCH_SIZE; i++)
+    {
+        cancels.push_back(percent(random) < cancel_percentage);
+    }
+
+    // the live orders flow added, cancelled at random; a full book turns adds into cancels
+    std::vector<OrderId> live;
+    live.reserve(BENCHMARK_BATCH_SIZE);
+    size_t live_limit = BENCHMARK_BATCH_SIZE / 2;
+    AllocationCounter allocations(state);
+    size_t next = 0;
+    counting_allocations = true;
+    for (auto _ : state)
+    {
+        if ((cancels[next] && !live.empty()) || live.size() == live_limit)
+        {
+            size_t index = random() % live.size();
+            book.order_book.remove_order(live[index]);
+            live[index] = live.back();
+            live.pop_back();
+        }
+        else
+        {
+            bool is_buy = next % 2 == 0;
+            auto order = book.make_order(static_cast<AccountId>(next % BENCHMARK_ACCOUNTS), is_buy, BENCHMARK_ORDER_QUANTITY, passive_price(is_buy, offsets[next]));
+            book.order_book.add_order(order);
+            live.push_back(order.id);
+        }
+        if (++next == BENCHMARK_BATCH_SIZE)
+        {
+            allocations.pause();
+            book.settle();
+            next = 0;
+            allocations.resume();
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+void depth_and_distribution(benchmark::internal::Benchmark *benchmark)
+{
+    for (int depth : {10, 100, 1000})
+    {
+        for (auto distribution : {PriceDistribution::uniform, PriceDistribution::touch, PriceDistribution::zipf})
+        {
+            benchmark->Args({depth, static_cast<int64_t>(distribution)});
+        }
+    }
+}
+
+BENCHMARK(BM_AddOrder)->ArgNames({"depth", "distribution"})->Apply(depth_and_distribution);
+BENCHMARK(BM_RemoveOrder)->ArgNames({"depth", "distribution"})->Apply(depth_and_distribution);
+BENCHMARK(BM_MatchOrder)->ArgNames({"depth", "swept"})->ArgsProduct({{10, 100, 1000}, {1, 5}});
+BENCHMARK(BM_IsAllowedOrder)->ArgNames({"depth", "type"})->ArgsProduct({{10, 100, 1000}, {static_cast<int64_t>(OrderType::limit), static_cast<int64_t>(OrderType::fok), static_cast<int64_t>(OrderType::post_only)}});
+BENCHMARK(BM_ConstructOrder);
+BENCHMARK(BM_OrderFlow)->ArgNames({"depth", "cancels"})->ArgsProduct({{10, 100, 1000}, {50, 75, 90}});
+
+BENCHMARK_MAIN();
@@ -0,0 +1,2053 @@
+/*
+    Author : Nad
+    Date : 2023-01-15
+    Description : A simple C++ Matching Engine
+*/
+
+/*
+    The command line, the TCP order gateway, the market-data bridges and the
+    load generator, all clients of one MatchingEngine.
+*/
+
+#include "matching_engine.h"
+
+#include <random>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+const int ACCOUNT_TABLE_WIDTH = 16;
+const int ORDER_TABLE_WIDTH = 24;
+const size_t MARKET_DATA_DATAGRAM_RECORDS = 16;
+const int MARKET_DATA_BRIDGE_IDLE_US = 50;
+const size_t GATEWAY_READ_SIZE = 1 << 16;
+const int GATEWAY_MAX_EVENTS = 64;
+const int GATEWAY_POLL_MS = 10;
+const size_t GATEWAY_REPORT_CAPACITY = 1 << 16;
+const uint16_t GATEWAY_ALL_SYMBOLS = UINT16_MAX; // a mass cancel's symbol for every symbol
+const size_t REPORT_BATCH_SIZE = 256;
+const int REPORT_OUTPUT_IDLE_US = 50;
+
+const int STATS_POLL_MS = 100;
+const int LOAD_DEFAULT_MESSAGES = 1000000;
+const int LOAD_DEFAULT_ACCOUNTS = 100;
+const int LOAD_PRICE_LEVELS = 64; // passive orders are placed this many levels either side of the mid
+const double LOAD_ZIPF_EXPONENT = 1.0;
+const double LOAD_MID_PRICE = 100;
+const int LOAD_MAX_QUANTITY = 10; // in lots
+const double LOAD_ACCOUNT_USD = 1e9;
+const double LOAD_ACCOUNT_COIN = 1e9;
+const uint64_t LOAD_SEED = 42;
+const uint32_t LOAD_SESSION = UINT32_MAX; // keeps the load's reports off the console and away from gateway sessions
+
+const char *const DEFAULT_SYMBOL = "C";
+
+MatchingEngine engine;
+
+// centres `input` in `width` columns, input that is already wider is returned as it is
+std::string pretty_print(std::string input, int width)
+{
+    int extra_spaces = std::max(width - static_cast<int>(input.length()), 0);
+    std::string white_space(extra_spaces / 2, ' ');
+    return (extra_spaces % 2 != 0 ? " " : "") + white_space + input + white_space;
+}
+
+/*
+    Account names, owned by the command line thread. The engine only sees AccountIds.
+*/
+std::vector<std::string> account_names;       // indexed by AccountId
+std::map<std::string, AccountId> account_ids; // live accounts only
+std::ofstream account_log;                    // "create <name>" and "delete <name>" lines, when persisted
+
+bool find_account(const std::string &account_name, AccountId &account_id)
+{
+    auto account_it = account_ids.find(account_name);
+    if (account_it == account_ids.end())
+    {
+        return false;
+    }
+    account_id = account_it->second;
+    return true;
+}
+
+// interns `account_name` to the next dense id, returns false when the account already exists or the ledger is full
+bool register_account(const std::string &account_name, AccountId &account_id)
+{
+    if (find_account(account_name, account_id) || account_names.size() >= engine.max_accounts())
+    {
+        return false;
+    }
+
+    account_id = static_cast<AccountId>(account_names.size());
+    account_names.push_back(account_name);
+    account_ids.emplace(account_name, account_id);
+    if (account_log.is_open())
+    {
+        account_log << "create " << account_name << std::endl;
+    }
+    return true;
+}
+
+void delete_account(const std::string &account_name)
+{
+    // the id is never reused, so resting orders and transactions keep pointing at the old account
+    if (account_ids.erase(account_name) > 0 && account_log.is_open())
+    {
+        account_log << "delete " << account_name << std::endl;
+    }
+}
+
+// replays the account log of an earlier run, returns false when there is none
+bool load_accounts(const std::string &path)
+{
+    std::ifstream accounts(path);
+    std::string action, account_name;
+    bool found = false;
+    while (accounts >> action >> account_name)
+    {
+        found = true;
+        AccountId account_id;
+        if (action == "create")
+        {
+            register_account(account_name, account_id);
+        }
+        else if (action == "delete")
+        {
+            delete_account(account_name);
+        }
+    }
+    return found;
+}
+
+void parse_input(std::string &input, std::vector<std::string> &input_tokens)
+{
+    std::stringstream ss(input);
+    std::string token;
+
+    while (ss >> token)
+    {
+        input_tokens.push_back(token);
+    }
+}
+
+std::string coin_label(const Shard &shard)
+{
+    return "Coin (" + engine.symbol(shard) + ")";
+}
+
+void print_accounts(const std::vector<StatePublisher::Reader> &states)
+{
+    std::cout << "-------------------- ACCOUNTS ------------------"
+              << "\n";
+    std::cout << "Total Accounts: " << account_ids.size() << "\n";
+    std::cout << pretty_print("Account", ACCOUNT_TABLE_WIDTH) << " | " << pretty_print("$USD", ACCOUNT_TABLE_WIDTH);
+    for (auto &shard : engine.shards())
+    {
+        std::cout << " | " << pretty_print(coin_label(*shard), ACCOUNT_TABLE_WIDTH);
+    }
+    std::cout << "\n";
+    for (auto account : account_ids)
+    {
+        std::cout << pretty_print(account.first, ACCOUNT_TABLE_WIDTH) << " | " << pretty_print(convert_cash_to_string(engine.balance(account.second)), ACCOUNT_TABLE_WIDTH);
+        for (auto &state : states)
+        {
+            std::cout << " | " << pretty_print(convert_quantity_to_string(state->coin_balances[account.second]), ACCOUNT_TABLE_WIDTH);
+        }
+        std::cout << "\n";
+    }
+}
+
+void print_order_book(const Shard &shard, const StateSnapshot &state)
+{
+    std::cout << "------------------ ORDER BOOK (" << engine.symbol(shard) << ") ----------------"
+              << "\n";
+    std::cout << " " << pretty_print("Qty", ORDER_TABLE_WIDTH / 2) << " | " << pretty_print("$", ORDER_TABLE_WIDTH / 2)
+              << "\n";
+
+    for (auto sell_it = state.asks.rbegin(); sell_it != state.asks.rend(); sell_it++)
+    {
+        std::cout << "⌄" << pretty_print(convert_quantity_to_string(sell_it->quantity), ORDER_TABLE_WIDTH / 2) << " | " << pretty_print(convert_price_to_string(sell_it->price), ORDER_TABLE_WIDTH / 2) << "\n";
+    }
+
+    std::cout << "\n";
+
+    for (auto buy_it = state.bids.begin(); buy_it != state.bids.end(); buy_it++)
+    {
+        std::cout << "⌃" << pretty_print(convert_quantity_to_string(buy_it->quantity), ORDER_TABLE_WIDTH / 2) << " | " << pretty_print(convert_price_to_string(buy_it->price), ORDER_TABLE_WIDTH / 2) << "\n";
+    }
+}
+
+// top of book as last published, read without a round trip through the engine
+void print_depth(const Shard &shard)
+{
+    auto depth = engine.depth(shard);
+    std::cout << "------------------ DEPTH (" << engine.symbol(shard) << ") ----------------"
+              << "\n";
+    std::cout << "Sequence: " << depth.sequence << "\n";
+    std::cout << " " << pretty_print("Qty", ORDER_TABLE_WIDTH / 2) << " | " << pretty_print("$", ORDER_TABLE_WIDTH / 2) << " | " << pretty_print("Orders", ORDER_TABLE_WIDTH / 2)
+              << "\n";
+
+    for (int n = depth.ask_count - 1; n >= 0; n--)
+    {
+        std::cout << "⌄" << pretty_print(convert_quantity_to_string(depth.asks[n].quantity), ORDER_TABLE_WIDTH / 2) << " | " << pretty_print(convert_price_to_string(depth.asks[n].price), ORDER_TABLE_WIDTH / 2) << " | " << pretty_print(convert_int_to_string(depth.asks[n].order_count), ORDER_TABLE_WIDTH / 2) << "\n";
+    }
+
+    std::cout << "\n";
+
+    for (int n = 0; n < depth.bid_count; n++)
+    {
+        std::cout << "⌃" << pretty_print(convert_quantity_to_string(depth.bids[n].quantity), ORDER_TABLE_WIDTH / 2) << " | " << pretty_print(convert_price_to_string(depth.bids[n].price), ORDER_TABLE_WIDTH / 2) << " | " << pretty_print(convert_int_to_string(depth.bids[n].order_count), ORDER_TABLE_WIDTH / 2) << "\n";
+    }
+}
+
+// names of deleted accounts are kept, but a journal from an earlier run can hold ids this run never registered
+std::string account_label(AccountId account_id)
+{
+    return account_id < account_names.size() ? account_names[account_id] : "#" + convert_int_to_string(static_cast<int>(account_id));
+}
+
+// newest first, straight out of the shard's mapped journal; an account's fills are followed through their back links
+void collect_transactions(const Shard &shard, const StateSnapshot &state, const AccountId *account_id, int num_transactions, std::vector<std::pair<const Transaction *, const Shard *>> &result)
+{
+    int found = 0;
+    if (account_id == nullptr)
+    {
+        for (size_t i = state.transaction_count; i > 0 && found < num_transactions; i--, found++)
+        {
+            result.emplace_back(&engine.transaction(shard, i - 1), &shard);
+        }
+        return;
+    }
+
+    for (auto position = *account_id < state.last_transactions.size() ? state.last_transactions[*account_id] : 0; position != 0 && found < num_transactions; found++)
+    {
+        auto &transaction = engine.transaction(shard, position - 1);
+        result.emplace_back(&transaction, &shard);
+        position = transaction.buyer == *account_id ? transaction.buyer_previous : transaction.seller_previous;
+    }
+}
+
+// merges the newest `num_transactions` across every shard, for one account or for all of them when `account_id` is null
+void print_transactions(const std::string &account, const AccountId *account_id, int num_transactions)
+{
+    // every fill the published state counts is already in the journal
+    auto states = engine.read_state();
+
+    std::cout << "-------------------- TRANSACTIONS ------------------"
+              << "\n";
+    if (account == "")
+    {
+        std::cout << "All Transactions"
+                  << "\n";
+    }
+    else
+    {
+        std::cout << "Account: " << account << "\n";
+    }
+
+    std::vector<std::pair<const Transaction *, const Shard *>> merged;
+    for (size_t i = 0; i < states.size(); i++)
+    {
+        collect_transactions(*engine.shards()[i], *states[i], account_id, num_transactions, merged);
+    }
+    std::stable_sort(merged.begin(), merged.end(), [](const auto &a, const auto &b)
+                     { return a.first->timestamp > b.first->timestamp; });
+    if (static_cast<int>(merged.size()) > num_transactions)
+    {
+        merged.resize(std::max(num_transactions, 0));
+    }
+
+    std::cout << pretty_print("Timestamp", ACCOUNT_TABLE_WIDTH) << " | " << pretty_print("Symbol", ACCOUNT_TABLE_WIDTH) << " | " << pretty_print("Aggressor", ACCOUNT_TABLE_WIDTH) << " | " << pretty_print("Buyer", ACCOUNT_TABLE_WIDTH) << " | " << pretty_print("Seller", ACCOUNT_TABLE_WIDTH) << " | " << pretty_print("Quantity", ACCOUNT_TABLE_WIDTH) << " | " << pretty_print("Price", ACCOUNT_TABLE_WIDTH) << "\n";
+    for (auto &entry : merged)
+    {
+        auto &transaction = *entry.first;
+        std::cout << pretty_print(convert_timestamp_to_string(transaction.timestamp), ACCOUNT_TABLE_WIDTH) << " | " << pretty_print(engine.symbol(*entry.second), ACCOUNT_TABLE_WIDTH) << " | " << pretty_print(side_to_string(transaction.aggressor), ACCOUNT_TABLE_WIDTH) << " | " << pretty_print(account_label(transaction.buyer), ACCOUNT_TABLE_WIDTH) << " | " << pretty_print(account_label(transaction.seller), ACCOUNT_TABLE_WIDTH) << " | " << pretty_print(convert_quantity_to_string(transaction.quantity), ACCOUNT_TABLE_WIDTH) << " | " << pretty_print(convert_price_to_string(transaction.price), ACCOUNT_TABLE_WIDTH) << "\n";
+    }
+}
+
+// what print_stats last saw, for turning the counters into rates
+struct StatsTotals
+{
+    std::chrono::steady_clock::time_point time = CLOCK_STEADY_ANCHOR;
+    std::vector<uint64_t> orders;
+    std::vector<uint64_t> fills;
+    std::vector<uint64_t> cancels;
+};
+
+// counters and rates since the previous call per symbol, then the stage percentiles over all symbols since startup
+void print_stats(std::ostream &out, StatsTotals &previous)
+{
+    auto now = std::chrono::steady_clock::now();
+    double seconds = std::max(std::chrono::duration<double>(now - previous.time).count(), 1e-9);
+    previous.time = now;
+    previous.orders.resize(engine.shards().size(), 0);
+    previous.fills.resize(engine.shards().size(), 0);
+    previous.cancels.resize(engine.shards().size(), 0);
+    auto rate = [seconds](uint64_t current, uint64_t &last)
+    {
+        auto per_second = static_cast<uint64_t>(std::llround(static_cast<double>(current - last) / seconds));
+        last = current;
+        return std::to_string(per_second);
+    };
+
+    out << "-------------------- STATS ------------------"
+        << "\n";
+    out << pretty_print("Symbol", ACCOUNT_TABLE_WIDTH) << " | " << pretty_print("Orders/s", ACCOUNT_TABLE_WIDTH) << " | " << pretty_print("Fills/s", ACCOUNT_TABLE_WIDTH) << " | " << pretty_print("Cancels/s", ACCOUNT_TABLE_WIDTH) << " | " << pretty_print("Rejects", ACCOUNT_TABLE_WIDTH) << " | " << pretty_print("Msgs/Batch", ACCOUNT_TABLE_WIDTH) << " | " << pretty_print("Queue Depth", ACCOUNT_TABLE_WIDTH) << " | " << pretty_print("Max Depth", ACCOUNT_TABLE_WIDTH) << " | " << pretty_print("Full Waits", ACCOUNT_TABLE_WIDTH) << " | " << pretty_print("Lost Reports", ACCOUNT_TABLE_WIDTH) << "\n";
+    for (size_t i = 0; i < engine.shards().size(); i++)
+    {
+        auto &shard = *engine.shards()[i];
+        auto &stats = engine.stats(shard);
+        auto backlog = engine.backlog(shard);
+        auto batches = std::max<uint64_t>(stats.batches.load(), 1);
+        out << pretty_print(engine.symbol(shard), ACCOUNT_TABLE_WIDTH) << " | " << pretty_print(rate(stats.orders.load(), previous.orders[i]), ACCOUNT_TABLE_WIDTH) << " | " << pretty_print(rate(stats.fills.load(), previous.fills[i]), ACCOUNT_TABLE_WIDTH) << " | " << pretty_print(rate(stats.cancels.load(), previous.cancels[i]), ACCOUNT_TABLE_WIDTH) << " | " << pretty_print(std::to_string(stats.rejects.load()), ACCOUNT_TABLE_WIDTH) << " | " << pretty_print(std::to_string(stats.messages.load() / batches), ACCOUNT_TABLE_WIDTH) << " | " << pretty_print(std::to_string(backlog.queue_depth), ACCOUNT_TABLE_WIDTH) << " | " << pretty_print(std::to_string(stats.max_queue_depth.load()), ACCOUNT_TABLE_WIDTH) << " | " << pretty_print(std::to_string(backlog.full_waits), ACCOUNT_TABLE_WIDTH) << " | " << pretty_print(std::to_string(backlog.lost_reports), ACCOUNT_TABLE_WIDTH) << "\n";
+    }
+
+    double scale = ns_per_cycle();
+    out << pretty_print("Stage (ns)", ACCOUNT_TABLE_WIDTH) << " | " << pretty_print("Count", ACCOUNT_TABLE_WIDTH) << " | " << pretty_print("p50", ACCOUNT_TABLE_WIDTH) << " | " << pretty_print("p99", ACCOUNT_TABLE_WIDTH) << " | " << pretty_print("p99.9", ACCOUNT_TABLE_WIDTH) << " | " << pretty_print("Max", ACCOUNT_TABLE_WIDTH) << "\n";
+    const std::pair<const char *, LatencyHistogram ShardStats::*> stages[] = {{"queue", &ShardStats::queue}, {"admission", &ShardStats::admission}, {"matching", &ShardStats::matching}, {"total", &ShardStats::total}};
+    for (auto &stage : stages)
+    {
+        std::vector<uint64_t> counts;
+        for (auto &shard : engine.shards())
+        {
+            (engine.stats(*shard).*stage.second).add_to(counts);
+        }
+        uint64_t count = 0;
+        for (auto bucket_count : counts)
+        {
+            count += bucket_count;
+        }
+        auto in_ns = [&counts, scale](double quantile)
+        { return std::to_string(std::llround(static_cast<double>(LatencyHistogram::value_at(counts, quantile)) * scale)); };
+        out << pretty_print(stage.first, ACCOUNT_TABLE_WIDTH) << " | " << pretty_print(std::to_string(count), ACCOUNT_TABLE_WIDTH) << " | " << pretty_print(in_ns(0.5), ACCOUNT_TABLE_WIDTH) << " | " << pretty_print(in_ns(0.99), ACCOUNT_TABLE_WIDTH) << " | " << pretty_print(in_ns(0.999), ACCOUNT_TABLE_WIDTH) << " | " << pretty_print(in_ns(1.0), ACCOUNT_TABLE_WIDTH) << "\n";
+    }
+}
+
+// dumps the stats to stderr every `interval_seconds` until `running` clears
+void stats_dump(int interval_seconds, const std::atomic<bool> &running)
+{
+    StatsTotals previous;
+    auto next = std::chrono::steady_clock::now() + std::chrono::seconds(interval_seconds);
+    while (running.load(std::memory_order_acquire))
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(STATS_POLL_MS));
+        if (std::chrono::steady_clock::now() >= next)
+        {
+            print_stats(std::cerr, previous);
+            next += std::chrono::seconds(interval_seconds);
+        }
+    }
+}
+
+// formatted from the published snapshots, so the matching threads carry on while the console is written
+void print_state(bool include_order_book)
+{
+    auto states = engine.read_state();
+    print_accounts(states);
+    if (include_order_book)
+    {
+        for (size_t i = 0; i < engine.shards().size(); i++)
+        {
+            print_order_book(*engine.shards()[i], *states[i]);
+        }
+    }
+}
+
+void command_router(std::vector<std::string> &input_tokens)
+{
+    if (input_tokens[0] == "account")
+    {
+        if (input_tokens.size() < 3)
+        {
+            std::cout << "Invalid arguments\n";
+            return;
+        }
+
+        if (input_tokens[2] == "create")
+        {
+            AccountId account_id;
+            if (register_account(input_tokens[1], account_id))
+            {
+                engine.broadcast(make_account_message(MessageType::open_account, account_id));
+            }
+            print_state(false);
+            return;
+        }
+
+        if (input_tokens[2] == "delete")
+        {
+            delete_account(input_tokens[1]);
+            print_state(false);
+            return;
+        }
+
+        AccountId account_id;
+        if (!find_account(input_tokens[1], account_id))
+        {
+            std::cout << "Account does not exist\n";
+            return;
+        }
+
+        if (input_tokens[2] == "query")
+        {
+            auto states = engine.read_state();
+            std::cout << "Account Name: " << input_tokens[1] << "\n";
+            Cash reserved_cash = 0;
+            for (auto &state : states)
+            {
+                reserved_cash += state->reserved_cash[account_id];
+            }
+            std::cout << "USD Balance: " << convert_cash_to_string(engine.balance(account_id)) << "\n";
+            std::cout << "USD Reserved: " << convert_cash_to_string(reserved_cash) << "\n";
+            for (size_t i = 0; i < engine.shards().size(); i++)
+            {
+                std::cout << coin_label(*engine.shards()[i]) << " Balance: " << convert_quantity_to_string(states[i]->coin_balances[account_id]) << "\n";
+                std::cout << coin_label(*engine.shards()[i]) << " Reserved: " << convert_quantity_to_string(states[i]->reserved_coin[account_id]) << "\n";
+            }
+        }
+        else if (input_tokens[2] == "fund")
+        {
+            if (input_tokens.size() < 4)
+            {
+                std::cout << "Invalid arguments\n";
+                return;
+            }
+            Cash funding_amount = usd_to_cash(convert_string_to_double(input_tokens[3]));
+            if (funding_amount <= 0)
+            {
+                std::cout << "Invalid amount\n";
+                return;
+            }
+            EngineReply reply;
+            engine.request(*engine.shards()[0], make_account_message(MessageType::fund, account_id, funding_amount, &reply), reply);
+        }
+        else if (input_tokens[2] == "withdraw")
+        {
+            if (input_tokens.size() < 4)
+            {
+                std::cout << "Invalid arguments\n";
+                return;
+            }
+            Cash withdraw_amount = usd_to_cash(convert_string_to_double(input_tokens[3]));
+            if (withdraw_amount <= 0)
+            {
+                std::cout << "Invalid amount\n";
+                return;
+            }
+            EngineReply reply;
+            engine.request(*engine.shards()[0], make_account_message(MessageType::withdraw, account_id, withdraw_amount, &reply), reply);
+            if (!reply.accepted)
+            {
+                std::cout << "Insufficient funds\n";
+                return;
+            }
+            std::cout << "Sending " << convert_cash_to_string(withdraw_amount) << " to " << input_tokens[1] << "'s linked bank account."
+                      << "\n";
+        }
+        else if (input_tokens[2] == "transactions")
+        {
+            if (input_tokens.size() < 4)
+            {
+                std::cout << "Invalid arguments\n";
+                return;
+            }
+            int num_transactions = convert_string_to_int(input_tokens[3]);
+            print_transactions(input_tokens[1], &account_id, num_transactions);
+        }
+        else
+        {
+            std::cout << "Invalid subcommand\n";
+        }
+    }
+    else if (input_tokens[0] == "order")
+    {
+        if (input_tokens.size() < 2)
+        {
+            std::cout << "Invalid arguments\n";
+            return;
+        }
+
+        if (input_tokens[1] == "cancel")
+        {
+            if (input_tokens.size() < 3)
+            {
+                std::cout << "Invalid arguments\n";
+                return;
+            }
+            if (input_tokens.size() == 3)
+            {
+                engine.submit_cancel(convert_string_to_order_id(input_tokens[2]));
+                return;
+            }
+            std::vector<OrderId> order_ids;
+            for (size_t i = 2; i < input_tokens.size(); i++)
+            {
+                order_ids.push_back(convert_string_to_order_id(input_tokens[i]));
+            }
+            engine.submit_cancels(order_ids);
+        }
+        else if (input_tokens[1] == "cancel-all")
+        {
+            if (input_tokens.size() < 3)
+            {
+                std::cout << "Invalid arguments\n";
+                return;
+            }
+            AccountId account_id;
+            if (!find_account(input_tokens[2], account_id))
+            {
+                std::cout << "Account does not exist\n";
+                return;
+            }
+            // the side and the symbol are both optional and may follow in either order
+            auto scope = CancelScope::all;
+            Shard *shard = nullptr;
+            for (size_t i = 3; i < input_tokens.size(); i++)
+            {
+                if (input_tokens[i] == "buy" || input_tokens[i] == "sell")
+                {
+                    scope = input_tokens[i] == "buy" ? CancelScope::buys : CancelScope::sells;
+                }
+                else if ((shard = engine.find_instrument(input_tokens[i])) == nullptr)
+                {
+                    std::cout << "Unknown symbol\n";
+                    return;
+                }
+            }
+            engine.submit_mass_cancel(account_id, scope, 0, shard);
+        }
+        else if (input_tokens[1] == "bulk")
+        {
+            // <buy/sell> <quantity> <price> for each order, then an optional symbol
+            if (input_tokens.size() < 6 || (input_tokens.size() - 3) % 3 > 1)
+            {
+                std::cout << "Invalid arguments\n";
+                return;
+            }
+            AccountId account_id;
+            if (!find_account(input_tokens[2], account_id))
+            {
+                std::cout << "Account does not exist\n";
+                return;
+            }
+            auto shard = (input_tokens.size() - 3) % 3 == 1 ? engine.find_instrument(input_tokens.back()) : engine.shards()[0].get();
+            if (shard == nullptr)
+            {
+                std::cout << "Unknown symbol\n";
+                return;
+            }
+            std::vector<OrderRequest> orders;
+            for (size_t i = 3; i + 2 < input_tokens.size(); i += 3)
+            {
+                auto side = input_tokens[i] == "buy" ? Side::buy : Side::sell;
+                orders.push_back(OrderRequest{account_id, side, quantity_to_lots(convert_string_to_double(input_tokens[i + 1])), price_to_ticks(convert_string_to_double(input_tokens[i + 2]))});
+            }
+            std::vector<OrderId> order_ids;
+            engine.submit_orders(*shard, orders, order_ids);
+        }
+        else if (input_tokens[1] == "amend")
+        {
+            if (input_tokens.size() < 5)
+            {
+                std::cout << "Invalid arguments\n";
+                return;
+            }
+            auto order_id = convert_string_to_order_id(input_tokens[2]);
+            auto quantity = quantity_to_lots(convert_string_to_double(input_tokens[3]));
+            auto price = price_to_ticks(convert_string_to_double(input_tokens[4]));
+            engine.submit_amend(order_id, quantity, price);
+        }
+        else if (input_tokens[1] == "create")
+        {
+            if (input_tokens.size() < 6)
+            {
+                std::cout << "Invalid arguments\n";
+                return;
+            }
+            AccountId account_id;
+            if (!find_account(input_tokens[2], account_id))
+            {
+                std::cout << "Account does not exist\n";
+                return;
+            }
+            // the symbol and the order type may follow in either order
+            auto symbol = engine.symbol(*engine.shards()[0]);
+            auto type = OrderType::limit;
+            for (size_t i = 6; i < input_tokens.size(); i++)
+            {
+                if (!parse_order_type(input_tokens[i], type))
+                {
+                    symbol = input_tokens[i];
+                }
+            }
+            auto shard = engine.find_instrument(symbol);
+            if (shard == nullptr)
+            {
+                std::cout << "Unknown symbol\n";
+                return;
+            }
+            auto side = input_tokens[3] == "buy" ? Side::buy : Side::sell;
+            auto quantity = quantity_to_lots(convert_string_to_double(input_tokens[4]));
+            auto price = price_to_ticks(convert_string_to_double(input_tokens[5]));
+
+            // create order
+            engine.submit_order(*shard, account_id, side, quantity, price, type);
+        }
+        else
+        {
+            std::cout << "Invalid subcommand\n";
+        }
+    }
+    else if (input_tokens[0] == "state")
+    {
+        print_state(true);
+    }
+    else if (input_tokens[0] == "auction")
+    {
+        if (input_tokens.size() < 2 || (input_tokens[1] != "start" && input_tokens[1] != "uncross"))
+        {
+            std::cout << "Invalid arguments\n";
+            return;
+        }
+        auto found = engine.find_instrument(input_tokens.size() > 2 ? input_tokens[2] : engine.symbol(*engine.shards()[0]));
+        if (found == nullptr)
+        {
+            std::cout << "Unknown symbol\n";
+            return;
+        }
+        auto &shard = *found;
+        EngineReply reply;
+        if (input_tokens[1] == "start")
+        {
+            engine.request(shard, make_auction_message(MessageType::auction_start, &reply), reply);
+            std::cout << "Matching suspended for " << engine.symbol(shard) << "\n";
+        }
+        else
+        {
+            engine.request(shard, make_auction_message(MessageType::auction_uncross, &reply), reply);
+            if (reply.auction_volume == 0)
+            {
+                std::cout << "Nothing to uncross, " << engine.symbol(shard) << " is matching again\n";
+            }
+            else
+            {
+                std::cout << "Uncrossed " << convert_quantity_to_string(reply.auction_volume) << " " << engine.symbol(shard) << " at " << convert_price_to_string(reply.auction_price) << "\n";
+            }
+        }
+    }
+    else if (input_tokens[0] == "stats")
+    {
+        static StatsTotals previous;
+        print_stats(std::cout, previous);
+    }
+    else if (input_tokens[0] == "depth")
+    {
+        auto shard = engine.find_instrument(input_tokens.size() > 1 ? input_tokens[1] : engine.symbol(*engine.shards()[0]));
+        if (shard == nullptr)
+        {
+            std::cout << "Unknown symbol\n";
+            return;
+        }
+        print_depth(*shard);
+    }
+    else if (input_tokens[0] == "transactions")
+    {
+        if (input_tokens.size() < 2)
+        {
+            std::cout << "Invalid arguments\n";
+            return;
+        }
+        int num_transactions = convert_string_to_int(input_tokens[1]);
+        print_transactions("", nullptr, num_transactions);
+    }
+    else
+    {
+        std::cout << "Invalid command\n";
+    }
+}
+
+// pins one of the command line's own threads, a core it cannot have is reported and the thread runs unpinned
+void pin_configured_thread(const ThreadConfig &thread, const char *name)
+{
+    if (thread.core >= 0 && !pin_current_thread(thread.core))
+    {
+        std::cerr << "Could not pin the " << name << " thread to core " << thread.core << "\n";
+    }
+}
+
+/*
+    Forwards one shard's market-data ring to a UDP multicast group, packing up
+    to MARKET_DATA_DATAGRAM_RECORDS records per datagram. It reads the ring like
+    any other consumer, so a slow network never reaches the matching thread.
+*/
+void market_data_bridge(const MarketDataRing &ring, sockaddr_in group, ThreadConfig thread, const std::atomic<bool> &running)
+{
+    pin_configured_thread(thread, "market data publisher");
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0)
+    {
+        std::cerr << "Could not open the market data socket\n";
+        return;
+    }
+    unsigned char ttl = 1;
+    setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+
+    MarketDataRecord datagram[MARKET_DATA_DATAGRAM_RECORDS];
+    uint64_t position = ring.published() + 1;
+    uint64_t lost = 0;
+    int idle_polls = 0;
+    while (true)
+    {
+        bool stopping = !running.load(std::memory_order_acquire);
+        size_t count = 0;
+        while (count < MARKET_DATA_DATAGRAM_RECORDS && ring.next(position, datagram[count], lost))
+        {
+            count++;
+        }
+        if (count > 0)
+        {
+            sendto(fd, datagram, count * sizeof(MarketDataRecord), 0, reinterpret_cast<const sockaddr *>(&group), sizeof(group));
+            idle_polls = 0;
+        }
+        else if (stopping)
+        {
+            break;
+        }
+        else
+        {
+            idle_wait(thread.wait, idle_polls, std::chrono::microseconds(MARKET_DATA_BRIDGE_IDLE_US));
+        }
+    }
+    close(fd);
+}
+
+bool parse_udp_address(const std::string &address, sockaddr_in &group)
+{
+    auto separator = address.rfind(':');
+    if (separator == std::string::npos)
+    {
+        return false;
+    }
+    std::string port = address.substr(separator + 1);
+    int port_number = convert_string_to_int(port);
+    group = sockaddr_in{};
+    group.sin_family = AF_INET;
+    group.sin_port = htons(static_cast<uint16_t>(port_number));
+    return port_number > 0 && port_number < 65536 && inet_pton(AF_INET, address.substr(0, separator).c_str(), &group.sin_addr) == 1;
+}
+
+/*
+    Order entry gateway. Clients connect over TCP and send length-prefixed
+    binary frames: a uint16_t length counting only what follows it, then one
+    of the Gateway* messages below, in host byte order with explicit padding.
+    Quantities are lots, prices are ticks and a symbol is its position in
+    --symbols. A connection first logs on to each account it trades, and an
+    account is held by one connection at a time; orders and mass cancels for
+    other accounts, and cancels and amends of orders another connection
+    entered, are refused. Each frame is acknowledged once it is on the
+    engine's queue, and what then happens to the connection's orders comes
+    back as execution reports. A connection's resting orders are cancelled
+    and its accounts released when it closes.
+*/
+enum class GatewayMessageType : uint8_t
+{
+    new_order = 1,
+    cancel = 2,
+    amend = 3,
+    mass_cancel = 4,
+    logon = 5,
+    ack = 101,
+    execution_report = 102
+};
+
+enum class GatewayStatus : uint8_t
+{
+    queued,
+    unknown_symbol,
+    unknown_order,
+    malformed,      // an unknown type or size, or a quantity or price out of range
+    not_logged_on,  // an account the connection has not logged on to
+    account_in_use  // an account another connection is logged on to
+};
+
+struct GatewayNewOrder
+{
+    GatewayMessageType type;
+    Side side;
+    uint16_t symbol;
+    AccountId account_id;
+    uint64_t client_order_id;
+    Quantity quantity;
+    Price price; // ignored for market orders
+    OrderType order_type;
+    uint8_t padding[7];
+};
+
+struct GatewayCancel
+{
+    GatewayMessageType type;
+    uint8_t padding[7];
+    uint64_t client_order_id;
+    OrderId order_id;
+};
+
+struct GatewayAmend
+{
+    GatewayMessageType type;
+    uint8_t padding[7];
+    uint64_t client_order_id;
+    OrderId order_id;
+    Quantity quantity;
+    Price price;
+};
+
+struct GatewayMassCancel
+{
+    GatewayMessageType type;
+    CancelScope scope;
+    uint16_t symbol; // GATEWAY_ALL_SYMBOLS for every symbol
+    AccountId account_id;
+    uint64_t client_order_id;
+};
+
+struct GatewayLogon
+{
+    GatewayMessageType type;
+    uint8_t padding[3];
+    AccountId account_id;
+    uint64_t client_order_id;
+};
+
+struct GatewayAck
+{
+    GatewayMessageType type;
+    GatewayStatus status;
+    uint8_t padding[6];
+    uint64_t client_order_id;
+    OrderId order_id; // the engine's id for a new order, 0 when it was not queued
+};
+
+struct GatewayExecutionReport
+{
+    GatewayMessageType type;
+    ReportType report;
+    RejectReason reason;
+    Side side;
+    uint32_t symbol;
+    OrderId order_id;
+    Quantity last_quantity;
+    Price last_price;
+    Quantity leaves_quantity;
+    uint64_t sequence; // per connection and symbol from 1, a gap means reports were dropped
+};
+
+static_assert(sizeof(GatewayNewOrder) == 40 && sizeof(GatewayCancel) == 24 && sizeof(GatewayAmend) == 40 && sizeof(GatewayMassCancel) == 16 && sizeof(GatewayLogon) == 16 && sizeof(GatewayAck) == 24 && sizeof(GatewayExecutionReport) == 48, "gateway messages are a wire format");
+
+#ifdef __linux__
+/*
+    Single-threaded epoll loop over every client connection. Each readable
+    connection gets one large read, every complete frame in it is decoded and
+    pushed onto the engine queues, consecutive new orders for one symbol as a
+    single run, and the acks they produced go back in one write; whatever the socket does not take is kept until it is writable.
+    Execution reports are handed over by the report output thread through a
+    ring and an eventfd that wakes the loop.
+*/
+class OrderGateway
+{
+public:
+    OrderGateway() : reports(GATEWAY_REPORT_CAPACITY) {}
+
+    OrderGateway(const OrderGateway &) = delete;
+    OrderGateway &operator=(const OrderGateway &) = delete;
+
+    ~OrderGateway()
+    {
+        for (auto &connection : connections)
+        {
+            close(connection.first);
+        }
+        if (listen_fd >= 0)
+        {
+            close(listen_fd);
+        }
+        if (epoll_fd >= 0)
+        {
+            close(epoll_fd);
+        }
+        if (report_fd >= 0)
+        {
+            close(report_fd);
+        }
+    }
+
+    // `address` is the IPv4 address to bind, false when it is not one or the port cannot be taken
+    bool listen(const std::string &address, uint16_t port)
+    {
+        listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        epoll_fd = epoll_create1(0);
+        report_fd = eventfd(0, EFD_NONBLOCK);
+        if (listen_fd < 0 || epoll_fd < 0 || report_fd < 0 || !watch(report_fd, EPOLLIN, EPOLL_CTL_ADD))
+        {
+            return false;
+        }
+        int reuse = 1;
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        sockaddr_in local{};
+        local.sin_family = AF_INET;
+        local.sin_port = htons(port);
+        if (inet_pton(AF_INET, address.c_str(), &local.sin_addr) != 1)
+        {
+            return false;
+        }
+        if (bind(listen_fd, reinterpret_cast<const sockaddr *>(&local), sizeof(local)) != 0 || ::listen(listen_fd, SOMAXCONN) != 0)
+        {
+            return false;
+        }
+        return watch(listen_fd, EPOLLIN, EPOLL_CTL_ADD);
+    }
+
+    // busy_spin polls epoll without ever sleeping in it, spin_then_park only once QUEUE_SPIN_LIMIT polls in a row found nothing
+    void run(ThreadConfig thread, const std::atomic<bool> &running)
+    {
+        pin_configured_thread(thread, "gateway");
+        epoll_event events[GATEWAY_MAX_EVENTS];
+        int idle_polls = 0;
+        while (running.load(std::memory_order_acquire))
+        {
+            bool polling = thread.wait == WaitStrategy::busy_spin || (thread.wait == WaitStrategy::spin_then_park && idle_polls < QUEUE_SPIN_LIMIT);
+            int count = epoll_wait(epoll_fd, events, GATEWAY_MAX_EVENTS, polling ? 0 : GATEWAY_POLL_MS);
+            idle_polls = count > 0 ? 0 : idle_polls + 1;
+            for (int i = 0; i < count; i++)
+            {
+                int fd = events[i].data.fd;
+                if (fd == listen_fd)
+                {
+                    accept_connections();
+                    continue;
+                }
+                if (fd == report_fd)
+                {
+                    send_reports();
+                    continue;
+                }
+
+                auto connection_it = connections.find(fd);
+                if (connection_it == connections.end())
+                {
+                    continue;
+                }
+                auto &connection = connection_it->second;
+                bool open = (events[i].events & (EPOLLHUP | EPOLLERR)) == 0;
+                if (open && (events[i].events & EPOLLIN) != 0)
+                {
+                    open = read_frames(fd, connection);
+                }
+                if (open)
+                {
+                    open = flush(fd, connection);
+                }
+                if (!open)
+                {
+                    close_connection(fd);
+                }
+            }
+        }
+    }
+
+    // called by the report output thread only, false when the report had to be dropped
+    bool deliver(const ExecutionReport &report) { return reports.try_push(ExecutionReport(report)); }
+
+    // wakes the loop once per delivered batch rather than once per report
+    void notify()
+    {
+        uint64_t one = 1;
+        if (write(report_fd, &one, sizeof(one)) < 0)
+        {
+            // the counter is already non-zero, the loop wakes anyway
+        }
+    }
+
+private:
+    struct Connection
+    {
+        uint32_t session;
+        std::vector<AccountId> accounts; // every account it is logged on to, its orders for them go on disconnect
+        std::vector<char> input;  // bytes of frames not yet complete
+        std::vector<char> output; // acks and reports not yet taken by the socket
+        bool waiting_to_write = false;
+    };
+
+    bool watch(int fd, uint32_t events, int operation)
+    {
+        epoll_event event{};
+        event.events = events;
+        event.data.fd = fd;
+        return epoll_ctl(epoll_fd, operation, fd, &event) == 0;
+    }
+
+    void accept_connections()
+    {
+        while (true)
+        {
+            int fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK);
+            if (fd < 0)
+            {
+                return;
+            }
+            int no_delay = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+            if (!watch(fd, EPOLLIN, EPOLL_CTL_ADD))
+            {
+                close(fd);
+                continue;
+            }
+            auto &connection = connections[fd];
+            connection.session = next_session++;
+            connection.input.reserve(GATEWAY_READ_SIZE);
+            session_fds[connection.session] = fd;
+        }
+    }
+
+    // the session's own resting orders go with it, orders other sessions entered for the same accounts stay
+    void close_connection(int fd)
+    {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+        close(fd);
+        auto &connection = connections[fd];
+        for (auto account_id : connection.accounts)
+        {
+            engine.submit_mass_cancel(account_id, CancelScope::session, connection.session);
+            account_sessions.erase(account_id);
+        }
+        session_fds.erase(connection.session);
+        connections.erase(fd);
+    }
+
+    // reports for sessions that have closed in the meantime are dropped
+    void send_reports()
+    {
+        uint64_t wakeups;
+        if (read(report_fd, &wakeups, sizeof(wakeups)) < 0)
+        {
+            // a spurious wakeup, the ring is drained either way
+        }
+
+        ExecutionReport report;
+        std::vector<int> touched;
+        while (reports.try_pop(report))
+        {
+            auto session_it = session_fds.find(report.session);
+            if (session_it == session_fds.end())
+            {
+                continue;
+            }
+            GatewayExecutionReport message{GatewayMessageType::execution_report, report.type, report.reason, report.side, report.shard, report.order_id, report.last_quantity, report.last_price, report.leaves_quantity, report.sequence};
+            append_frame(connections[session_it->second], message);
+            touched.push_back(session_it->second);
+        }
+
+        std::sort(touched.begin(), touched.end());
+        touched.erase(std::unique(touched.begin(), touched.end()), touched.end());
+        for (int fd : touched)
+        {
+            if (!flush(fd, connections[fd]))
+            {
+                close_connection(fd);
+            }
+        }
+    }
+
+    template <typename T>
+    static void append_frame(Connection &connection, const T &message)
+    {
+        uint16_t length = sizeof(message);
+        auto &output = connection.output;
+        output.insert(output.end(), reinterpret_cast<const char *>(&length), reinterpret_cast<const char *>(&length) + sizeof(length));
+        output.insert(output.end(), reinterpret_cast<const char *>(&message), reinterpret_cast<const char *>(&message) + sizeof(message));
+    }
+
+    // false once the peer has gone away
+    bool read_frames(int fd, Connection &connection)
+    {
+        size_t used = connection.input.size();
+        connection.input.resize(used + GATEWAY_READ_SIZE);
+        ssize_t received = read(fd, connection.input.data() + used, GATEWAY_READ_SIZE);
+        connection.input.resize(used + std::max<ssize_t>(received, 0));
+        if (received == 0 || (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+        {
+            return false;
+        }
+
+        size_t offset = 0;
+        while (connection.input.size() - offset >= sizeof(uint16_t))
+        {
+            uint16_t length;
+            std::memcpy(&length, connection.input.data() + offset, sizeof(length));
+            if (connection.input.size() - offset - sizeof(length) < length)
+            {
+                break;
+            }
+            handle_frame(connection, connection.input.data() + offset + sizeof(length), length);
+            offset += sizeof(length) + length;
+        }
+        submit_pending_orders(connection);
+        connection.input.erase(connection.input.begin(), connection.input.begin() + offset);
+        return true;
+    }
+
+    bool logged_on(const Connection &connection, AccountId account_id) const
+    {
+        auto it = account_sessions.find(account_id);
+        return it != account_sessions.end() && it->second == connection.session;
+    }
+
+    // market orders take their price from the book, every other order must have a notional the engine can hold
+    static bool valid_new_order(const GatewayNewOrder &message)
+    {
+        return (message.side == Side::buy || message.side == Side::sell) && message.order_type <= OrderType::post_only && (message.order_type == OrderType::market ? message.quantity > 0 : valid_order_size(message.quantity, message.price));
+    }
+
+    // a quantity of 0 cancels the order
+    static bool valid_amend(const GatewayAmend &message)
+    {
+        return message.quantity == 0 || valid_order_size(message.quantity, message.price);
+    }
+
+    void handle_frame(Connection &connection, const char *body, size_t length)
+    {
+        GatewayAck ack{GatewayMessageType::ack, GatewayStatus::malformed, {}, 0, 0};
+        auto type = length > 0 ? static_cast<GatewayMessageType>(body[0]) : GatewayMessageType::ack;
+        if (type == GatewayMessageType::new_order && length == sizeof(GatewayNewOrder))
+        {
+            GatewayNewOrder message;
+            std::memcpy(&message, body, sizeof(message));
+            ack.client_order_id = message.client_order_id;
+            if (message.symbol >= engine.shards().size())
+            {
+                ack.status = GatewayStatus::unknown_symbol;
+            }
+            else if (valid_new_order(message) && !logged_on(connection, message.account_id))
+            {
+                ack.status = GatewayStatus::not_logged_on;
+            }
+            else if (valid_new_order(message))
+            {
+                // acked once the run it joins is queued
+                if (pending_symbol != message.symbol)
+                {
+                    submit_pending_orders(connection);
+                    pending_symbol = message.symbol;
+                }
+                pending_orders.push_back(OrderRequest{message.account_id, message.side, message.quantity, message.price, message.order_type});
+                pending_client_ids.push_back(message.client_order_id);
+                return;
+            }
+        }
+        else if (type == GatewayMessageType::cancel && length == sizeof(GatewayCancel))
+        {
+            GatewayCancel message;
+            std::memcpy(&message, body, sizeof(message));
+            ack.client_order_id = message.client_order_id;
+            ack.status = engine.submit_cancel(message.order_id, connection.session) ? GatewayStatus::queued : GatewayStatus::unknown_order;
+        }
+        else if (type == GatewayMessageType::amend && length == sizeof(GatewayAmend))
+        {
+            GatewayAmend message;
+            std::memcpy(&message, body, sizeof(message));
+            ack.client_order_id = message.client_order_id;
+            if (valid_amend(message))
+            {
+                ack.status = engine.submit_amend(message.order_id, message.quantity, message.price, connection.session) ? GatewayStatus::queued : GatewayStatus::unknown_order;
+            }
+        }
+        else if (type == GatewayMessageType::mass_cancel && length == sizeof(GatewayMassCancel))
+        {
+            GatewayMassCancel message;
+            std::memcpy(&message, body, sizeof(message));
+            ack.client_order_id = message.client_order_id;
+            if (message.symbol != GATEWAY_ALL_SYMBOLS && message.symbol >= engine.shards().size())
+            {
+                ack.status = GatewayStatus::unknown_symbol;
+            }
+            else if (message.scope <= CancelScope::session && !logged_on(connection, message.account_id))
+            {
+                ack.status = GatewayStatus::not_logged_on;
+            }
+            else if (message.scope <= CancelScope::session)
+            {
+                auto shard = message.symbol == GATEWAY_ALL_SYMBOLS ? nullptr : engine.shards()[message.symbol].get();
+                engine.submit_mass_cancel(message.account_id, message.scope, connection.session, shard);
+                ack.status = GatewayStatus::queued;
+            }
+        }
+        else if (type == GatewayMessageType::logon && length == sizeof(GatewayLogon))
+        {
+            GatewayLogon message;
+            std::memcpy(&message, body, sizeof(message));
+            ack.client_order_id = message.client_order_id;
+            auto owner = account_sessions.emplace(message.account_id, connection.session);
+            if (owner.second)
+            {
+                connection.accounts.push_back(message.account_id);
+            }
+            ack.status = owner.first->second == connection.session ? GatewayStatus::queued : GatewayStatus::account_in_use;
+        }
+        // the new orders before this frame go first so the acks stay in frame order
+        submit_pending_orders(connection);
+        append_frame(connection, ack);
+    }
+
+    void submit_pending_orders(Connection &connection)
+    {
+        if (pending_orders.empty())
+        {
+            return;
+        }
+        engine.submit_orders(*engine.shards()[pending_symbol], pending_orders, pending_ids, connection.session);
+        for (size_t i = 0; i < pending_ids.size(); i++)
+        {
+            append_frame(connection, GatewayAck{GatewayMessageType::ack, GatewayStatus::queued, {}, pending_client_ids[i], pending_ids[i]});
+        }
+        pending_orders.clear();
+        pending_client_ids.clear();
+    }
+
+    // writes what the socket takes and waits for writability for the rest, false once the peer has gone away
+    bool flush(int fd, Connection &connection)
+    {
+        if (!connection.output.empty())
+        {
+            ssize_t sent = send(fd, connection.output.data(), connection.output.size(), MSG_NOSIGNAL);
+            if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                return false;
+            }
+            connection.output.erase(connection.output.begin(), connection.output.begin() + std::max<ssize_t>(sent, 0));
+        }
+
+        bool waiting_to_write = !connection.output.empty();
+        if (waiting_to_write != connection.waiting_to_write)
+        {
+            connection.waiting_to_write = waiting_to_write;
+            return watch(fd, waiting_to_write ? EPOLLIN | EPOLLOUT : EPOLLIN, EPOLL_CTL_MOD);
+        }
+        return true;
+    }
+
+    int listen_fd = -1;
+    int epoll_fd = -1;
+    int report_fd = -1;
+    std::unordered_map<int, Connection> connections;
+    std::unordered_map<uint32_t, int> session_fds; // session -> fd of the live connection
+    std::unordered_map<AccountId, uint32_t> account_sessions; // account -> session logged on to it
+    uint32_t next_session = 1;                     // 0 is the command line
+    std::vector<OrderRequest> pending_orders;      // new orders of the read being decoded, all for pending_symbol
+    std::vector<uint64_t> pending_client_ids;
+    std::vector<OrderId> pending_ids;
+    uint32_t pending_symbol = 0;
+    SpscRing<ExecutionReport> reports;
+};
+#else
+class OrderGateway;
+#endif
+
+void write_report(std::ostream &log, const ExecutionReport &report)
+{
+    log << report.timestamp << " " << engine.symbol(*engine.shards()[report.shard]) << " " << report.order_id << " " << report.account_id << " " << side_to_string(report.side) << " " << report_type_to_string(report.type);
+    if (report.reason != RejectReason::none)
+    {
+        log << " (" << reject_reason_to_string(report.reason) << ")";
+    }
+    if (report.type == ReportType::partially_filled || report.type == ReportType::filled)
+    {
+        log << " " << convert_quantity_to_string(report.last_quantity) << " @ " << convert_price_to_string(report.last_price);
+    }
+    log << " leaves " << convert_quantity_to_string(report.leaves_quantity) << "\n";
+}
+
+/*
+    Drains every shard's execution reports so the matching threads never
+    format or write anything themselves. Rejects of command-line orders are
+    printed, every report goes to the report log when there is one, and gateway
+    sessions get theirs as binary frames. After `running` clears it makes one
+    last pass, so it should be stopped once the matching threads have exited.
+*/
+void report_output(std::ostream *log, OrderGateway *gateway, ThreadConfig thread, const std::atomic<bool> &running)
+{
+    pin_configured_thread(thread, "report output");
+    std::vector<ExecutionReport> batch(REPORT_BATCH_SIZE);
+    int idle_polls = 0;
+    while (true)
+    {
+        bool stopping = !running.load(std::memory_order_acquire);
+        bool delivered = false;
+        size_t drained = 0;
+        for (auto &shard : engine.shards())
+        {
+            size_t count;
+            while ((count = engine.drain_reports(*shard, batch.data(), batch.size())) > 0)
+            {
+                drained += count;
+                for (size_t i = 0; i < count; i++)
+                {
+                    auto &report = batch[i];
+                    if (log != nullptr)
+                    {
+                        write_report(*log, report);
+                    }
+                    if (report.session == 0 && report.type == ReportType::rejected)
+                    {
+                        std::cout << "Order " << report.order_id << " rejected: " << reject_reason_to_string(report.reason) << "\n";
+                    }
+#ifdef __linux__
+                    if (report.session != 0 && gateway != nullptr)
+                    {
+                        // a full gateway ring loses the report like a full channel does, and it is counted the same
+                        if (gateway->deliver(report))
+                        {
+                            delivered = true;
+                        }
+                        else
+                        {
+                            engine.count_lost_report(*shard);
+                        }
+                    }
+#endif
+                }
+            }
+        }
+
+#ifdef __linux__
+        if (delivered)
+        {
+            gateway->notify();
+        }
+#endif
+        if (log != nullptr && drained > 0)
+        {
+            log->flush();
+        }
+        if (stopping)
+        {
+            break;
+        }
+        if (drained == 0)
+        {
+            idle_wait(thread.wait, idle_polls, std::chrono::microseconds(REPORT_OUTPUT_IDLE_US));
+        }
+        else
+        {
+            idle_polls = 0;
+        }
+    }
+    (void)gateway;
+}
+
+/*
+    Command Line Interface
+*/
+void commander()
+{
+    while (true)
+    {
+
+        std::string input;
+        std::vector<std::string> input_tokens;
+        std::cout << "Enter Command: ";
+        if (!getline(std::cin, input))
+        {
+            break;
+        }
+
+        parse_input(input, input_tokens);
+
+        if (input_tokens.size() == 0)
+        {
+            continue;
+        }
+
+        if (input_tokens[0] == "exit")
+        {
+            break;
+        }
+
+        command_router(input_tokens);
+    }
+}
+
+// update as you see fit
+void setup()
+{
+    // goes through the queues like any other input, so it is logged and replayed too
+    AccountId alice, bob, charlie;
+    register_account("alice", alice);
+    register_account("bob", bob);
+    register_account("charlie", charlie);
+    for (size_t i = 0; i < engine.shards().size(); i++)
+    {
+        auto &shard = *engine.shards()[i];
+        bool is_first = i == 0;
+        engine.submit(shard, make_account_message(MessageType::open_account, alice, is_first ? quantity_to_lots(43540) : 0));
+        engine.submit(shard, make_account_message(MessageType::open_account, bob, is_first ? quantity_to_lots(2000) : 0));
+        engine.submit(shard, make_account_message(MessageType::open_account, charlie, is_first ? quantity_to_lots(1000) : 0));
+    }
+
+    auto &shard = *engine.shards()[0];
+    engine.submit(shard, make_account_message(MessageType::fund, alice, usd_to_cash(6000)));
+    engine.submit(shard, make_account_message(MessageType::fund, bob, usd_to_cash(300)));
+    engine.submit(shard, make_account_message(MessageType::fund, charlie, usd_to_cash(1235)));
+    engine.submit_order(shard, alice, Side::buy, quantity_to_lots(1), price_to_ticks(20.50));
+    engine.submit_order(shard, bob, Side::buy, quantity_to_lots(10), price_to_ticks(22.50));
+    engine.submit_order(shard, charlie, Side::sell, quantity_to_lots(8), price_to_ticks(23.50));
+    engine.submit_order(shard, charlie, Side::sell, quantity_to_lots(8), price_to_ticks(25.50));
+}
+
+/*
+    Load generator, driven in place of the command line by --mode load. It
+    either replays the input logs recorded under a journal directory, merged
+    across shards by the time the engine first saw them, or generates flow of
+    its own: passive orders placed around the mid with Zipf-distributed
+    distance from it, cancels of random orders it placed earlier, and IOC
+    orders that take from the touch outwards. Everything goes through the
+    shard queues stamped like any other client message, so the stats at the
+    end time the same path the command line and the gateway take.
+*/
+struct LoadConfig
+{
+    bool enabled = false;
+    std::string input_dir; // replays the input logs recorded there instead of generating flow
+    int messages = LOAD_DEFAULT_MESSAGES;
+    int rate = 0; // messages per second, 0 for flat out
+    int accounts = LOAD_DEFAULT_ACCOUNTS;
+    int add_percentage = 40;
+    int cancel_percentage = 50; // the rest aggresses
+};
+
+struct LoadResult
+{
+    uint64_t sent = 0;
+    std::chrono::steady_clock::time_point start;
+};
+
+// "<add>,<cancel>,<aggress>" percentages that add up to 100
+bool parse_load_mix(const std::string &input, LoadConfig &config)
+{
+    std::vector<int> percentages;
+    std::stringstream mix(input);
+    std::string percentage;
+    while (std::getline(mix, percentage, ','))
+    {
+        if (percentage.empty() || percentage.find_first_not_of("0123456789") != std::string::npos)
+        {
+            return false;
+        }
+        percentages.push_back(convert_string_to_int(percentage));
+    }
+    if (percentages.size() != 3 || percentages[0] + percentages[1] + percentages[2] != 100)
+    {
+        return false;
+    }
+    config.add_percentage = percentages[0];
+    config.cancel_percentage = percentages[1];
+    return true;
+}
+
+// holds the generator back to `rate` messages per second from `start`
+void pace_load(const LoadConfig &config, const LoadResult &result)
+{
+    if (config.rate <= 0)
+    {
+        return;
+    }
+    auto due = result.start + std::chrono::nanoseconds(static_cast<int64_t>(result.sent) * NS_PER_SECOND / config.rate);
+    while (std::chrono::steady_clock::now() < due)
+    {
+        cpu_relax();
+    }
+}
+
+void replay_recorded_load(const LoadConfig &config, LoadResult &result)
+{
+    std::vector<std::unique_ptr<InputLog>> logs;
+    size_t recorded = 0;
+    for (auto &shard : engine.shards())
+    {
+        logs.push_back(std::make_unique<InputLog>());
+        if (!logs.back()->open(config.input_dir + "/" + engine.symbol(*shard) + ".input", FsyncPolicy::none))
+        {
+            std::cerr << "Could not open the recorded inputs for " << engine.symbol(*shard) << "\n";
+            return;
+        }
+        recorded += logs.back()->size() - logs.back()->first();
+    }
+    if (recorded == 0)
+    {
+        std::cerr << "Nothing to load\n";
+        return;
+    }
+
+    // inputs a later snapshot covered may have been released, each log starts from its oldest one left
+    std::vector<size_t> positions;
+    for (auto &log : logs)
+    {
+        positions.push_back(log->first());
+    }
+    result.start = std::chrono::steady_clock::now();
+    while (true)
+    {
+        // the shard whose next input the engine saw first
+        size_t next = engine.shards().size();
+        for (size_t i = 0; i < engine.shards().size(); i++)
+        {
+            if (positions[i] < logs[i]->size() && (next == engine.shards().size() || (*logs[i])[positions[i]].timestamp < (*logs[next])[positions[next]].timestamp))
+            {
+                next = i;
+            }
+        }
+        if (next == engine.shards().size())
+        {
+            break;
+        }
+
+        auto message = (*logs[next])[positions[next]++].message;
+        if (message.type == MessageType::new_order)
+        {
+            message.new_order.session = LOAD_SESSION;
+        }
+        else if (message.type == MessageType::cancel)
+        {
+            message.cancel.session = LOAD_SESSION;
+        }
+        else if (message.type == MessageType::amend)
+        {
+            message.amend.session = LOAD_SESSION;
+        }
+        pace_load(config, result);
+        message.enqueued = read_cycles();
+        engine.submit(*engine.shards()[next], message);
+        result.sent++;
+    }
+}
+
+void generate_synthetic_load(const LoadConfig &config, LoadResult &result)
+{
+    std::vector<AccountId> accounts;
+    for (int n = 0; n < config.accounts; n++)
+    {
+        AccountId account_id;
+        if (!register_account("load" + std::to_string(n), account_id))
+        {
+            std::cerr << "Could not register the load accounts\n";
+            return;
+        }
+        accounts.push_back(account_id);
+        for (auto &shard : engine.shards())
+        {
+            engine.submit(*shard, make_account_message(MessageType::open_account, account_id, quantity_to_lots(LOAD_ACCOUNT_COIN)));
+        }
+        engine.submit(*engine.shards()[0], make_account_message(MessageType::fund, account_id, usd_to_cash(LOAD_ACCOUNT_USD)));
+    }
+
+    std::mt19937_64 random(LOAD_SEED);
+    std::vector<double> weights;
+    for (int n = 0; n < LOAD_PRICE_LEVELS; n++)
+    {
+        weights.push_back(1.0 / std::pow(n + 1, LOAD_ZIPF_EXPONENT));
+    }
+    std::discrete_distribution<int> levels(weights.begin(), weights.end());
+    std::uniform_int_distribution<size_t> pick_shard(0, engine.shards().size() - 1);
+    std::uniform_int_distribution<size_t> pick_account(0, accounts.size() - 1);
+    std::uniform_int_distribution<int> pick_quantity(1, LOAD_MAX_QUANTITY);
+    std::uniform_int_distribution<int> percent(0, 99);
+    Price mid = price_to_ticks(LOAD_MID_PRICE);
+
+    // the orders placed on each shard that may still rest, cancels pick from them at random
+    std::vector<std::vector<OrderId>> placed(engine.shards().size());
+    result.start = std::chrono::steady_clock::now();
+    for (int n = 0; n < config.messages; n++)
+    {
+        auto shard_index = pick_shard(random);
+        auto &shard_placed = placed[shard_index];
+        int action = percent(random);
+        bool is_buy = random() % 2 == 0;
+        int level = levels(random);
+        pace_load(config, result);
+        if (action >= config.add_percentage && action < config.add_percentage + config.cancel_percentage && !shard_placed.empty())
+        {
+            size_t index = random() % shard_placed.size();
+            engine.submit_cancel(shard_placed[index], LOAD_SESSION);
+            shard_placed[index] = shard_placed.back();
+            shard_placed.pop_back();
+        }
+        else if (action >= config.add_percentage + config.cancel_percentage)
+        {
+            Price price = is_buy ? mid + level : mid - 1 - level;
+            engine.submit_order(*engine.shards()[shard_index], accounts[pick_account(random)], is_buy ? Side::buy : Side::sell, pick_quantity(random), price, OrderType::ioc, LOAD_SESSION);
+        }
+        else
+        {
+            Price price = is_buy ? mid - 1 - level : mid + level;
+            shard_placed.push_back(engine.submit_order(*engine.shards()[shard_index], accounts[pick_account(random)], is_buy ? Side::buy : Side::sell, pick_quantity(random), price, OrderType::limit, LOAD_SESSION));
+        }
+        result.sent++;
+    }
+}
+
+void generate_load(const LoadConfig &config, LoadResult &result)
+{
+    if (config.input_dir.empty())
+    {
+        generate_synthetic_load(config, result);
+    }
+    else
+    {
+        replay_recorded_load(config, result);
+    }
+}
+
+// throughput from the first message sent until the engines drained the last, then the stats over the run
+void print_load_result(const LoadResult &result, std::chrono::steady_clock::time_point end)
+{
+    double seconds = std::max(std::chrono::duration<double>(end - result.start).count(), 1e-9);
+    std::cout << "Sent " << result.sent << " messages in " << std::fixed << std::setprecision(3) << seconds << "s, " << std::llround(static_cast<double>(result.sent) / seconds) << " messages/s\n";
+    std::cout.unsetf(std::ios::fixed);
+    StatsTotals previous;
+    previous.time = result.start;
+    print_stats(std::cout, previous);
+}
+
+// a --thread option: cores for the threads of one kind in symbol order, the last one reused, and how they wait
+struct ThreadOption
+{
+    std::vector<int> cores; // empty leaves them unpinned
+    WaitStrategy wait = WaitStrategy::spin_then_park;
+};
+
+bool parse_wait_strategy(const std::string &input, WaitStrategy &wait)
+{
+    if (input == "busy-spin")
+    {
+        wait = WaitStrategy::busy_spin;
+    }
+    else if (input == "spin-then-park")
+    {
+        wait = WaitStrategy::spin_then_park;
+    }
+    else if (input == "block")
+    {
+        wait = WaitStrategy::block;
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+// "<threads>=[<core>,...][:<wait>]" for the matching, gateway, publisher or reports threads
+bool parse_thread_option(const std::string &input, std::map<std::string, ThreadOption> &options)
+{
+    auto equals = input.find('=');
+    if (equals == std::string::npos)
+    {
+        return false;
+    }
+    std::string threads = input.substr(0, equals);
+    if (threads != "matching" && threads != "gateway" && threads != "publisher" && threads != "reports")
+    {
+        return false;
+    }
+    ThreadOption option;
+    auto colon = input.find(':', equals);
+    if (colon != std::string::npos && !parse_wait_strategy(input.substr(colon + 1), option.wait))
+    {
+        return false;
+    }
+    std::stringstream core_list(input.substr(equals + 1, colon == std::string::npos ? std::string::npos : colon - equals - 1));
+    std::string core;
+    while (std::getline(core_list, core, ','))
+    {
+        // a core the process may not run on would only fail once the thread tries to pin itself
+        if (core.empty() || core.find_first_not_of("0123456789") != std::string::npos || !core_available(convert_string_to_int(core)))
+        {
+            return false;
+        }
+        option.cores.push_back(convert_string_to_int(core));
+    }
+    options[threads] = option;
+    return true;
+}
+
+// the `index`th thread of a kind, `fallback` when no --thread option names that kind
+ThreadConfig thread_config(const std::map<std::string, ThreadOption> &options, const std::string &threads, size_t index, ThreadConfig fallback)
+{
+    auto option = options.find(threads);
+    if (option == options.end())
+    {
+        return fallback;
+    }
+    auto &cores = option->second.cores;
+    return ThreadConfig{cores.empty() ? -1 : cores[std::min(index, cores.size() - 1)], option->second.wait};
+}
+
+int main(int argc, char *argv[])
+{
+    double tick_size = DEFAULT_TICK_SIZE;
+    double lot_size = DEFAULT_LOT_SIZE;
+    std::string symbols = DEFAULT_SYMBOL;
+    std::string journal_dir;
+    FsyncPolicy fsync_policy = FsyncPolicy::batch;
+    bool replay_only = false;
+    LoadConfig load;
+    std::string market_data_shm;
+    std::string market_data_udp;
+    int gateway_port = 0;
+    std::string gateway_address = "127.0.0.1"; // only local clients unless the operator opens it up
+    std::string report_log_path;
+    int stats_interval = 0;
+    std::map<std::string, ThreadOption> thread_options;
+    SelfTradePrevention self_trade_prevention = SelfTradePrevention::cancel_newest;
+    RiskLimits risk_limits;
+    double max_open_notional = 0;
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        std::string option = argv[i];
+        std::string value = argv[i + 1];
+        if (option == "--tick-size")
+        {
+            tick_size = convert_string_to_double(value);
+        }
+        else if (option == "--lot-size")
+        {
+            lot_size = convert_string_to_double(value);
+        }
+        else if (option == "--symbols")
+        {
+            symbols = value;
+        }
+        else if (option == "--journal-dir")
+        {
+            journal_dir = value;
+        }
+        else if (option == "--mode")
+        {
+            if (value == "live" || value == "replay" || value == "load")
+            {
+                replay_only = value == "replay";
+                load.enabled = value == "load";
+            }
+            else
+            {
+                std::cerr << "Invalid mode\n";
+                return 1;
+            }
+        }
+        else if (option == "--gateway-port")
+        {
+            gateway_port = convert_string_to_int(value);
+            if (gateway_port <= 0 || gateway_port > 65535)
+            {
+                std::cerr << "Invalid gateway port\n";
+                return 1;
+            }
+        }
+        else if (option == "--gateway-address")
+        {
+            gateway_address = value;
+        }
+        else if (option == "--max-open-orders")
+        {
+            risk_limits.max_open_orders = convert_string_to_int(value);
+        }
+        else if (option == "--max-open-notional")
+        {
+            max_open_notional = convert_string_to_double(value);
+        }
+        else if (option == "--max-message-rate")
+        {
+            risk_limits.max_messages_per_second = convert_string_to_int(value);
+        }
+        else if (option == "--load-from")
+        {
+            load.input_dir = value;
+        }
+        else if (option == "--load-messages")
+        {
+            load.messages = convert_string_to_int(value);
+        }
+        else if (option == "--load-rate")
+        {
+            load.rate = convert_string_to_int(value);
+        }
+        else if (option == "--load-accounts")
+        {
+            load.accounts = convert_string_to_int(value);
+            if (load.accounts <= 0)
+            {
+                std::cerr << "Invalid number of load accounts\n";
+                return 1;
+            }
+        }
+        else if (option == "--load-mix")
+        {
+            if (!parse_load_mix(value, load))
+            {
+                std::cerr << "Invalid load mix\n";
+                return 1;
+            }
+        }
+        else if (option == "--thread")
+        {
+            if (!parse_thread_option(value, thread_options))
+            {
+                std::cerr << "Invalid thread option\n";
+                return 1;
+            }
+        }
+        else if (option == "--stats-interval")
+        {
+            stats_interval = convert_string_to_int(value);
+        }
+        else if (option == "--report-log")
+        {
+            report_log_path = value;
+        }
+        else if (option == "--market-data-shm")
+        {
+            market_data_shm = value;
+        }
+        else if (option == "--market-data-udp")
+        {
+            market_data_udp = value;
+        }
+        else if (option == "--fsync")
+        {
+            if (value == "none")
+            {
+                fsync_policy = FsyncPolicy::none;
+            }
+            else if (value == "batch")
+            {
+                fsync_policy = FsyncPolicy::batch;
+            }
+            else if (value == "interval")
+            {
+                fsync_policy = FsyncPolicy::interval;
+            }
+            else
+            {
+                std::cerr << "Invalid fsync policy\n";
+                return 1;
+            }
+        }
+        else if (option == "--stp")
+        {
+            if (value == "cancel-newest")
+            {
+                self_trade_prevention = SelfTradePrevention::cancel_newest;
+            }
+            else if (value == "cancel-oldest")
+            {
+                self_trade_prevention = SelfTradePrevention::cancel_oldest;
+            }
+            else if (value == "decrement")
+            {
+                self_trade_prevention = SelfTradePrevention::decrement;
+            }
+            else
+            {
+                std::cerr << "Invalid self-trade prevention mode\n";
+                return 1;
+            }
+        }
+    }
+    if (!configure_fixed_point(tick_size, lot_size))
+    {
+        std::cerr << "Invalid tick or lot size\n";
+        return 1;
+    }
+
+    // by default core 0 is left to the command line and each matching thread gets its own core while the process has them
+    std::stringstream symbol_list(symbols);
+    std::string symbol;
+    while (std::getline(symbol_list, symbol, ','))
+    {
+        auto index = engine.shards().size();
+        ThreadConfig matching{core_available(static_cast<int>(index + 1)) ? static_cast<int>(index + 1) : -1, WaitStrategy::spin_then_park};
+        if (!engine.add_instrument(symbol, thread_config(thread_options, "matching", index, matching)))
+        {
+            std::cerr << "Invalid symbol list\n";
+            return 1;
+        }
+    }
+    if (engine.shards().empty())
+    {
+        std::cerr << "Invalid symbol list\n";
+        return 1;
+    }
+
+    risk_limits.max_open_notional = usd_to_cash(max_open_notional);
+    for (auto &shard : engine.shards())
+    {
+        if (!engine.open_journals(*shard, journal_dir, fsync_policy))
+        {
+            std::cerr << "Could not open the journals for " << engine.symbol(*shard) << "\n";
+            return 1;
+        }
+    }
+    engine.set_risk_controls(self_trade_prevention, risk_limits);
+
+    std::string account_log_path = journal_dir + "/accounts";
+    if (!journal_dir.empty() && load_accounts(account_log_path))
+    {
+        size_t replayed = 0;
+        for (auto &shard : engine.shards())
+        {
+            size_t shard_replayed = 0;
+            if (!engine.restore(*shard, account_names.size(), shard_replayed))
+            {
+                std::cerr << "Could not restore " << engine.symbol(*shard) << ": its input log starts after the last usable snapshot\n";
+                return 1;
+            }
+            replayed += shard_replayed;
+        }
+        std::cout << "Restored " << account_names.size() << " accounts and replayed " << replayed << " inputs\n";
+    }
+    else if (replay_only)
+    {
+        std::cerr << "Nothing to replay\n";
+        return 1;
+    }
+    if (!journal_dir.empty())
+    {
+        account_log.open(account_log_path, std::ios::app);
+    }
+    // a load run brings its own accounts and flow
+    if (account_names.empty() && !load.enabled)
+    {
+        setup();
+    }
+
+    if (replay_only)
+    {
+        engine.start();
+        print_state(true);
+        engine.stop();
+        return 0;
+    }
+
+    // the rings start after the restore, a replay's fills and levels were published by the run that made them
+    sockaddr_in market_data_group{};
+    if (!market_data_udp.empty() && !parse_udp_address(market_data_udp, market_data_group))
+    {
+        std::cerr << "Invalid market data address\n";
+        return 1;
+    }
+    if (!market_data_shm.empty() || !market_data_udp.empty())
+    {
+        for (auto &shard : engine.shards())
+        {
+            if (!engine.publish_market_data(*shard, market_data_shm.empty() ? "" : "/" + market_data_shm + "." + engine.symbol(*shard)))
+            {
+                std::cerr << "Could not create the market data ring for " << engine.symbol(*shard) << "\n";
+                return 1;
+            }
+        }
+    }
+    std::atomic<bool> market_data_running{true};
+    std::vector<std::thread> market_data_threads;
+    for (size_t i = 0; i < engine.shards().size(); i++)
+    {
+        if (!market_data_udp.empty())
+        {
+            market_data_threads.emplace_back(market_data_bridge, std::cref(engine.market_data_ring(*engine.shards()[i])), market_data_group, thread_config(thread_options, "publisher", i, ThreadConfig{-1, WaitStrategy::block}), std::cref(market_data_running));
+        }
+    }
+
+    std::atomic<bool> gateway_running{true};
+    std::thread gateway_thread;
+    OrderGateway *report_gateway = nullptr;
+#ifdef __linux__
+    OrderGateway gateway;
+    if (gateway_port != 0)
+    {
+        if (!gateway.listen(gateway_address, static_cast<uint16_t>(gateway_port)))
+        {
+            std::cerr << "Could not listen on " << gateway_address << ":" << gateway_port << "\n";
+            return 1;
+        }
+        report_gateway = &gateway;
+        gateway_thread = std::thread(&OrderGateway::run, &gateway, thread_config(thread_options, "gateway", 0, ThreadConfig{-1, WaitStrategy::block}), std::cref(gateway_running));
+    }
+#else
+    if (gateway_port != 0)
+    {
+        std::cerr << "The gateway needs epoll\n";
+        return 1;
+    }
+#endif
+
+    std::ofstream report_log;
+    if (!report_log_path.empty())
+    {
+        report_log.open(report_log_path, std::ios::app);
+        if (!report_log)
+        {
+            std::cerr << "Could not open the report log\n";
+            return 1;
+        }
+    }
+    std::atomic<bool> report_running{true};
+    std::thread report_thread(report_output, report_log.is_open() ? &report_log : nullptr, report_gateway, thread_config(thread_options, "reports", 0, ThreadConfig{-1, WaitStrategy::block}), std::cref(report_running));
+    std::atomic<bool> stats_running{true};
+    std::thread stats_thread;
+    if (stats_interval > 0)
+    {
+        stats_thread = std::thread(stats_dump, stats_interval, std::cref(stats_running));
+    }
+
+    LoadResult load_result;
+    std::thread commander_thread = load.enabled ? std::thread(generate_load, std::cref(load), std::ref(load_result)) : std::thread(commander);
+    engine.start();
+
+    commander_thread.join();
+    gateway_running.store(false, std::memory_order_release);
+    if (gateway_thread.joinable())
+    {
+        gateway_thread.join();
+    }
+    // every client has stopped, so nothing reaches the queues after this
+    engine.stop();
+    auto engines_done = std::chrono::steady_clock::now();
+    report_running.store(false, std::memory_order_release);
+    report_thread.join();
+    stats_running.store(false, std::memory_order_release);
+    if (stats_thread.joinable())
+    {
+        stats_thread.join();
+    }
+    for (auto &shard : engine.shards())
+    {
+        auto lost_reports = engine.backlog(*shard).lost_reports;
+        if (lost_reports > 0)
+        {
+            std::cerr << "Dropped " << lost_reports << " execution reports for " << engine.symbol(*shard) << "\n";
+        }
+    }
+    market_data_running.store(false, std::memory_order_release);
+    for (auto &market_data_thread : market_data_threads)
+    {
+        market_data_thread.join();
+    }
+    if (load.enabled && load_result.sent > 0)
+    {
+        print_load_result(load_result, engines_done);
+    }
+
+    return 0;
+}
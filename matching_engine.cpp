@@ -4,64 +4,168 @@
     Description : A simple C++ Matching Engine
 */
 
-#include <iostream>
-#include <sstream>
-#include <string>
-#include <map>
-#include <set>
-#include <vector>
-#include <algorithm>
-#include <thread>
-#include <mutex>
-#include <condition_variable>
-#include <queue>
-#include <chrono>
+#include "shard.h"
 
-const int ACCOUNT_TABLE_WIDTH = 16;
-const int ORDER_TABLE_WIDTH = 24;
+Message make_new_order_message(const Order &order)
+{
+    Message message{};
+    message.type = MessageType::new_order;
+    message.new_order = order;
+    return message;
+}
+
+Message make_cancel_message(OrderId order_id, uint32_t session)
+{
+    Message message{};
+    message.type = MessageType::cancel;
+    message.cancel = CancelMessage{order_id, session};
+    return message;
+}
+
+Message make_amend_message(OrderId order_id, Quantity quantity, Price price, uint32_t session)
+{
+    Message message{};
+    message.type = MessageType::amend;
+    message.amend = AmendMessage{order_id, quantity, price, session};
+    return message;
+}
+
+Message make_mass_cancel_message(AccountId account_id, CancelScope scope, uint32_t session)
+{
+    Message message{};
+    message.type = MessageType::mass_cancel;
+    message.mass_cancel = MassCancelMessage{account_id, scope, session};
+    return message;
+}
+
+Message make_account_message(MessageType type, AccountId account_id, int64_t amount, EngineReply *reply)
+{
+    Message message{};
+    message.type = type;
+    message.account = AccountMessage{account_id, amount, reply};
+    return message;
+}
 
-struct Transaction
+Message make_query_message(MessageType type, EngineReply *reply, AccountId account_id)
 {
-    int id;
-    int quantity;
-    double price;
-    int timestamp;
-    std::string buyer;
-    std::string seller;
-    std::string aggressor;
-};
+    Message message{};
+    message.type = type;
+    message.query = QueryMessage{reply, account_id};
+    return message;
+}
 
-struct Account_Details
+Message make_market_data_message(MessageType type, MarketDataFeed *feed)
 {
-    double usd_balance;
-    int coin_balance;
-};
+    Message message{};
+    message.type = type;
+    message.market_data = MarketDataMessage{feed};
+    return message;
+}
 
-struct Order
+Message make_auction_message(MessageType type, EngineReply *reply)
 {
-    int id;
-    std::string account_name;
-    bool is_buy;
-    int quantity;
-    double price;
-    int timestamp;
-};
+    Message message{};
+    message.type = type;
+    message.auction = AuctionMessage{reply};
+    return message;
+}
+
+Message make_control_message(MessageType type)
+{
+    Message message{};
+    message.type = type;
+    return message;
+}
 
-struct OrderComparator
+// the messages that go into the input log
+bool is_logged_message(MessageType type)
 {
-    bool operator()(const Order &a, const Order &b) const
+    switch (type)
     {
-        return a.is_buy ? a.price > b.price || (a.price == b.price && a.timestamp < b.timestamp) : a.price < b.price || (a.price == b.price && a.timestamp < b.timestamp);
+    case MessageType::new_order:
+    case MessageType::cancel:
+    case MessageType::amend:
+    case MessageType::open_account:
+    case MessageType::fund:
+    case MessageType::withdraw:
+    case MessageType::auction_start:
+    case MessageType::auction_uncross:
+    case MessageType::mass_cancel:
+        return true;
+    default:
+        return false;
     }
-};
+}
 
-using MessageQueueData = std::variant<Order, std::string>;
+const char *side_to_string(const Side side)
+{
+    return side == Side::buy ? "buy" : "sell";
+}
 
-std::string convert_dbl_to_string(const double input)
+bool parse_order_type(const std::string &input, OrderType &type)
 {
-    std::ostringstream strs;
-    strs << input;
-    return strs.str();
+    static const std::map<std::string, OrderType> types = {{"limit", OrderType::limit}, {"market", OrderType::market}, {"ioc", OrderType::ioc}, {"fok", OrderType::fok}, {"post-only", OrderType::post_only}};
+    auto it = types.find(input);
+    if (it == types.end())
+    {
+        return false;
+    }
+    type = it->second;
+    return true;
+}
+
+const char *report_type_to_string(const ReportType type)
+{
+    switch (type)
+    {
+    case ReportType::accepted:
+        return "accepted";
+    case ReportType::rejected:
+        return "rejected";
+    case ReportType::partially_filled:
+        return "partially filled";
+    case ReportType::filled:
+        return "filled";
+    case ReportType::cancelled:
+        return "cancelled";
+    }
+    return "unknown";
+}
+
+const char *reject_reason_to_string(const RejectReason reason)
+{
+    switch (reason)
+    {
+    case RejectReason::none:
+        return "none";
+    case RejectReason::unknown_account:
+        return "unknown account";
+    case RejectReason::insufficient_funds:
+        return "insufficient funds";
+    case RejectReason::insufficient_coin:
+        return "insufficient coin";
+    case RejectReason::self_trade:
+        return "self trade";
+    case RejectReason::unknown_order:
+        return "unknown order";
+    case RejectReason::no_liquidity:
+        return "no liquidity";
+    case RejectReason::would_not_fill:
+        return "would not fill";
+    case RejectReason::would_cross:
+        return "would cross";
+    case RejectReason::auction_in_progress:
+        return "auction in progress";
+    case RejectReason::too_many_orders:
+        return "too many open orders";
+    case RejectReason::notional_limit:
+        return "notional limit";
+    case RejectReason::rate_limited:
+        return "rate limited";
+    case RejectReason::invalid_order:
+        return "invalid quantity or price";
+    }
+    return "unknown";
 }
 
 std::string convert_int_to_string(const int input)
@@ -94,6 +198,29 @@ int convert_string_to_int(std::string &input)
     return 0;
 }
 
+OrderId convert_string_to_order_id(std::string &input)
+{
+    if (input.find_first_not_of("0123456789") != std::string::npos)
+    {
+        std::cerr << "Invalid input: non-numeric characters found" << std::endl;
+        return 0;
+    }
+
+    try
+    {
+        return std::stoll(input);
+    }
+    catch (const std::invalid_argument &ia)
+    {
+        return 0;
+    }
+    catch (const std::out_of_range &oor)
+    {
+        return 0;
+    }
+    return 0;
+}
+
 double convert_string_to_double(std::string &input)
 {
     if (input.find_first_not_of("0123456789.-") != std::string::npos)
@@ -117,563 +244,1024 @@ double convert_string_to_double(std::string &input)
     return 0;
 }
 
-int get_epoch_ms()
+FixedPointConfig fixed_point;
+
+// the tick and lot sizes must make the notional of one lot at one tick a whole number of cash units
+bool configure_fixed_point(const double tick_size, const double lot_size)
+{
+    double cash_per_tick_lot = tick_size * lot_size * CASH_SCALE;
+    if (tick_size <= 0 || lot_size <= 0 || cash_per_tick_lot < 1 || std::abs(cash_per_tick_lot - std::round(cash_per_tick_lot)) > 1e-9)
+    {
+        return false;
+    }
+    fixed_point.tick_size = tick_size;
+    fixed_point.lot_size = lot_size;
+    fixed_point.cash_per_tick_lot = std::llround(cash_per_tick_lot);
+    return true;
+}
+
+Price price_to_ticks(const double price)
+{
+    return std::llround(price / fixed_point.tick_size);
+}
+
+Quantity quantity_to_lots(const double quantity)
+{
+    return std::llround(quantity / fixed_point.lot_size);
+}
+
+Cash usd_to_cash(const double usd)
+{
+    return std::llround(usd * CASH_SCALE);
+}
+
+std::string convert_fixed_to_string(const int64_t units, const double unit_size)
+{
+    std::ostringstream strs;
+    strs << std::setprecision(15) << units * unit_size;
+    return strs.str();
+}
+
+std::string convert_price_to_string(const Price price)
+{
+    return convert_fixed_to_string(price, fixed_point.tick_size);
+}
+
+std::string convert_quantity_to_string(const Quantity quantity)
+{
+    return convert_fixed_to_string(quantity, fixed_point.lot_size);
+}
+
+std::string convert_cash_to_string(const Cash cash)
+{
+    return convert_fixed_to_string(cash, 1.0 / CASH_SCALE);
+}
+
+const auto CLOCK_WALL_ANCHOR = std::chrono::system_clock::now().time_since_epoch();
+const std::chrono::steady_clock::time_point CLOCK_STEADY_ANCHOR = std::chrono::steady_clock::now();
+
+/*
+    The engine clock: the monotonic clock anchored to the wall clock once at
+    startup, so it never steps back and is read through the vDSO rather than a
+    system call. The matching threads sample it once per batch; time priority
+    itself comes from order ids, which are issued in sequence.
+*/
+Timestamp get_timestamp_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(CLOCK_WALL_ANCHOR + (std::chrono::steady_clock::now() - CLOCK_STEADY_ANCHOR)).count();
+}
+
+// a raw cycle count for timing intervals on the hot path, the TSC where there is one
+uint64_t read_cycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+const uint64_t CYCLES_ANCHOR = read_cycles();
+
+// calibrated against the monotonic clock over the whole uptime, so it only gets better
+double ns_per_cycle()
+{
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - CLOCK_STEADY_ANCHOR).count();
+    auto cycles = read_cycles() - CYCLES_ANCHOR;
+    return cycles == 0 ? 1.0 : static_cast<double>(elapsed) / static_cast<double>(cycles);
+}
+
+// UTC time of day to the microsecond
+std::string convert_timestamp_to_string(const Timestamp timestamp)
+{
+    Timestamp micros = timestamp / 1000;
+    Timestamp seconds = micros / 1000000;
+    char buffer[32];
+    std::snprintf(buffer, sizeof(buffer), "%02d:%02d:%02d.%06d", static_cast<int>(seconds / 3600 % 24), static_cast<int>(seconds / 60 % 60), static_cast<int>(seconds % 60), static_cast<int>(micros % 1000000));
+    return buffer;
+}
+
+MatchingEngine::MatchingEngine(size_t max_accounts) : cash_ledger(max_accounts) {}
+
+MatchingEngine::~MatchingEngine()
 {
-    return static_cast<int>(std::chrono::time_point_cast<std::chrono::milliseconds>(std::chrono::system_clock::now()).time_since_epoch().count());
+    stop();
 }
 
-std::string pretty_print(std::string input, int width)
+bool MatchingEngine::add_instrument(const std::string &symbol, ThreadConfig matching)
 {
-    std::string white_space = "";
-    auto extra_spaces = width - input.length();
-    if (extra_spaces > 0)
+    if (symbol.empty() || instruments.size() >= MAX_SHARDS || instrument_shards.count(symbol) > 0 || !threads.empty())
     {
-        for (int i = 0; i < extra_spaces / 2; i++)
-        {
-            white_space += " ";
-        }
+        return false;
+    }
+    auto index = static_cast<uint32_t>(instruments.size());
+    std::unique_ptr<Shard> shard;
+    if (!run_on_core(matching.core, [&]()
+                     { shard = std::make_unique<Shard>(index, symbol, cash_ledger, matching.wait); }))
+    {
+        std::cerr << "Could not pin to core " << matching.core << ", " << symbol << " is allocated off its matching core\n";
     }
-    return (extra_spaces % 2 != 0 ? " " : "") + white_space + input + white_space;
+    shard->core = matching.core;
+    instruments.push_back(std::move(shard));
+    instrument_shards.emplace(symbol, index);
+    return true;
+}
+
+Shard *MatchingEngine::find_instrument(const std::string &symbol) const
+{
+    auto shard_it = instrument_shards.find(symbol);
+    return shard_it == instrument_shards.end() ? nullptr : instruments[shard_it->second].get();
+}
+
+Shard *MatchingEngine::find_order_shard(OrderId order_id) const
+{
+    auto index = static_cast<uint64_t>(order_id) >> ORDER_ID_SHARD_SHIFT;
+    return index < instruments.size() ? instruments[index].get() : nullptr;
 }
 
-class MessageQueue
+const std::string &MatchingEngine::symbol(const Shard &shard) const
 {
-public:
-    void push(const MessageQueueData &data)
+    return shard.symbol;
+}
+
+const ShardStats &MatchingEngine::stats(const Shard &shard) const
+{
+    return shard.stats;
+}
+
+ShardBacklog MatchingEngine::backlog(const Shard &shard) const
+{
+    ShardBacklog backlog;
+    backlog.queue_depth = shard.message_queue.size();
+    backlog.full_waits = shard.message_queue.full_wait_count();
+    backlog.lost_reports = shard.reports.dropped_count();
+    return backlog;
+}
+
+DepthSnapshot MatchingEngine::depth(const Shard &shard) const
+{
+    return shard.market_data.depth();
+}
+
+const Transaction &MatchingEngine::transaction(const Shard &shard, size_t position) const
+{
+    return shard.journal[position];
+}
+
+bool MatchingEngine::open_journals(Shard &shard, const std::string &journal_dir, FsyncPolicy fsync_policy)
+{
+    std::string path_prefix = journal_dir.empty() ? "" : journal_dir + "/" + shard.symbol;
+    bool opened = false;
+    // a core the shard cannot be pinned to was already reported when it was added
+    run_on_core(shard.core, [&]()
+                { opened = shard.journal.open(path_prefix, fsync_policy) && shard.input_log.open(journal_dir.empty() ? "" : path_prefix + ".input", fsync_policy); });
+    shard.snapshot_path = journal_dir.empty() ? "" : path_prefix + ".snapshot";
+    return opened;
+}
+
+void MatchingEngine::set_risk_controls(SelfTradePrevention self_trade_prevention, const RiskLimits &risk_limits)
+{
+    for (auto &shard : instruments)
     {
-        {
-            std::lock_guard<std::mutex> lock(message_queue_mutex);
-            message_queue.push(data);
-        }
-        message_available.notify_one();
+        shard->order_book.set_self_trade_prevention(self_trade_prevention);
+        shard->order_book.set_risk_limits(risk_limits);
     }
+}
+
+bool MatchingEngine::restore(Shard &shard, size_t account_count, size_t &replayed)
+{
+    bool restored = false;
+    // on the shard's own core, the restored book and balances are first touched there
+    run_on_core(shard.core, [&]()
+                {
+                    restored = restore_shard(shard, replayed);
+                    if (!restored)
+                    {
+                        return;
+                    }
+                    // an account registered just before a crash may not have reached every shard
+                    for (auto account_id = static_cast<AccountId>(shard.coin_balances.size()); account_id < account_count; account_id++)
+                    {
+                        open_account(shard, account_id, 0);
+                    }
+                });
+    return restored;
+}
+
+bool MatchingEngine::publish_market_data(Shard &shard, const std::string &shm_name)
+{
+    if (!shard.market_data_ring.create(shm_name, MARKET_DATA_RING_CAPACITY))
+    {
+        return false;
+    }
+    // fills already in the journal were published by the run that made them
+    shard.market_data.attach_ring(&shard.market_data_ring, shard.journal.size());
+    return true;
+}
+
+const MarketDataRing &MatchingEngine::market_data_ring(const Shard &shard) const
+{
+    return shard.market_data_ring;
+}
+
+void MatchingEngine::start()
+{
+    for (auto &shard : instruments)
+    {
+        threads.emplace_back(matching_engine, std::ref(*shard));
+    }
+}
 
-    MessageQueueData pop()
+void MatchingEngine::stop()
+{
+    if (threads.empty())
+    {
+        return;
+    }
+    broadcast(make_control_message(MessageType::shutdown));
+    for (auto &thread : threads)
     {
-        std::unique_lock<std::mutex> lock(message_queue_mutex);
-        message_available.wait(lock, [this]()
-                               { return !message_queue.empty(); });
-        MessageQueueData data = message_queue.front();
-        message_queue.pop();
-        return data;
+        thread.join();
     }
+    threads.clear();
+}
 
-    bool empty() const
+void MatchingEngine::broadcast(const Message &message)
+{
+    for (auto &shard : instruments)
     {
-        std::lock_guard<std::mutex> lock(message_queue_mutex);
-        return message_queue.empty();
+        shard->message_queue.push(message);
     }
+}
 
-    void notify() { message_available.notify_one(); }
+void MatchingEngine::submit(Shard &shard, const Message &message)
+{
+    shard.message_queue.push(message);
+}
+
+OrderId MatchingEngine::submit_order(Shard &shard, AccountId account_id, Side side, Quantity quantity, Price price, OrderType type, uint32_t session)
+{
+    auto order = shard.order_book.construct_order(account_id, side, quantity, price, 0, type);
+    order.session = session;
+    auto message = make_new_order_message(order);
+    message.enqueued = read_cycles();
+    shard.message_queue.push(message);
+    return order.id;
+}
+
+bool MatchingEngine::submit_cancel(OrderId order_id, uint32_t session)
+{
+    auto shard = find_order_shard(order_id);
+    if (order_id == 0 || shard == nullptr)
+    {
+        return false;
+    }
+    auto message = make_cancel_message(order_id, session);
+    message.enqueued = read_cycles();
+    shard->message_queue.push(message);
+    return true;
+}
 
-private:
-    std::queue<MessageQueueData> message_queue;
-    std::condition_variable message_available;
-    mutable std::mutex message_queue_mutex;
-};
+bool MatchingEngine::submit_amend(OrderId order_id, Quantity quantity, Price price, uint32_t session)
+{
+    auto shard = find_order_shard(order_id);
+    if (order_id == 0 || shard == nullptr)
+    {
+        return false;
+    }
+    auto message = make_amend_message(order_id, quantity, price, session);
+    message.enqueued = read_cycles();
+    shard->message_queue.push(message);
+    return true;
+}
 
-class OrderBook
+void MatchingEngine::submit_orders(Shard &shard, const std::vector<OrderRequest> &orders, std::vector<OrderId> &order_ids, uint32_t session)
 {
-public:
-    void add_order(Order &order)
+    std::vector<Message> messages;
+    messages.reserve(orders.size());
+    order_ids.clear();
+    auto enqueued = read_cycles();
+    for (auto &request : orders)
     {
-        std::lock_guard<std::mutex> order_book_lock(order_book_mutex);
-        order_book[order.is_buy ? "buy" : "sell"].emplace(order);
+        auto order = shard.order_book.construct_order(request.account_id, request.side, request.quantity, request.price, 0, request.type);
+        order.session = session;
+        messages.push_back(make_new_order_message(order));
+        messages.back().enqueued = enqueued;
+        order_ids.push_back(order.id);
     }
+    shard.message_queue.push_batch(messages.data(), messages.size());
+}
 
-    void remove_order(const int &order_id)
+size_t MatchingEngine::submit_cancels(const std::vector<OrderId> &order_ids, uint32_t session)
+{
+    std::vector<std::vector<Message>> runs(instruments.size());
+    size_t queued = 0;
+    auto enqueued = read_cycles();
+    for (auto order_id : order_ids)
     {
-        if (order_id == 0)
+        auto shard = find_order_shard(order_id);
+        if (order_id == 0 || shard == nullptr)
         {
-            return;
+            continue;
         }
-        std::lock_guard<std::mutex> lock(order_book_mutex);
-        auto &order_book_side = order_book[order_id < 0 ? "buy" : "sell"];
-        auto order_it = std::find_if(order_book_side.begin(), order_book_side.end(),
-                                     [order_id](const Order &o)
-                                     { return o.id == order_id; });
-        if (order_it != order_book_side.end())
+        runs[shard->index].push_back(make_cancel_message(order_id, session));
+        runs[shard->index].back().enqueued = enqueued;
+        queued++;
+    }
+    for (size_t i = 0; i < runs.size(); i++)
+    {
+        if (!runs[i].empty())
         {
-            order_book_side.erase(order_it);
+            instruments[i]->message_queue.push_batch(runs[i].data(), runs[i].size());
         }
     }
+    return queued;
+}
 
-    void settle_accounts(std::string buyer, std::string seller, int quantity, double price, std::string aggressor, std::map<std::string, Account_Details> &accounts, std::mutex &accounts_mutex, std::vector<Transaction> &transactions, std::mutex &transactions_mutex)
+void MatchingEngine::submit_mass_cancel(AccountId account_id, CancelScope scope, uint32_t session, Shard *shard)
+{
+    auto message = make_mass_cancel_message(account_id, scope, session);
+    if (shard != nullptr)
     {
-        std::lock_guard<std::mutex> accounts_lock(accounts_mutex);
-        std::lock_guard<std::mutex> transactions_lock(transactions_mutex);
+        shard->message_queue.push(message);
+        return;
+    }
+    broadcast(message);
+}
 
-        accounts[buyer].coin_balance += quantity;
-        accounts[buyer].usd_balance -= quantity * price;
-        accounts[seller].coin_balance -= quantity;
-        accounts[seller].usd_balance += quantity * price;
+void MatchingEngine::request(Shard &shard, const Message &message, EngineReply &reply)
+{
+    auto ready = reply.ready.get_future();
+    shard.message_queue.push(message);
+    ready.wait();
+}
 
-        Transaction transaction = {static_cast<int>(transactions.size()) + 1, quantity, price, get_epoch_ms(), buyer, seller, aggressor};
-        transactions.push_back(transaction);
+std::vector<EngineReply> MatchingEngine::request_all(MessageType type, AccountId account_id)
+{
+    std::vector<EngineReply> replies(instruments.size());
+    std::vector<std::future<void>> ready;
+    for (size_t i = 0; i < instruments.size(); i++)
+    {
+        ready.push_back(replies[i].ready.get_future());
+        instruments[i]->message_queue.push(make_query_message(type, &replies[i], account_id));
     }
-
-    void match_order(Order &order, std::map<std::string, Account_Details> &accounts, std::mutex &accounts_mutex, std::vector<Transaction> &transactions, std::mutex &transactions_mutex)
+    for (auto &shard_ready : ready)
     {
-        std::lock_guard<std::mutex> order_book_lock(order_book_mutex);
-        auto &order_book_side = order_book[order.is_buy ? "sell" : "buy"];
-        auto order_it = order_book_side.begin();
-        while (order_it != order_book_side.end() && (order.is_buy ? order_it->price <= order.price : order_it->price >= order.price) && order.quantity > 0 && order.account_name != order_it->account_name)
-        {
-            if (order_it->quantity <= order.quantity)
-            {
-                order.quantity -= order_it->quantity;
-                auto buyer = order.is_buy ? order.account_name : order_it->account_name;
-                auto seller = order.is_buy ? order_it->account_name : order.account_name;
-                settle_accounts(buyer, seller, order_it->quantity, order_it->price, order.is_buy ? "buy" : "sell", accounts, accounts_mutex, transactions, transactions_mutex);
-                order_it = order_book_side.erase(order_it);
-            }
-            else
-            {
-                Order updatedOrder;
-                updatedOrder.timestamp = order_it->timestamp;
-                updatedOrder.id = order_it->id;
-                updatedOrder.price = order_it->price;
-                updatedOrder.account_name = order_it->account_name;
-                updatedOrder.is_buy = order_it->is_buy;
-                updatedOrder.quantity = order_it->quantity - order.quantity;
-
-                auto buyer = order.is_buy ? order.account_name : order_it->account_name;
-                auto seller = order.is_buy ? order_it->account_name : order.account_name;
-                settle_accounts(buyer, seller, order.quantity, order_it->price, order.is_buy ? "buy" : "sell", accounts, accounts_mutex, transactions, transactions_mutex);
-
-                order_book_side.erase(order_it);
-                order_book_side.emplace(updatedOrder);
-
-                order.quantity = 0;
-                break;
-            }
-        }
+        shard_ready.wait();
     }
+    return replies;
+}
 
-    bool is_allowed_order(Order &order, std::map<std::string, Account_Details> &accounts, std::mutex &accounts_mutex) const
+std::vector<StatePublisher::Reader> MatchingEngine::read_state() const
+{
+    std::vector<uint64_t> queued;
+    for (auto &shard : instruments)
     {
-        std::lock_guard<std::mutex> accounts_lock(accounts_mutex);
-        std::lock_guard<std::mutex> order_book_lock(order_book_mutex);
-        if (order.is_buy)
+        queued.push_back(shard->message_queue.pushed());
+    }
+    std::vector<StatePublisher::Reader> states;
+    for (size_t i = 0; i < instruments.size(); i++)
+    {
+        // the request goes after everything counted above, so the publish it brings covers them
+        if (instruments[i]->state.read()->applied_inputs < queued[i])
         {
-            return accounts[order.account_name].usd_balance >= order.quantity * order.price && std::find_if(order_book["sell"].begin(), order_book["sell"].end(),
-                                                                                                            [order](const Order &o)
-                                                                                                            { return o.account_name == order.account_name && o.price == order.price; }) == order_book["sell"].end();
+            instruments[i]->message_queue.push(make_control_message(MessageType::publish_state));
         }
-        else
+        while (true)
         {
-            return accounts[order.account_name].coin_balance >= order.quantity && std::find_if(order_book["buy"].begin(), order_book["buy"].end(),
-                                                                                               [order](const Order &o)
-                                                                                               { return o.account_name == order.account_name && o.price == order.price; }) == order_book["buy"].end();
+            {
+                auto state = instruments[i]->state.read();
+                if (state->applied_inputs >= queued[i])
+                {
+                    states.push_back(std::move(state));
+                    break;
+                }
+            }
+            // the older snapshot is let go while waiting, so it does not keep a slot from the matching thread
+            std::this_thread::sleep_for(std::chrono::microseconds(STATE_POLL_US));
         }
     }
+    return states;
+}
 
-    int get_last_order_id(bool isBuy) const
-    {
-        std::lock_guard<std::mutex> lock(order_book_mutex);
-        int last_order_id = 0;
-        int factor = isBuy ? 1 : -1;
-        auto &order_book_side = order_book[isBuy ? "buy" : "sell"];
+size_t MatchingEngine::drain_reports(Shard &shard, ExecutionReport *reports, size_t max_count)
+{
+    return shard.reports.drain(reports, max_count);
+}
 
-        for (auto &order : order_book_side)
-        {
-            last_order_id = std::max(last_order_id, abs(order.id));
-        }
+void MatchingEngine::count_lost_report(Shard &shard)
+{
+    shard.reports.count_dropped();
+}
 
-        return factor * (last_order_id == 0 ? 1 : (last_order_id + 1));
-    }
+/*
+    Matching Engine
+*/
 
-    const Order construct_order(std::string account_name, std::string side, int quantity, double price, int timestamp) const
+/*
+    The first pre-trade check the order fails. Once it passes them all the
+    shared ledger is settled to `reserved`: a buy takes what it needs beyond
+    the `held` its resting order already reserved, and a cancel-replace that
+    needs less gives the difference back. Neither amount is ever negative, the
+    checks reject any quantity or price that would make one so.
+*/
+RejectReason check_order(Shard &shard, Order &order, Cash reserved, Cash held, bool within_rate)
+{
+    RejectReason reason;
+    if (shard.in_auction && order.type != OrderType::limit && order.type != OrderType::post_only)
     {
-        Order order;
-        order.id = this->get_last_order_id(side == "buy");
-        order.account_name = account_name;
-        order.is_buy = side == "buy";
-        order.quantity = quantity;
-        order.price = price;
-        order.timestamp = timestamp;
-        return order;
+        return RejectReason::auction_in_progress;
     }
-
-    void print_order_book() const
+    if (!shard.order_book.is_allowed_order(order, shard.coin_balances, reason))
+    {
+        return reason;
+    }
+    if (!within_rate)
     {
-        std::cout << "------------------ ORDER BOOK ----------------"
-                  << "\n";
-        std::lock_guard<std::mutex> lock(order_book_mutex);
-        std::cout << " " << pretty_print("Qty", ORDER_TABLE_WIDTH / 2) << " | " << pretty_print("$", ORDER_TABLE_WIDTH / 2)
-                  << "\n";
+        return RejectReason::rate_limited;
+    }
+    if (reserved < 0 || held < 0)
+    {
+        // is_allowed_order lets no such order through, refuse rather than move cash the wrong way
+        return RejectReason::invalid_order;
+    }
+    if (reserved > held && !shard.ledger.try_debit(order.account_id, reserved - held))
+    {
+        return RejectReason::insufficient_funds;
+    }
+    if (held > reserved)
+    {
+        shard.ledger.credit(order.account_id, held - reserved);
+    }
+    return RejectReason::none;
+}
 
-        std::map<double, int> buy_orders_by_price;
-        std::map<double, int> sell_orders_by_price;
-        for (auto buy_it = order_book["buy"].begin(), sell_it = order_book["sell"].begin();
-             buy_it != order_book["buy"].end() || sell_it != order_book["sell"].end();)
+/*
+    Reports whether the order got in, replay only repeats the logged decision.
+    A buy reserves its full notional at its limit price; a cancel-replace only
+    takes or gives back the difference to what its resting order held.
+*/
+bool admit_order(Shard &shard, Order &order, Cash &reserved, bool &admitted)
+{
+    if (order.type == OrderType::market)
+    {
+        // a market order is priced at the worst level it needs, which also bounds what a buy reserves
+        order.price = shard.order_book.market_price(order);
+    }
+    Order replaced;
+    Cash held = order.is_buy && shard.order_book.find_order(order.id, replaced) ? notional(replaced.quantity, replaced.price) : 0;
+    // an order whose notional would not fit reserves nothing and is rejected by check_order
+    reserved = order.is_buy && valid_order_size(order.quantity, order.price) ? notional(order.quantity, order.price) : 0;
+    // the window counts every attempt, replay included, so it is the same afterwards
+    bool within_rate = order.account_id < shard.coin_balances.size() && shard.order_book.count_message(order.account_id, order.timestamp);
+    if (shard.replaying)
+    {
+        if (admitted && reserved > held)
         {
-            if (buy_it != order_book["buy"].end())
-            {
-                buy_orders_by_price[buy_it->price] += buy_it->quantity;
-                buy_it++;
-            }
-            if (sell_it != order_book["sell"].end())
-            {
-                sell_orders_by_price[sell_it->price] += sell_it->quantity;
-                sell_it++;
-            }
+            shard.ledger.debit(order.account_id, reserved - held);
         }
-
-        for (auto sell_it = sell_orders_by_price.rbegin(); sell_it != sell_orders_by_price.rend();)
+        else if (admitted && reserved < held)
         {
-            std::cout << "⌄" << pretty_print(convert_int_to_string(sell_it->second), ORDER_TABLE_WIDTH / 2) << " | " << pretty_print(convert_dbl_to_string(sell_it->first), ORDER_TABLE_WIDTH / 2) << "\n";
-            sell_it++;
+            shard.ledger.credit(order.account_id, held - reserved);
         }
+        return admitted;
+    }
 
-        std::cout << "\n";
+    RejectReason reason = check_order(shard, order, reserved, held, within_rate);
+    admitted = reason == RejectReason::none;
+    if (!admitted)
+    {
+        shard.stats.rejects.add();
+    }
+    shard.order_book.report(order, admitted ? ReportType::accepted : ReportType::rejected, reason, 0, 0, order.timestamp);
+    return admitted;
+}
+
+void execute_order(Shard &shard, Order &order, Cash reserved, Timestamp timestamp)
+{
+    Cash traded = shard.in_auction ? 0 : shard.order_book.match_order(order, timestamp, shard.ledger, shard.coin_balances, shard.journal, shard.last_transactions);
+    bool rests = order.quantity > 0 && (order.type == OrderType::limit || order.type == OrderType::post_only);
+    if (order.is_buy)
+    {
+        // whatever was not spent goes back, a resting remainder keeps its share reserved until it fills or is cancelled
+        shard.ledger.credit(order.account_id, reserved - traded - (rests ? notional(order.quantity, order.price) : 0));
+    }
+    if (rests)
+    {
+        shard.order_book.add_order(order);
+    }
+    else if (order.quantity > 0)
+    {
+        order.quantity = 0;
+        shard.order_book.report(order, ReportType::cancelled, RejectReason::none, 0, 0, timestamp);
+    }
+}
 
-        for (auto buy_it = buy_orders_by_price.rbegin(); buy_it != buy_orders_by_price.rend();)
+// orders are stamped here rather than by their clients, so every time on a shard comes from one clock
+void process_order(Shard &shard, Order &order, Timestamp timestamp, bool &admitted)
+{
+    order.timestamp = timestamp;
+    uint64_t started = read_cycles();
+    Cash reserved;
+    bool accepted = admit_order(shard, order, reserved, admitted);
+    uint64_t checked = read_cycles();
+    if (accepted)
+    {
+        execute_order(shard, order, reserved, timestamp);
+    }
+    if (!shard.replaying)
+    {
+        shard.stats.admission.record(checked - started);
+        if (accepted)
         {
-            std::cout << "⌃" << pretty_print(convert_int_to_string(buy_it->second), ORDER_TABLE_WIDTH / 2) << " | " << pretty_print(convert_dbl_to_string(buy_it->first), ORDER_TABLE_WIDTH / 2) << "\n";
-            buy_it++;
+            shard.stats.matching.record(read_cycles() - checked);
         }
     }
+}
 
-private:
-    mutable std::map<std::string, std::multiset<Order, OrderComparator>> order_book;
-    mutable std::mutex order_book_mutex;
-};
-
-std::map<std::string, Account_Details> accounts;
-std::mutex accounts_mutex;
-std::vector<Transaction> transactions;
-std::mutex transactions_mutex;
-OrderBook order_book;
+// the command line may cancel or amend any order, a gateway session only the orders it entered
+bool entered_by(const Order &order, uint32_t session)
+{
+    return session == 0 || order.session == session;
+}
 
-void parse_input(std::string &input, std::vector<std::string> &input_tokens)
+void cancel_resting(Shard &shard, Order &order, Timestamp timestamp)
 {
-    std::stringstream ss(input);
-    std::string token;
+    shard.order_book.remove_order(order.id);
+    if (order.is_buy)
+    {
+        shard.ledger.credit(order.account_id, notional(order.quantity, order.price));
+    }
+    order.quantity = 0;
+    shard.order_book.report(order, ReportType::cancelled, RejectReason::none, 0, 0, timestamp);
+}
 
-    while (ss >> token)
+// another session's order is reported as unknown, the same as one that does not exist
+void cancel_order(Shard &shard, OrderId order_id, uint32_t session, Timestamp timestamp)
+{
+    Order order;
+    if (!shard.order_book.find_order(order_id, order) || !entered_by(order, session))
     {
-        input_tokens.push_back(token);
+        shard.order_book.report(Order{order_id, 0, false, OrderType::limit, 0, 0, timestamp, session}, ReportType::rejected, RejectReason::unknown_order, 0, 0, timestamp);
+        return;
     }
+    cancel_resting(shard, order, timestamp);
 }
 
-void print_accounts()
+// each order goes the way a single cancel does, with its own report; the account's list keeps this to the orders it has resting
+void mass_cancel(Shard &shard, const MassCancelMessage &message, Timestamp timestamp)
 {
-    std::lock_guard<std::mutex> lock(accounts_mutex);
-    std::cout << "-------------------- ACCOUNTS ------------------"
-              << "\n";
-    std::cout << "Total Accounts: " << accounts.size() << "\n";
-    std::cout << pretty_print("Account", ACCOUNT_TABLE_WIDTH) << " | " << pretty_print("$USD", ACCOUNT_TABLE_WIDTH) << " | " << pretty_print("Coin (C)", ACCOUNT_TABLE_WIDTH) << "\n";
-    for (auto account : accounts)
+    shard.order_book.collect_account_orders(message.account_id, message.scope, message.session, shard.mass_cancel_ids);
+    Order order;
+    for (auto order_id : shard.mass_cancel_ids)
     {
-        std::cout << pretty_print(account.first, ACCOUNT_TABLE_WIDTH) << " | " << pretty_print(convert_dbl_to_string(account.second.usd_balance), ACCOUNT_TABLE_WIDTH) << " | " << pretty_print(convert_int_to_string(account.second.coin_balance), ACCOUNT_TABLE_WIDTH) << "\n";
+        shard.order_book.find_order(order_id, order);
+        cancel_resting(shard, order, timestamp);
+    }
+    if (!shard.replaying)
+    {
+        shard.stats.cancels.add(shard.mass_cancel_ids.size());
     }
 }
 
-void print_transactions(std::string &account, int num_transactions)
+/*
+    A quantity reduction at the same price keeps queue priority, anything else
+    is a cancel-replace that keeps the order id. Either way the order is
+    reported as accepted again with its new quantity and price; a rejected
+    replace leaves the original order resting.
+*/
+void amend_order(Shard &shard, OrderId order_id, Quantity quantity, Price price, uint32_t session, Timestamp timestamp, bool &admitted)
 {
-    std::lock_guard<std::mutex> lock(accounts_mutex);
-    std::cout << "-------------------- TRANSACTIONS ------------------"
-              << "\n";
-    if (account == "")
+    if (quantity <= 0)
     {
-        std::cout << "All Transactions"
-                  << "\n";
+        cancel_order(shard, order_id, session, timestamp);
+        return;
     }
-    else
+
+    Order order;
+    if (!shard.order_book.find_order(order_id, order) || !entered_by(order, session))
     {
-        std::cout << "Account: " << account << "\n";
+        shard.order_book.report(Order{order_id, 0, false, OrderType::limit, 0, 0, timestamp, session}, ReportType::rejected, RejectReason::unknown_order, 0, 0, timestamp);
+        return;
     }
-    std::cout << pretty_print("Timestamp", ACCOUNT_TABLE_WIDTH) << " | " << pretty_print("Aggressor", ACCOUNT_TABLE_WIDTH) << " | " << pretty_print("Buyer", ACCOUNT_TABLE_WIDTH) << " | " << pretty_print("Seller", ACCOUNT_TABLE_WIDTH) << " | " << pretty_print("Quantity", ACCOUNT_TABLE_WIDTH) << " | " << pretty_print("Price", ACCOUNT_TABLE_WIDTH) << "\n";
-    auto transaction_iter = transactions.rbegin();
-    int i = 0;
-    while (transaction_iter != transactions.rend() && i < num_transactions)
+
+    if (price == order.price && quantity <= order.quantity)
     {
-        if (account != "" && (transaction_iter->buyer == account || transaction_iter->seller == account))
-        {
-            std::cout << pretty_print(convert_int_to_string(transaction_iter->timestamp), ACCOUNT_TABLE_WIDTH) << " | " << pretty_print(transaction_iter->aggressor, ACCOUNT_TABLE_WIDTH) << " | " << pretty_print(transaction_iter->buyer, ACCOUNT_TABLE_WIDTH) << " | " << pretty_print(transaction_iter->seller, ACCOUNT_TABLE_WIDTH) << " | " << pretty_print(convert_int_to_string(transaction_iter->quantity), ACCOUNT_TABLE_WIDTH) << " | " << pretty_print(convert_dbl_to_string(transaction_iter->price), ACCOUNT_TABLE_WIDTH) << "\n";
-            transaction_iter++;
-            i++;
-        }
-        else if (account == "")
-        {
-            std::cout << pretty_print(convert_int_to_string(transaction_iter->timestamp), ACCOUNT_TABLE_WIDTH) << " | " << pretty_print(transaction_iter->aggressor, ACCOUNT_TABLE_WIDTH) << " | " << pretty_print(transaction_iter->buyer, ACCOUNT_TABLE_WIDTH) << " | " << pretty_print(transaction_iter->seller, ACCOUNT_TABLE_WIDTH) << " | " << pretty_print(convert_int_to_string(transaction_iter->quantity), ACCOUNT_TABLE_WIDTH) << " | " << pretty_print(convert_dbl_to_string(transaction_iter->price), ACCOUNT_TABLE_WIDTH) << "\n";
-            transaction_iter++;
-            i++;
-        }
-        else
+        shard.order_book.reduce_order(order_id, quantity);
+        if (order.is_buy)
         {
-            transaction_iter++;
+            shard.ledger.credit(order.account_id, notional(order.quantity - quantity, order.price));
         }
+        order.quantity = quantity;
+        shard.order_book.report(order, ReportType::accepted, RejectReason::none, 0, 0, timestamp);
+        return;
+    }
+
+    order.quantity = quantity;
+    order.price = price;
+    order.timestamp = timestamp;
+    Cash reserved;
+    if (!admit_order(shard, order, reserved, admitted))
+    {
+        return;
     }
+    shard.order_book.remove_order(order_id);
+    execute_order(shard, order, reserved, timestamp);
 }
 
-void command_router(std::vector<std::string> &input_tokens, MessageQueue &message_queue)
+void open_account(Shard &shard, AccountId account_id, Quantity coin_balance)
 {
-    if (input_tokens[0] == "account")
+    if (account_id >= shard.coin_balances.size())
     {
-        if (input_tokens.size() < 3)
-        {
-            std::cout << "Invalid arguments\n";
-            return;
-        }
-
-        if (input_tokens[2] == "create")
-        {
-            {
-                std::lock_guard<std::mutex> lock(accounts_mutex);
-                accounts.emplace(std::make_pair(input_tokens[1], Account_Details{0, 0}));
-            }
-            print_accounts();
-            return;
-        }
-
-        if (input_tokens[2] == "delete")
-        {
-            {
-                std::lock_guard<std::mutex> lock(accounts_mutex);
-                accounts.erase(input_tokens[1]);
-            }
-            print_accounts();
-            return;
-        }
+        shard.coin_balances.resize(account_id + 1, 0);
+        shard.last_transactions.resize(account_id + 1, 0);
+    }
+    shard.coin_balances[account_id] = coin_balance;
+    shard.ledger.open_account(account_id);
+}
 
-        std::unique_lock<std::mutex> lock(accounts_mutex);
-        auto Account_Details = accounts.find(input_tokens[1]);
-        if (Account_Details == accounts.end())
+bool withdraw(Shard &shard, AccountId account_id, Cash amount, bool &admitted)
+{
+    if (amount <= 0)
+    {
+        admitted = false;
+        return admitted;
+    }
+    if (shard.replaying)
+    {
+        if (admitted)
         {
-            std::cout << "Account does not exist\n";
-            return;
+            shard.ledger.debit(account_id, amount);
         }
-        lock.unlock();
+        return admitted;
+    }
+    admitted = shard.ledger.try_debit(account_id, amount);
+    return admitted;
+}
 
-        if (input_tokens[2] == "query")
-        {
-            std::cout << "Account Name: " << input_tokens[1] << "\n";
-            std::cout << "USD Balance: " << Account_Details->second.usd_balance << "\n";
-            std::cout << "Coin Balance: " << Account_Details->second.coin_balance << "\n";
-        }
-        else if (input_tokens[2] == "fund")
-        {
-            if (input_tokens.size() < 4)
-            {
-                std::cout << "Invalid arguments\n";
-                return;
-            }
-            double funding_amount = convert_string_to_double(input_tokens[3]);
-            std::lock_guard<std::mutex> lock(accounts_mutex);
-            Account_Details->second.usd_balance += funding_amount;
-        }
-        else if (input_tokens[2] == "withdraw")
-        {
-            if (input_tokens.size() < 4)
-            {
-                std::cout << "Invalid arguments\n";
-                return;
-            }
-            double withdraw_amount = convert_string_to_double(input_tokens[3]);
-            std::lock_guard<std::mutex> lock(accounts_mutex);
-            if (withdraw_amount > Account_Details->second.usd_balance)
-            {
-                std::cout << "Insufficient funds\n";
-                return;
-            }
-            Account_Details->second.usd_balance -= withdraw_amount;
-            std::cout << "Sending " << withdraw_amount << " to " << input_tokens[1] << "'s linked bank account."
-                      << "\n";
-        }
-        else if (input_tokens[2] == "transactions")
+/*
+    Applies one input. `timestamp` is the engine's clock for it, and `admitted`
+    is the input's admission decision as described at admit_order. Replies are
+    only sent live; logged inputs never carry a reply pointer.
+*/
+bool handle_message(Shard &shard, const Message &message, Timestamp timestamp, bool &admitted)
+{
+    switch (message.type)
+    {
+    case MessageType::new_order:
+    {
+        Order order = message.new_order;
+        process_order(shard, order, timestamp, admitted);
+        break;
+    }
+    case MessageType::cancel:
+        cancel_order(shard, message.cancel.order_id, message.cancel.session, timestamp);
+        break;
+    case MessageType::amend:
+        amend_order(shard, message.amend.order_id, message.amend.quantity, message.amend.price, message.amend.session, timestamp, admitted);
+        break;
+    case MessageType::open_account:
+        open_account(shard, message.account.account_id, message.account.amount);
+        break;
+    case MessageType::fund:
+    {
+        // only a positive amount is added, the same on replay since the decision depends on nothing else
+        bool accepted = message.account.amount > 0;
+        if (accepted)
         {
-            if (input_tokens.size() < 4)
-            {
-                std::cout << "Invalid arguments\n";
-                return;
-            }
-            int num_transactions = convert_string_to_int(input_tokens[3]);
-            print_transactions(input_tokens[1], num_transactions);
+            shard.ledger.credit(message.account.account_id, message.account.amount);
         }
-        else
+        if (message.account.reply != nullptr)
         {
-            std::cout << "Invalid subcommand\n";
+            message.account.reply->accepted = accepted;
+            message.account.reply->ready.set_value();
         }
+        break;
     }
-    else if (input_tokens[0] == "order")
+    case MessageType::withdraw:
     {
-        if (input_tokens.size() < 2)
+        bool accepted = withdraw(shard, message.account.account_id, message.account.amount, admitted);
+        if (message.account.reply != nullptr)
         {
-            std::cout << "Invalid arguments\n";
-            return;
+            message.account.reply->accepted = accepted;
+            message.account.reply->ready.set_value();
         }
-
-        if (input_tokens[1] == "cancel")
+        break;
+    }
+    case MessageType::mass_cancel:
+        mass_cancel(shard, message.mass_cancel, timestamp);
+        break;
+    case MessageType::auction_start:
+        shard.in_auction = true;
+        if (message.auction.reply != nullptr)
         {
-            if (input_tokens.size() < 3)
-            {
-                std::cout << "Invalid arguments\n";
-                return;
-            }
-            int order_id = convert_string_to_int(input_tokens[2]);
-            if (order_id == 0)
-            {
-                return;
-            }
-            message_queue.push(input_tokens[1] + " " + input_tokens[2]);
-            message_queue.notify();
+            message.auction.reply->ready.set_value();
         }
-        else if (input_tokens[1] == "create")
+        break;
+    case MessageType::auction_uncross:
+    {
+        Price price = 0;
+        Quantity volume = shard.order_book.uncross(timestamp, shard.ledger, shard.coin_balances, shard.journal, shard.last_transactions, price);
+        shard.in_auction = false;
+        if (message.auction.reply != nullptr)
         {
-            if (input_tokens.size() < 6)
-            {
-                std::cout << "Invalid arguments\n";
-                return;
-            }
-            std::string account_name = input_tokens[2];
-            std::string side = input_tokens[3];
-            auto quantity = convert_string_to_int(input_tokens[4]);
-            auto price = convert_string_to_double(input_tokens[5]);
-
-            // create order
-            auto order = order_book.construct_order(account_name, side, quantity, price, get_epoch_ms());
-            message_queue.push(order);
+            message.auction.reply->auction_price = price;
+            message.auction.reply->auction_volume = volume;
+            message.auction.reply->ready.set_value();
         }
-        else
+        break;
+    }
+    case MessageType::query_account:
+        message.query.reply->coin_balances.push_back(shard.coin_balances[message.query.account_id]);
+        message.query.reply->reserved_cash = shard.order_book.reserved_cash(message.query.account_id);
+        message.query.reply->reserved_coin = shard.order_book.reserved_coin(message.query.account_id);
+        message.query.reply->ready.set_value();
+        break;
+    case MessageType::query_transactions:
+        message.query.reply->transaction_count = shard.journal.size();
+        if (message.query.account_id < shard.last_transactions.size())
         {
-            std::cout << "Invalid subcommand\n";
+            message.query.reply->last_account_transaction = shard.last_transactions[message.query.account_id];
         }
+        message.query.reply->ready.set_value();
+        break;
+    case MessageType::snapshot:
+        message.query.reply->coin_balances = shard.coin_balances;
+        shard.order_book.snapshot_levels(true, message.query.reply->bids);
+        shard.order_book.snapshot_levels(false, message.query.reply->asks);
+        message.query.reply->ready.set_value();
+        break;
+    case MessageType::subscribe_market_data:
+        shard.market_data.subscribe(message.market_data.feed);
+        break;
+    case MessageType::unsubscribe_market_data:
+        shard.market_data.unsubscribe(message.market_data.feed);
+        break;
+    case MessageType::shutdown:
+        return false;
+    case MessageType::publish_state:
+        shard.state_requested = true;
+        break;
     }
-    else if (input_tokens[0] == "state")
-    {
-        print_accounts();
-        order_book.print_order_book();
-    }
-    else if (input_tokens[0] == "transactions")
+    return true;
+}
+
+// logs a state-changing input before it is applied and returns its record, whose admission decision is filled in while it is applied; null when the log is full
+InputRecord *log_input(Shard &shard, const Message &message, Timestamp timestamp)
+{
+    InputRecord record{static_cast<int64_t>(shard.input_log.size()) + 1, timestamp, true, message};
+    if (record.message.type == MessageType::fund || record.message.type == MessageType::withdraw)
     {
-        if (input_tokens.size() < 2)
-        {
-            std::cout << "Invalid arguments\n";
-            return;
-        }
-        int num_transactions = convert_string_to_int(input_tokens[1]);
-        std::string all = "";
-        print_transactions(all, num_transactions);
+        record.message.account.reply = nullptr;
     }
-    else
+    else if (record.message.type == MessageType::auction_start || record.message.type == MessageType::auction_uncross)
     {
-        std::cout << "Invalid command\n";
+        record.message.auction.reply = nullptr;
     }
+    return shard.input_log.append(record);
 }
 
 /*
-    Matching Engine
+    Binary snapshot of one shard as of the last input in its log. Both logs are
+    flushed first so a snapshot never gets ahead of them, and it is written
+    next to its final name and renamed over it so a crash leaves either the old
+    or the new one.
 */
-void matching_engine(MessageQueue &message_queue)
+bool write_snapshot(Shard &shard)
 {
-    while (true)
+    if (shard.snapshot_path.empty())
     {
-        // Wait for a message to be available
-        MessageQueueData data = message_queue.pop();
-
-        if (data.index() == 0) // data is of type Order
-        {
-            Order order = std::get<Order>(data);
-            if (order_book.is_allowed_order(order, accounts, accounts_mutex))
-            {
-                order_book.match_order(order, accounts, accounts_mutex, transactions, transactions_mutex);
-                if (order.quantity > 0)
-                {
-                    order_book.add_order(order);
-                }
-            }
-            else
-            {
-                std::cout << "Order rejected\n";
-            }
-        }
-        else if (data.index() == 1) // data is of type std::string
-        {
-            std::vector<std::string> message_tokens;
-            parse_input(std::get<std::string>(data), message_tokens);
+        // nothing is persisted, moving the mark keeps the interval from firing on every batch
+        shard.snapshot_input_count = shard.input_log.size();
+        return true;
+    }
+    shard.input_log.flush();
+    shard.journal.flush();
+
+    std::vector<Order> orders;
+    shard.order_book.snapshot_orders(orders);
+    auto &changes = shard.ledger.changes();
+    SnapshotHeader header{SNAPSHOT_MAGIC, shard.input_log.size(), shard.journal.size(), shard.order_book.next_order_id(), shard.coin_balances.size(), orders.size(), shard.in_auction ? 1u : 0u};
+
+    std::string temporary_path = shard.snapshot_path + ".tmp";
+    std::ofstream snapshot(temporary_path, std::ios::binary | std::ios::trunc);
+    snapshot.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    snapshot.write(reinterpret_cast<const char *>(shard.coin_balances.data()), shard.coin_balances.size() * sizeof(Quantity));
+    snapshot.write(reinterpret_cast<const char *>(changes.data()), changes.size() * sizeof(Cash));
+    snapshot.write(reinterpret_cast<const char *>(shard.last_transactions.data()), shard.last_transactions.size() * sizeof(uint32_t));
+    snapshot.write(reinterpret_cast<const char *>(orders.data()), orders.size() * sizeof(Order));
+    snapshot.close();
+    if (!snapshot || std::rename(temporary_path.c_str(), shard.snapshot_path.c_str()) != 0)
+    {
+        return false;
+    }
+    shard.snapshot_input_count = header.input_count;
+    // a restart needs nothing before the snapshot, the fills stay for the readers that walk the journal
+    shard.input_log.release_before(header.input_count);
+    return true;
+}
 
-            if (message_tokens.size() == 0)
-            {
-                continue;
-            }
+// loads the shard's snapshot if there is a usable one, leaving `header` zeroed otherwise
+void load_snapshot(Shard &shard, SnapshotHeader &header)
+{
+    header = SnapshotHeader{};
+    std::ifstream snapshot(shard.snapshot_path, std::ios::binary);
+    SnapshotHeader stored;
+    if (!snapshot.read(reinterpret_cast<char *>(&stored), sizeof(stored)) || stored.magic != SNAPSHOT_MAGIC || stored.input_count > shard.input_log.size() || stored.input_count < shard.input_log.first())
+    {
+        return;
+    }
 
-            if (message_tokens[0] == "exit")
-            {
-                break;
-            }
+    std::vector<Quantity> coin_balances(stored.account_count);
+    std::vector<Cash> changes(stored.account_count);
+    std::vector<uint32_t> last_transactions(stored.account_count);
+    std::vector<Order> orders(stored.order_count);
+    snapshot.read(reinterpret_cast<char *>(coin_balances.data()), coin_balances.size() * sizeof(Quantity));
+    snapshot.read(reinterpret_cast<char *>(changes.data()), changes.size() * sizeof(Cash));
+    snapshot.read(reinterpret_cast<char *>(last_transactions.data()), last_transactions.size() * sizeof(uint32_t));
+    snapshot.read(reinterpret_cast<char *>(orders.data()), orders.size() * sizeof(Order));
+    if (!snapshot)
+    {
+        return;
+    }
 
-            if (message_tokens[0] == "cancel")
-            {
-                int order_id = convert_string_to_int(message_tokens[1]);
-                order_book.remove_order(order_id);
-            }
-        }
+    shard.coin_balances = coin_balances;
+    shard.last_transactions = last_transactions;
+    shard.ledger.restore(changes);
+    for (auto &order : orders)
+    {
+        shard.order_book.add_order(order);
     }
+    shard.order_book.advance_order_id_past(stored.next_order_id - 1);
+    shard.in_auction = stored.in_auction != 0;
+    header = stored;
 }
 
 /*
-    Command Line Interface
+    Rebuilds a shard from its snapshot and the inputs logged after it. This runs
+    before the matching threads start, with no console output or clock reads;
+    the fills it produces overwrite the journal records past the snapshot with
+    the same values.
 */
-void commander(MessageQueue &message_queue)
+bool restore_shard(Shard &shard, size_t &replayed)
 {
-    while (true)
+    SnapshotHeader header;
+    load_snapshot(shard, header);
+    // the inputs before the log's first segment were released behind a snapshot, without it they are gone and the journal is kept as it is
+    if (header.input_count < shard.input_log.first())
     {
+        return false;
+    }
+    shard.journal.truncate(header.transaction_count);
+    shard.snapshot_input_count = header.input_count;
 
-        std::string input;
-        std::vector<std::string> input_tokens;
-        std::cout << "Enter Command: ";
-        if (!getline(std::cin, input))
-        {
-            break;
-        }
-
-        parse_input(input, input_tokens);
-
-        if (input_tokens.size() == 0)
+    shard.replaying = true;
+    shard.reports.set_enabled(false);
+    for (size_t i = header.input_count; i < shard.input_log.size(); i++)
+    {
+        auto &record = shard.input_log[i];
+        bool admitted = record.admitted;
+        if (record.message.type == MessageType::new_order)
         {
-            continue;
+            shard.order_book.advance_order_id_past(record.message.new_order.id);
         }
+        handle_message(shard, record.message, record.timestamp, admitted);
+    }
+    shard.replaying = false;
+    shard.reports.set_enabled(true);
+    shard.order_book.clear_sessions();
+    shard.market_data.publish(shard.order_book, shard.journal);
+    publish_state(shard);
+    replayed = shard.input_log.size() - header.input_count;
+    return true;
+}
 
-        if (input_tokens[0] == "exit")
-        {
-            message_queue.push("exit");
-            break;
-        }
+bool publish_state(Shard &shard)
+{
+    auto snapshot = shard.state.prepare();
+    if (snapshot == nullptr)
+    {
+        return false;
+    }
+    auto account_count = shard.coin_balances.size();
+    snapshot->applied_inputs = shard.applied_inputs;
+    snapshot->coin_balances.assign(shard.coin_balances.begin(), shard.coin_balances.end());
+    snapshot->last_transactions.assign(shard.last_transactions.begin(), shard.last_transactions.end());
+    snapshot->reserved_cash.resize(account_count);
+    snapshot->reserved_coin.resize(account_count);
+    for (AccountId account_id = 0; account_id < account_count; account_id++)
+    {
+        snapshot->reserved_cash[account_id] = shard.order_book.reserved_cash(account_id);
+        snapshot->reserved_coin[account_id] = shard.order_book.reserved_coin(account_id);
+    }
+    snapshot->transaction_count = shard.journal.size();
+    shard.order_book.snapshot_levels(true, snapshot->bids);
+    shard.order_book.snapshot_levels(false, snapshot->asks);
+    shard.state.publish();
+    shard.state_requested = false;
+    return true;
+}
 
-        command_router(input_tokens, message_queue);
+bool pin_current_thread(int core)
+{
+#ifdef __linux__
+    if (core < 0 || core >= CPU_SETSIZE)
+    {
+        return false;
     }
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    CPU_SET(core, &cpu_set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set) == 0;
+#else
+    return false;
+#endif
 }
 
-// update as you see fit
-void setup()
+bool core_available(int core)
 {
+#ifdef __linux__
+    cpu_set_t cpu_set;
+    return core >= 0 && core < CPU_SETSIZE && sched_getaffinity(0, sizeof(cpu_set), &cpu_set) == 0 && CPU_ISSET(core, &cpu_set);
+#else
+    return false;
+#endif
+}
+
+// what the logs lost since the last report, at most once per JOURNAL_ERROR_REPORT_INTERVAL_NS
+void report_journal_errors(Shard &shard, Timestamp now)
+{
+    size_t failed = shard.input_log.failed_appends() + shard.journal.failed_appends();
+    if (failed == shard.journal_errors_reported || now - shard.journal_error_reported_at < JOURNAL_ERROR_REPORT_INTERVAL_NS)
     {
-        std::lock_guard<std::mutex> lock(accounts_mutex);
-        accounts.emplace("alice", Account_Details{6000, 43540});
-        accounts.emplace("bob", Account_Details{300, 2000});
-        accounts.emplace("charlie", Account_Details{1235, 1000});
+        return;
     }
-    auto order1 = order_book.construct_order("alice", "buy", 1, 20.50, get_epoch_ms());
-    order_book.add_order(order1);
-    auto order2 = order_book.construct_order("bob", "buy", 10, 22.50, get_epoch_ms());
-    order_book.add_order(order2);
-    auto order3 = order_book.construct_order("charlie", "sell", 8, 23.50, get_epoch_ms());
-    order_book.add_order(order3);
-    auto order4 = order_book.construct_order("charlie", "sell", 8, 25.50, get_epoch_ms());
-    order_book.add_order(order4);
+    std::cerr << "The journals for " << shard.symbol << " are full, " << failed - shard.journal_errors_reported << " more records were not written\n";
+    shard.journal_errors_reported = failed;
+    shard.journal_error_reported_at = now;
 }
 
-int main()
+void matching_engine(Shard &shard)
 {
-    setup();
-    MessageQueue message_queue;
-    std::thread commander_thread(commander, std::ref(message_queue));
-    std::thread matching_engine_thread(matching_engine, std::ref(message_queue));
+    if (shard.core >= 0 && !pin_current_thread(shard.core))
+    {
+        std::cerr << "Could not pin the matching thread for " << shard.symbol << " to core " << shard.core << "\n";
+    }
 
-    commander_thread.join();
-    matching_engine_thread.join();
+    std::vector<MessageQueueData> batch(MESSAGE_BATCH_SIZE);
+    bool running = true;
+    while (running)
+    {
+        // Wait for messages to be available and drain them in one go, but never park while a reader waits on a publish
+        size_t count = shard.state_requested ? shard.message_queue.try_pop_batch(batch.data(), batch.size()) : shard.message_queue.pop_batch(batch.data(), batch.size());
+        if (count == 0)
+        {
+            std::this_thread::yield();
+            publish_state(shard);
+            continue;
+        }
+        Timestamp now = get_timestamp_ns();
+        uint64_t dequeued = read_cycles();
+        size_t fill_count = shard.journal.size();
+        shard.stats.batches.add();
+        shard.stats.messages.add(count);
+        shard.stats.max_queue_depth.raise_to(count + shard.message_queue.size());
+        for (size_t i = 0; i < count && running; i++)
+        {
+            auto &message = batch[i];
+            bool unlogged_admitted = true;
+            // without a journal directory nothing is ever replayed, so nothing is logged; an input the log could not take is still applied
+            auto record = is_logged_message(message.type) && shard.input_log.persistent() ? log_input(shard, message, now) : nullptr;
+            bool &admitted = record != nullptr ? record->admitted : unlogged_admitted;
+            running = handle_message(shard, message, now, admitted);
+
+            shard.stats.count_input(message.type);
+            if (message.enqueued != 0)
+            {
+                shard.stats.queue.record(dequeued - message.enqueued);
+                shard.stats.total.record(read_cycles() - message.enqueued);
+            }
+        }
+        shard.stats.fills.add(shard.journal.size() - fill_count);
 
-    return 0;
-}
\ No newline at end of file
+        shard.market_data.publish(shard.order_book, shard.journal);
+        // the state is only copied for a reader that asked, once the batch that carried its request is applied
+        shard.applied_inputs += count;
+        if (shard.state_requested)
+        {
+            publish_state(shard);
+        }
+        shard.input_log.commit(now);
+        shard.journal.commit(now);
+        report_journal_errors(shard, now);
+        if (!running || shard.input_log.size() - shard.snapshot_input_count >= SNAPSHOT_INTERVAL_INPUTS)
+        {
+            if (!write_snapshot(shard))
+            {
+                std::cerr << "Could not write the snapshot for " << shard.symbol << "\n";
+            }
+        }
+    }
+    shard.input_log.flush();
+    shard.journal.flush();
+}
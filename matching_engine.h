@@ -0,0 +1,3052 @@
+/*
+    Author : Nad
+    Date : 2023-01-15
+    Description : A simple C++ Matching Engine
+*/
+
+/*
+    The matching engine as a library. A MatchingEngine owns its ledger and one
+    shard per instrument; everything below it is the book, the rings and the
+    journals those shards are built from.
+*/
+
+#ifndef MATCHING_ENGINE_H
+#define MATCHING_ENGINE_H
+
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <map>
+#include <vector>
+#include <cstring>
+#include <type_traits>
+#include <cmath>
+#include <cstdint>
+#include <cassert>
+#include <limits>
+#include <unordered_map>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <future>
+#include <condition_variable>
+#include <memory>
+#include <new>
+#include <chrono>
+#include <atomic>
+#include <fstream>
+#include <cstdio>
+#include <cstdlib>
+#ifdef __linux__
+#include <pthread.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <glob.h>
+#include <cerrno>
+
+const double DEFAULT_TICK_SIZE = 0.01;
+const double DEFAULT_LOT_SIZE = 1;
+const int64_t CASH_SCALE = 10000; // cash units per USD
+const int PRICE_LEVEL_RESERVE = 256;
+const int ORDER_INDEX_RESERVE = 1 << 16;
+const int ORDER_POOL_RESERVE = 1 << 16;
+const size_t JOURNAL_SEGMENT_RECORDS = 1 << 16;
+const size_t JOURNAL_MAX_SEGMENTS = 1 << 12;
+const int JOURNAL_FSYNC_INTERVAL_MS = 100;
+const size_t SNAPSHOT_INTERVAL_INPUTS = 1 << 16;
+const int64_t JOURNAL_ERROR_REPORT_INTERVAL_NS = 1000000000; // a journal that cannot grow is reported at most this often
+const uint64_t SNAPSHOT_MAGIC = 0x34504e534d454e45; // "ENEMSNP4"
+const int ACCOUNT_PRICE_RESERVE = 16;
+const uint32_t NULL_NODE = UINT32_MAX;
+const int MARKET_DEPTH_LEVELS = 10;
+const size_t MARKET_DATA_FEED_CAPACITY = 1 << 14;
+const size_t MARKET_DATA_RING_CAPACITY = 1 << 16;
+const uint64_t MARKET_DATA_RING_MAGIC = 0x32474e49524d454e; // "NEMRING2"
+const size_t REPORT_CHANNEL_CAPACITY = 1 << 16;
+const size_t STATE_SNAPSHOT_SLOTS = 4;                 // one being written, one current and the rest for readers still holding older ones
+const int STATE_POLL_US = 20;
+
+const size_t CACHE_LINE_SIZE = 64;
+const size_t MESSAGE_QUEUE_CAPACITY = 1 << 16;
+const size_t MESSAGE_BATCH_SIZE = 256;
+const int QUEUE_SPIN_LIMIT = 4096;
+const int LATENCY_SUB_BUCKET_BITS = 4;
+const size_t LATENCY_SUB_BUCKETS = 1 << LATENCY_SUB_BUCKET_BITS;
+const size_t LATENCY_BUCKETS = 64 * LATENCY_SUB_BUCKETS;
+
+const size_t MAX_SHARDS = 64;
+const size_t MAX_ACCOUNTS = 1 << 16;
+const int ORDER_ID_SHARD_SHIFT = 48; // order ids are (shard index << ORDER_ID_SHARD_SHIFT) + sequence
+const int64_t MAX_ORDER_NOTIONAL = std::numeric_limits<int64_t>::max() >> 20; // cash units, leaves room to add up a million orders
+
+using OrderId = int64_t;
+using AccountId = uint32_t;
+using Price = int64_t;    // integer price ticks
+using Quantity = int64_t; // integer lots
+using Cash = int64_t;     // integer USD cash units
+using Timestamp = int64_t; // nanoseconds since the epoch, see get_timestamp_ns
+
+const Timestamp NS_PER_MS = 1000000;
+const Timestamp NS_PER_SECOND = 1000000000;
+
+enum class Side : uint8_t
+{
+    buy,
+    sell
+};
+
+// everything but limit and post-only is done once it has matched, its remainder is cancelled rather than rested
+enum class OrderType : uint8_t
+{
+    limit,
+    market,    // trades at any price the book has, never rests
+    ioc,       // immediate or cancel
+    fok,       // fill or kill, trades its whole quantity at once or not at all
+    post_only  // only ever rests, rejected if it would take liquidity
+};
+
+// which of an account's resting orders a mass cancel takes
+enum class CancelScope : uint8_t
+{
+    all,
+    buys,
+    sells,
+    session // both sides, only the orders entered by the mass cancel's session
+};
+
+// what happens when an incoming order would trade against a resting order of the same account
+enum class SelfTradePrevention
+{
+    cancel_newest, // the incoming order is rejected or its remainder cancelled
+    cancel_oldest, // the resting order is cancelled and matching carries on
+    decrement      // both orders are reduced by the overlap without a trade
+};
+
+// when appended trade records are forced to disk
+enum class FsyncPolicy
+{
+    none,    // left to the page cache
+    batch,   // at the end of every drained message batch
+    interval // at the end of a batch once JOURNAL_FSYNC_INTERVAL_MS has passed since the last sync
+};
+
+// how a ring consumer waits when it runs dry
+enum class WaitStrategy
+{
+    busy_spin,
+    spin_then_park,
+    block
+};
+
+// where one thread runs and how it waits for work
+struct ThreadConfig
+{
+    int core = -1; // -1 leaves it to the scheduler
+    WaitStrategy wait = WaitStrategy::spin_then_park;
+};
+
+// pre-trade limits on each account, per symbol; 0 leaves a limit off
+struct RiskLimits
+{
+    int max_open_orders = 0;
+    Cash max_open_notional = 0;     // resting buys and sells at their limit prices, plus the new order
+    int max_messages_per_second = 0; // new orders and amends
+};
+
+/*
+    Fixed-point scales for the engine. Everything past the CLI is integer:
+    prices are ticks, quantities are lots and USD balances are cash units, and
+    the notional of one lot at one tick is a whole number of cash units.
+*/
+
+struct FixedPointConfig
+{
+    double tick_size = DEFAULT_TICK_SIZE; // USD per tick
+    double lot_size = DEFAULT_LOT_SIZE;   // coin per lot
+    Cash cash_per_tick_lot = std::llround(DEFAULT_TICK_SIZE * DEFAULT_LOT_SIZE * CASH_SCALE);
+};
+
+struct Transaction
+{
+    int id;
+    Quantity quantity;
+    Price price;
+    Timestamp timestamp;
+    AccountId buyer;
+    AccountId seller;
+    Side aggressor;
+    uint32_t buyer_previous;  // journal position + 1 of the buyer's previous fill on this shard, 0 for none
+    uint32_t seller_previous; // same for the seller
+};
+
+struct Order
+{
+    OrderId id;
+    AccountId account_id;
+    bool is_buy;
+    OrderType type;
+    Quantity quantity;
+    Price price;
+    Timestamp timestamp;
+    uint32_t session; // gateway connection that entered the order, 0 for the command line
+};
+
+// a resting order in the pool, linked into its level's FIFO and its account's list, or into the free list
+struct OrderNode
+{
+    Order order;
+    uint32_t prev;
+    uint32_t next;
+    uint32_t account_prev; // the account's other resting orders on this shard, in no particular order
+    uint32_t account_next;
+};
+
+struct PriceLevel
+{
+    Price price;
+    Quantity total_quantity;
+    int order_count;
+    uint32_t head; // FIFO of pool nodes, head has time priority
+    uint32_t tail;
+};
+
+struct Order_Handle
+{
+    bool is_buy;
+    uint32_t level;
+    uint32_t node;
+};
+
+enum class MessageType : uint8_t
+{
+    new_order,
+    cancel,
+    amend,
+    open_account,
+    fund,
+    withdraw,
+    auction_start,
+    auction_uncross,
+    mass_cancel,
+    query_account,
+    query_transactions,
+    snapshot,
+    subscribe_market_data,
+    unsubscribe_market_data,
+    shutdown,
+    publish_state // a reader wants the published state brought up to date
+};
+
+struct Level_Summary
+{
+    Price price;
+    Quantity quantity;
+    int order_count;
+};
+
+// one level's new aggregate, a quantity of 0 means the level is gone
+struct LevelUpdate
+{
+    uint64_t sequence; // per shard, gapless
+    uint32_t shard;
+    Side side;
+    Price price;
+    Quantity quantity;
+    int order_count;
+};
+
+// top of both sides as of update `sequence`
+struct DepthSnapshot
+{
+    uint64_t sequence;
+    uint32_t shard;
+    int bid_count;
+    int ask_count;
+    Level_Summary bids[MARKET_DEPTH_LEVELS]; // best first
+    Level_Summary asks[MARKET_DEPTH_LEVELS]; // best first
+};
+
+enum class MarketDataType : uint8_t
+{
+    trade,
+    level
+};
+
+// one record of the shared-memory and multicast feed, in host byte order
+struct MarketDataRecord
+{
+    uint64_t sequence; // per shard, gapless across trades and level updates
+    uint32_t shard;
+    MarketDataType type;
+    Side side;           // the aggressor for a trade, the book side for a level
+    Price price;
+    Quantity quantity;   // traded quantity, or the level's new total with 0 removing it
+    int order_count;     // levels only
+    Timestamp timestamp; // trades only
+};
+
+enum class ReportType : uint8_t
+{
+    accepted,
+    rejected,
+    partially_filled,
+    filled,
+    cancelled
+};
+
+enum class RejectReason : uint8_t
+{
+    none,
+    unknown_account,
+    insufficient_funds,
+    insufficient_coin,
+    self_trade,
+    unknown_order,
+    no_liquidity,       // a market order with nothing on the other side
+    would_not_fill,     // a fill-or-kill order the book cannot fill completely
+    would_cross,        // a post-only order that would trade
+    auction_in_progress, // an order type that needs continuous matching
+    too_many_orders,
+    notional_limit,
+    rate_limited,
+    invalid_order // a quantity or price that is not positive, or a notional over MAX_ORDER_NOTIONAL
+};
+
+// one outbound event about an order, addressed to the session that entered it
+struct ExecutionReport
+{
+    OrderId order_id;
+    AccountId account_id;
+    uint32_t session;
+    uint32_t shard;
+    ReportType type;
+    RejectReason reason; // why it was rejected, or self_trade for a self-trade cancel
+    Side side;
+    Quantity last_quantity; // fills only
+    Price last_price;       // fills only
+    Quantity leaves_quantity;
+    Timestamp timestamp;
+    uint64_t sequence; // per session and shard from 1, a gap means reports were dropped on the way
+};
+
+class MarketDataFeed;
+
+// filled in by the engine thread and formatted by the requester, which never touches engine state itself
+struct EngineReply
+{
+    bool accepted = true;
+    std::vector<Quantity> coin_balances; // one shard's coin balances
+    std::vector<Level_Summary> bids; // best first
+    std::vector<Level_Summary> asks; // best first
+    size_t transaction_count = 0;        // journal records visible to the requester
+    uint32_t last_account_transaction = 0; // journal position + 1 of the queried account's newest fill, 0 for none
+    Cash reserved_cash = 0;                // held by the queried account's resting buys on one shard
+    Quantity reserved_coin = 0;            // held by its resting sells
+    Price auction_price = 0;               // uncrossing price, when auction_volume is not 0
+    Quantity auction_volume = 0;
+    std::promise<void> ready;
+};
+
+// a shard's balances and book as of `applied_inputs`, never written again once published
+struct StateSnapshot
+{
+    uint64_t version = 0;
+    uint64_t applied_inputs = 0;             // messages the matching thread had taken off its queue
+    std::vector<Quantity> coin_balances;     // indexed by AccountId
+    std::vector<Cash> reserved_cash;         // held by each account's resting buys
+    std::vector<Quantity> reserved_coin;     // held by its resting sells
+    std::vector<uint32_t> last_transactions; // journal position + 1 of each account's newest fill
+    size_t transaction_count = 0;            // journal records a reader may follow
+    std::vector<Level_Summary> bids;         // best first
+    std::vector<Level_Summary> asks;         // best first
+};
+
+struct CancelMessage
+{
+    OrderId order_id;
+    uint32_t session; // where a reject goes, the order's own session gets the cancel
+};
+
+struct AmendMessage
+{
+    OrderId order_id;
+    Quantity quantity;
+    Price price;
+    uint32_t session;
+};
+
+struct MassCancelMessage
+{
+    AccountId account_id;
+    CancelScope scope;
+    uint32_t session; // whose orders CancelScope::session takes
+};
+
+struct AccountMessage
+{
+    AccountId account_id;
+    int64_t amount; // opening coin lots for open_account, cash units for fund and withdraw
+    EngineReply *reply;
+};
+
+struct AuctionMessage
+{
+    EngineReply *reply;
+};
+
+struct MarketDataMessage
+{
+    MarketDataFeed *feed;
+};
+
+struct QueryMessage
+{
+    EngineReply *reply;
+    AccountId account_id;
+};
+
+// fixed-size engine input, copied by value through the rings with no heap payload
+struct Message
+{
+    MessageType type;
+    uint64_t enqueued; // read_cycles() when a client queued it, 0 when it is not timed
+    union
+    {
+        Order new_order;
+        CancelMessage cancel;
+        AmendMessage amend;
+        MassCancelMessage mass_cancel;
+        AccountMessage account;
+        QueryMessage query;
+        AuctionMessage auction;
+        MarketDataMessage market_data;
+    };
+};
+
+/*
+    An input as the engine saw it. Only messages that change engine state are
+    logged; the timestamp is the one the engine used, and `admitted` records
+    whether an order or withdrawal got through admission, which depends on the
+    USD balances other shards are trading against at the same time.
+*/
+struct InputRecord
+{
+    int64_t id; // 1-based position in the log
+    Timestamp timestamp;
+    bool admitted;
+    Message message;
+};
+
+// header of a binary shard snapshot, followed by the coin balances, the shard's net USD changes, each account's last fill and the resting orders
+struct SnapshotHeader
+{
+    uint64_t magic;
+    uint64_t input_count;
+    uint64_t transaction_count;
+    OrderId next_order_id;
+    uint64_t account_count;
+    uint64_t order_count;
+    uint64_t in_auction; // 1 while matching is suspended for a call auction
+};
+
+static_assert(std::is_trivially_copyable<Order>::value && sizeof(Order) <= CACHE_LINE_SIZE, "resting orders must stay POD and fit in a cache line");
+static_assert(std::is_trivially_copyable<Message>::value, "engine messages must stay POD");
+static_assert(std::is_trivially_copyable<Transaction>::value && std::is_trivially_copyable<InputRecord>::value, "journal records are written as raw bytes");
+static_assert(std::is_trivially_copyable<ExecutionReport>::value, "execution reports are copied through rings");
+
+using MessageQueueData = Message;
+
+Message make_new_order_message(const Order &order);
+Message make_cancel_message(OrderId order_id, uint32_t session = 0);
+Message make_amend_message(OrderId order_id, Quantity quantity, Price price, uint32_t session = 0);
+Message make_mass_cancel_message(AccountId account_id, CancelScope scope, uint32_t session = 0);
+Message make_account_message(MessageType type, AccountId account_id, int64_t amount = 0, EngineReply *reply = nullptr);
+Message make_query_message(MessageType type, EngineReply *reply, AccountId account_id = 0);
+Message make_market_data_message(MessageType type, MarketDataFeed *feed);
+Message make_auction_message(MessageType type, EngineReply *reply = nullptr);
+Message make_control_message(MessageType type);
+
+// the messages that go into the input log
+bool is_logged_message(MessageType type);
+
+const char *side_to_string(const Side side);
+bool parse_order_type(const std::string &input, OrderType &type);
+const char *report_type_to_string(const ReportType type);
+const char *reject_reason_to_string(const RejectReason reason);
+
+std::string convert_int_to_string(const int input);
+int convert_string_to_int(std::string &input);
+OrderId convert_string_to_order_id(std::string &input);
+double convert_string_to_double(std::string &input);
+
+extern FixedPointConfig fixed_point;
+
+// the tick and lot sizes must make the notional of one lot at one tick a whole number of cash units
+bool configure_fixed_point(const double tick_size, const double lot_size);
+Price price_to_ticks(const double price);
+Quantity quantity_to_lots(const double quantity);
+Cash usd_to_cash(const double usd);
+std::string convert_fixed_to_string(const int64_t units, const double unit_size);
+std::string convert_price_to_string(const Price price);
+std::string convert_quantity_to_string(const Quantity quantity);
+std::string convert_cash_to_string(const Cash cash);
+
+extern const std::chrono::steady_clock::time_point CLOCK_STEADY_ANCHOR;
+
+// the engine clock in nanoseconds since the epoch: monotonic, anchored to the wall clock at startup
+Timestamp get_timestamp_ns();
+
+// a raw cycle count for timing intervals on the hot path, the TSC where there is one
+uint64_t read_cycles();
+
+// calibrated against the monotonic clock over the whole uptime, so it only gets better
+double ns_per_cycle();
+
+// UTC time of day to the microsecond
+std::string convert_timestamp_to_string(const Timestamp timestamp);
+
+// only for quantities and prices that passed valid_order_size, which keeps the product from overflowing
+inline Cash notional(const Quantity quantity, const Price price)
+{
+    return quantity * price * fixed_point.cash_per_tick_lot;
+}
+
+// both positive and small enough that the order's notional fits MAX_ORDER_NOTIONAL
+inline bool valid_order_size(const Quantity quantity, const Price price)
+{
+    return quantity > 0 && price > 0 && quantity <= MAX_ORDER_NOTIONAL / fixed_point.cash_per_tick_lot / price;
+}
+
+inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+/*
+    One idle turn of a polling thread that found no work, `idle_polls`
+    counting the turns in a row that found none. busy_spin never gives up the
+    core, spin_then_park spins QUEUE_SPIN_LIMIT turns before sleeping `park`
+    at a time, and block sleeps straight away.
+*/
+inline void idle_wait(WaitStrategy wait, int &idle_polls, std::chrono::microseconds park)
+{
+    if (wait == WaitStrategy::busy_spin || (wait == WaitStrategy::spin_then_park && idle_polls < QUEUE_SPIN_LIMIT))
+    {
+        idle_polls++;
+        cpu_relax();
+        return;
+    }
+    std::this_thread::sleep_for(park);
+}
+
+inline size_t round_up_to_power_of_two(size_t value)
+{
+    size_t result = 1;
+    while (result < value)
+    {
+        result <<= 1;
+    }
+    return result;
+}
+
+/*
+    Bounded single-producer single-consumer ring. Each side keeps its own index
+    on a separate cache line together with a cached copy of the other side's
+    index, so the shared line is only touched when the cached view runs out.
+*/
+template <typename T>
+class SpscRing
+{
+public:
+    explicit SpscRing(size_t capacity) : mask(round_up_to_power_of_two(capacity) - 1), slots(new T[mask + 1]) {}
+
+    bool try_push(T &&value)
+    {
+        const size_t write = write_index.load(std::memory_order_relaxed);
+        if (write - cached_read_index > mask)
+        {
+            cached_read_index = read_index.load(std::memory_order_acquire);
+            if (write - cached_read_index > mask)
+            {
+                return false;
+            }
+        }
+        slots[write & mask] = std::move(value);
+        write_index.store(write + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool try_pop(T &value) { return try_pop_batch(&value, 1) == 1; }
+
+    size_t try_pop_batch(T *values, size_t max_count)
+    {
+        const size_t read = read_index.load(std::memory_order_relaxed);
+        if (read == cached_write_index)
+        {
+            cached_write_index = write_index.load(std::memory_order_acquire);
+            if (read == cached_write_index)
+            {
+                return 0;
+            }
+        }
+        size_t count = std::min(max_count, cached_write_index - read);
+        for (size_t i = 0; i < count; i++)
+        {
+            values[i] = std::move(slots[(read + i) & mask]);
+        }
+        read_index.store(read + count, std::memory_order_release);
+        return count;
+    }
+
+    bool empty() const { return read_index.load(std::memory_order_acquire) == write_index.load(std::memory_order_acquire); }
+
+    // read from another thread the consumer can move between the loads, so read first and clamp at zero
+    size_t size() const
+    {
+        const size_t read = read_index.load(std::memory_order_acquire);
+        const size_t write = write_index.load(std::memory_order_acquire);
+        return write > read ? write - read : 0;
+    }
+
+private:
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> read_index{0};
+    size_t cached_write_index = 0;
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> write_index{0};
+    size_t cached_read_index = 0;
+    alignas(CACHE_LINE_SIZE) const size_t mask;
+    std::unique_ptr<T[]> slots;
+};
+
+/*
+    Bounded multi-producer single-consumer ring. Producers claim a slot with a
+    CAS on the write index and publish it through the slot's sequence number;
+    the single consumer never writes a shared index producers spin on.
+*/
+template <typename T>
+class MpscRing
+{
+public:
+    explicit MpscRing(size_t capacity) : mask(round_up_to_power_of_two(capacity) - 1), slots(new Slot[mask + 1])
+    {
+        for (size_t i = 0; i <= mask; i++)
+        {
+            slots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    bool try_push(T &&value)
+    {
+        size_t write = write_index.load(std::memory_order_relaxed);
+        Slot *slot;
+        while (true)
+        {
+            slot = &slots[write & mask];
+            const size_t sequence = slot->sequence.load(std::memory_order_acquire);
+            const auto difference = static_cast<std::ptrdiff_t>(sequence - write);
+            if (difference == 0)
+            {
+                if (write_index.compare_exchange_weak(write, write + 1, std::memory_order_relaxed))
+                {
+                    break;
+                }
+            }
+            else if (difference < 0)
+            {
+                return false;
+            }
+            else
+            {
+                write = write_index.load(std::memory_order_relaxed);
+            }
+        }
+        slot->value = std::move(value);
+        slot->sequence.store(write + 1, std::memory_order_release);
+        return true;
+    }
+
+    // claims `count` consecutive slots with one CAS, so the run reaches the consumer unbroken by other producers; at most capacity()
+    bool try_push_batch(const T *values, size_t count)
+    {
+        size_t write = write_index.load(std::memory_order_relaxed);
+        while (true)
+        {
+            // the consumer frees slots in order, so the whole run is free once its last slot is
+            const size_t last = write + count - 1;
+            const size_t sequence = slots[last & mask].sequence.load(std::memory_order_acquire);
+            const auto difference = static_cast<std::ptrdiff_t>(sequence - last);
+            if (difference == 0)
+            {
+                if (write_index.compare_exchange_weak(write, write + count, std::memory_order_relaxed))
+                {
+                    break;
+                }
+            }
+            else if (difference < 0)
+            {
+                return false;
+            }
+            else
+            {
+                write = write_index.load(std::memory_order_relaxed);
+            }
+        }
+        for (size_t i = 0; i < count; i++)
+        {
+            Slot &slot = slots[(write + i) & mask];
+            slot.value = values[i];
+            slot.sequence.store(write + i + 1, std::memory_order_release);
+        }
+        return true;
+    }
+
+    bool try_pop(T &value) { return try_pop_batch(&value, 1) == 1; }
+
+    size_t try_pop_batch(T *values, size_t max_count)
+    {
+        size_t read = read_index.load(std::memory_order_relaxed);
+        size_t count = 0;
+        while (count < max_count)
+        {
+            Slot &slot = slots[read & mask];
+            if (slot.sequence.load(std::memory_order_acquire) != read + 1)
+            {
+                break;
+            }
+            values[count++] = std::move(slot.value);
+            slot.sequence.store(read + mask + 1, std::memory_order_release);
+            read++;
+        }
+        read_index.store(read, std::memory_order_relaxed);
+        return count;
+    }
+
+    bool empty() const
+    {
+        const size_t read = read_index.load(std::memory_order_relaxed);
+        return slots[read & mask].sequence.load(std::memory_order_acquire) != read + 1;
+    }
+
+    // read first and clamp, a consumer racing ahead of a stale write index would otherwise wrap
+    size_t size() const
+    {
+        const size_t read = read_index.load(std::memory_order_acquire);
+        const size_t write = write_index.load(std::memory_order_relaxed);
+        return write > read ? write - read : 0;
+    }
+
+    size_t capacity() const { return mask + 1; }
+
+    // slots ever claimed by producers, whether or not they have been consumed yet
+    uint64_t pushed() const { return write_index.load(std::memory_order_acquire); }
+
+private:
+    struct alignas(CACHE_LINE_SIZE) Slot
+    {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> read_index{0};
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> write_index{0};
+    alignas(CACHE_LINE_SIZE) const size_t mask;
+    std::unique_ptr<Slot[]> slots;
+};
+
+/*
+    Adds the consumer wait policy on top of a ring. Producers only pay for a
+    fence and a flag load unless the consumer has actually parked, so the
+    busy-spin and spin phases never make a syscall.
+*/
+template <typename Ring, typename T>
+class WaitingRing
+{
+public:
+    WaitingRing(size_t capacity, WaitStrategy wait_strategy) : ring(capacity), wait_strategy(wait_strategy) {}
+
+    void push(T data)
+    {
+        for (int spins = 0; !ring.try_push(std::move(data)); spins++)
+        {
+            if (spins == 0)
+            {
+                full_waits.fetch_add(1, std::memory_order_relaxed);
+            }
+            spins < QUEUE_SPIN_LIMIT ? cpu_relax() : std::this_thread::yield();
+        }
+        wake_consumer();
+    }
+
+    // pushes the values as unbroken runs of up to the ring's capacity, waking the consumer once for all of them
+    void push_batch(const T *data, size_t count)
+    {
+        while (count > 0)
+        {
+            size_t run = std::min(count, ring.capacity());
+            for (int spins = 0; !ring.try_push_batch(data, run); spins++)
+            {
+                if (spins == 0)
+                {
+                    full_waits.fetch_add(1, std::memory_order_relaxed);
+                }
+                spins < QUEUE_SPIN_LIMIT ? cpu_relax() : std::this_thread::yield();
+            }
+            data += run;
+            count -= run;
+        }
+        wake_consumer();
+    }
+
+    T pop()
+    {
+        T data;
+        pop_batch(&data, 1);
+        return data;
+    }
+
+    // drains up to `max_count` messages without waiting for any
+    size_t try_pop_batch(T *data, size_t max_count) { return ring.try_pop_batch(data, max_count); }
+
+    // waits for at least one message and then drains up to `max_count` of them
+    size_t pop_batch(T *data, size_t max_count)
+    {
+        while (true)
+        {
+            size_t count = ring.try_pop_batch(data, max_count);
+            if (count > 0)
+            {
+                return count;
+            }
+            wait();
+        }
+    }
+
+    bool empty() const { return ring.empty(); }
+
+    size_t size() const { return ring.size(); }
+
+    uint64_t pushed() const { return ring.pushed(); }
+
+    // pushes that found the ring full and had to wait, the only place a producer ever waits
+    uint64_t full_wait_count() const { return full_waits.load(std::memory_order_relaxed); }
+
+private:
+    void wake_consumer()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (consumer_parked.load(std::memory_order_relaxed))
+        {
+            std::lock_guard<std::mutex> lock(park_mutex);
+            message_available.notify_one();
+        }
+    }
+
+    void wait()
+    {
+        if (wait_strategy != WaitStrategy::block)
+        {
+            for (int spins = 0; spins < QUEUE_SPIN_LIMIT || wait_strategy == WaitStrategy::busy_spin; spins++)
+            {
+                if (!ring.empty())
+                {
+                    return;
+                }
+                cpu_relax();
+            }
+        }
+
+        std::unique_lock<std::mutex> lock(park_mutex);
+        consumer_parked.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        message_available.wait(lock, [this]()
+                               { return !ring.empty(); });
+        consumer_parked.store(false, std::memory_order_relaxed);
+    }
+
+    Ring ring;
+    WaitStrategy wait_strategy;
+    alignas(CACHE_LINE_SIZE) std::atomic<bool> consumer_parked{false};
+    std::atomic<uint64_t> full_waits{0};
+    std::mutex park_mutex;
+    std::condition_variable message_available;
+};
+
+using MessageQueue = WaitingRing<MpscRing<MessageQueueData>, MessageQueueData>;
+
+// a counter with a single writer, which needs no read-modify-write to stay exact
+class StatCounter
+{
+public:
+    void add(uint64_t amount = 1) { value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed); }
+
+    void raise_to(uint64_t amount)
+    {
+        if (amount > value.load(std::memory_order_relaxed))
+        {
+            value.store(amount, std::memory_order_relaxed);
+        }
+    }
+
+    uint64_t load() const { return value.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint64_t> value{0};
+};
+
+/*
+    Log-linear histogram in the style of HdrHistogram: a value goes to one of
+    LATENCY_SUB_BUCKETS linear buckets between its highest set bit and the next
+    one, so every bucket is within 1/16 of its values and recording is a couple
+    of shifts and one counter store. Written by one thread, read by any.
+*/
+class LatencyHistogram
+{
+public:
+    static size_t bucket(uint64_t value)
+    {
+        if (value < LATENCY_SUB_BUCKETS)
+        {
+            return static_cast<size_t>(value);
+        }
+        int shift = 63 - __builtin_clzll(value) - LATENCY_SUB_BUCKET_BITS;
+        return (shift + 1) * LATENCY_SUB_BUCKETS + ((value >> shift) & (LATENCY_SUB_BUCKETS - 1));
+    }
+
+    // the largest value that lands in `index`
+    static uint64_t bucket_limit(size_t index)
+    {
+        if (index < LATENCY_SUB_BUCKETS)
+        {
+            return index;
+        }
+        size_t shift = index / LATENCY_SUB_BUCKETS - 1;
+        return ((LATENCY_SUB_BUCKETS + index % LATENCY_SUB_BUCKETS + 1) << shift) - 1;
+    }
+
+    // the bucket limit below which a `quantile` of the counted values fall, 0 when empty
+    static uint64_t value_at(const std::vector<uint64_t> &counts, double quantile)
+    {
+        uint64_t total = 0;
+        for (auto count : counts)
+        {
+            total += count;
+        }
+        auto rank = static_cast<uint64_t>(std::ceil(quantile * static_cast<double>(total)));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < counts.size() && total > 0; i++)
+        {
+            seen += counts[i];
+            if (seen >= std::max<uint64_t>(rank, 1))
+            {
+                return bucket_limit(i);
+            }
+        }
+        return 0;
+    }
+
+    void record(uint64_t value)
+    {
+        auto &count = counts[bucket(value)];
+        count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    void add_to(std::vector<uint64_t> &totals) const
+    {
+        totals.resize(LATENCY_BUCKETS, 0);
+        for (size_t i = 0; i < LATENCY_BUCKETS; i++)
+        {
+            totals[i] += counts[i].load(std::memory_order_relaxed);
+        }
+    }
+
+private:
+    std::atomic<uint64_t> counts[LATENCY_BUCKETS] = {};
+};
+
+/*
+    Hot-path instrumentation of one shard, in cycles. The stages follow a
+    message from the order entry layer to the end of its handling:
+    queue is submit to dequeue, admission the pre-trade checks and
+    reservation, matching the matching, settlement and resting that follow,
+    and total submit to applied. Replay is not counted.
+*/
+struct ShardStats
+{
+    LatencyHistogram queue;
+    LatencyHistogram admission;
+    LatencyHistogram matching;
+    LatencyHistogram total;
+    StatCounter batches;
+    StatCounter messages;
+    StatCounter orders;
+    StatCounter cancels;
+    StatCounter amends;
+    StatCounter fills;
+    StatCounter rejects;
+    StatCounter max_queue_depth;
+
+    void count_input(MessageType type)
+    {
+        if (type == MessageType::new_order)
+        {
+            orders.add();
+        }
+        else if (type == MessageType::cancel)
+        {
+            cancels.add();
+        }
+        else if (type == MessageType::amend)
+        {
+            amends.add();
+        }
+    }
+};
+
+/*
+    Single-writer sequence lock for a small trivially copyable value. The
+    writer never waits; readers retry while a write is in progress. The value
+    is copied through relaxed atomic words so concurrent reads are not a race.
+*/
+template <typename T>
+class SeqLock
+{
+public:
+    static_assert(std::is_trivially_copyable<T>::value, "seqlocked values are copied as raw words");
+
+    void store(const T &value)
+    {
+        uint64_t buffer[WORD_COUNT] = {};
+        std::memcpy(buffer, &value, sizeof(T));
+        auto sequence = version.load(std::memory_order_relaxed);
+        version.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        for (size_t i = 0; i < WORD_COUNT; i++)
+        {
+            words[i].store(buffer[i], std::memory_order_relaxed);
+        }
+        version.store(sequence + 2, std::memory_order_release);
+    }
+
+    T load() const
+    {
+        uint64_t buffer[WORD_COUNT];
+        uint64_t before, after;
+        do
+        {
+            before = version.load(std::memory_order_acquire);
+            for (size_t i = 0; i < WORD_COUNT; i++)
+            {
+                buffer[i] = words[i].load(std::memory_order_relaxed);
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            after = version.load(std::memory_order_relaxed);
+        } while ((before & 1) != 0 || before != after);
+
+        T value;
+        std::memcpy(&value, buffer, sizeof(T));
+        return value;
+    }
+
+private:
+    static const size_t WORD_COUNT = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+    alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> version{0};
+    std::atomic<uint64_t> words[WORD_COUNT] = {};
+};
+
+/*
+    Open-addressing hash map for integer keys with linear probing and
+    backward-shift deletion. Slots are one flat array sized up front, so
+    inserts and erases never touch the heap until the table has to grow.
+*/
+template <typename Key, typename Value>
+class FlatHashMap
+{
+public:
+    explicit FlatHashMap(size_t capacity = ACCOUNT_PRICE_RESERVE) : slots(round_up_to_power_of_two(capacity * 2)), mask(slots.size() - 1) {}
+
+    size_t size() const { return count; }
+
+    Value *find(Key key)
+    {
+        for (size_t index = home(key);; index = (index + 1) & mask)
+        {
+            if (!slots[index].used)
+            {
+                return nullptr;
+            }
+            if (slots[index].key == key)
+            {
+                return &slots[index].value;
+            }
+        }
+    }
+
+    const Value *find(Key key) const
+    {
+        return const_cast<FlatHashMap *>(this)->find(key);
+    }
+
+    // value-initialises a missing key
+    Value &operator[](Key key)
+    {
+        if ((count + 1) * 2 > slots.size())
+        {
+            grow();
+        }
+        size_t index = home(key);
+        for (; slots[index].used; index = (index + 1) & mask)
+        {
+            if (slots[index].key == key)
+            {
+                return slots[index].value;
+            }
+        }
+        slots[index] = Slot{key, Value(), true};
+        count++;
+        return slots[index].value;
+    }
+
+    bool erase(Key key)
+    {
+        size_t index = home(key);
+        for (; slots[index].key != key; index = (index + 1) & mask)
+        {
+            if (!slots[index].used)
+            {
+                return false;
+            }
+        }
+        if (!slots[index].used)
+        {
+            return false;
+        }
+
+        // pull later entries of the probe run back so lookups never need tombstones
+        for (size_t next = (index + 1) & mask; slots[next].used; next = (next + 1) & mask)
+        {
+            size_t next_home = home(slots[next].key);
+            bool stays = index <= next ? index < next_home && next_home <= next : index < next_home || next_home <= next;
+            if (!stays)
+            {
+                slots[index] = slots[next];
+                index = next;
+            }
+        }
+        slots[index].used = false;
+        count--;
+        return true;
+    }
+
+private:
+    struct Slot
+    {
+        Key key;
+        Value value;
+        bool used;
+    };
+
+    size_t home(Key key) const
+    {
+        uint64_t hash = static_cast<uint64_t>(key) * 0x9E3779B97F4A7C15ull;
+        return (hash ^ (hash >> 32)) & mask;
+    }
+
+    void grow()
+    {
+        std::vector<Slot> old_slots(slots.size() * 2);
+        old_slots.swap(slots);
+        mask = slots.size() - 1;
+        count = 0;
+        for (auto &slot : old_slots)
+        {
+            if (slot.used)
+            {
+                (*this)[slot.key] = slot.value;
+            }
+        }
+    }
+
+    std::vector<Slot> slots;
+    size_t mask;
+    size_t count = 0;
+};
+
+// per-account count of live resting orders by side and price
+struct Account_Orders
+{
+    FlatHashMap<Price, int> buy_orders_at_price;
+    FlatHashMap<Price, int> sell_orders_at_price;
+
+    // exposure of the resting orders, kept in step with every change to them
+    int open_orders = 0;
+    Cash buy_notional = 0;      // USD the resting buys hold reserved in the ledger
+    Quantity sell_quantity = 0; // coin the resting sells hold reserved
+    Cash sell_notional = 0;
+
+    Timestamp rate_window_start = 0; // the current one-second message window
+    int rate_window_messages = 0;
+
+    uint32_t first_order = NULL_NODE; // head of the account's resting orders, linked through OrderNode::account_next
+};
+
+/*
+    Preallocated storage for resting orders. Released nodes go on an intrusive
+    free list and are handed out again before the pool grows, so adding,
+    filling and cancelling orders does not allocate in steady state.
+*/
+class OrderPool
+{
+public:
+    explicit OrderPool(size_t capacity) { nodes.reserve(capacity); }
+
+    OrderNode &operator[](uint32_t index) { return nodes[index]; }
+
+    const OrderNode &operator[](uint32_t index) const { return nodes[index]; }
+
+    uint32_t acquire(const Order &order)
+    {
+        uint32_t index;
+        if (free_head != NULL_NODE)
+        {
+            index = free_head;
+            free_head = nodes[index].next;
+        }
+        else
+        {
+            index = static_cast<uint32_t>(nodes.size());
+            nodes.emplace_back();
+        }
+        nodes[index] = OrderNode{order, NULL_NODE, NULL_NODE, NULL_NODE, NULL_NODE};
+        return index;
+    }
+
+    void release(uint32_t index)
+    {
+        nodes[index].next = free_head;
+        free_head = index;
+    }
+
+private:
+    std::vector<OrderNode> nodes;
+    uint32_t free_head = NULL_NODE;
+};
+
+// what differs between the two sides of the book, fixed at compile time so each side's code is its own specialization
+template <Side S>
+struct SideTraits;
+
+template <>
+struct SideTraits<Side::buy>
+{
+    static constexpr bool is_buy = true;
+
+    // true when `price` has priority over `other` on this side
+    static constexpr bool is_better(Price price, Price other) { return price > other; }
+};
+
+template <>
+struct SideTraits<Side::sell>
+{
+    static constexpr bool is_buy = false;
+
+    static constexpr bool is_better(Price price, Price other) { return price < other; }
+};
+
+/*
+    One side of the book: price levels kept in a flat ladder sorted from the
+    worst price to the best, so the touch sits at the back of the vector where
+    inserts and removals are cheapest. Levels live in a pool and the ladder only
+    stores their tick and pool index, which keeps the hot scan contiguous.
+*/
+template <Side S>
+class BookSide
+{
+public:
+    BookSide()
+    {
+        ladder.reserve(PRICE_LEVEL_RESERVE);
+        levels.reserve(PRICE_LEVEL_RESERVE);
+    }
+
+    bool empty() const { return ladder.empty(); }
+
+    size_t level_count() const { return ladder.size(); }
+
+    // true when `price` has priority over `other` on this side
+    static constexpr bool is_better(Price price, Price other) { return SideTraits<S>::is_better(price, other); }
+
+    PriceLevel &best() { return levels[ladder.back().level]; }
+
+    PriceLevel &level(uint32_t index) { return levels[index]; }
+
+    const PriceLevel &level(uint32_t index) const { return levels[index]; }
+
+    // level `n` counted from the touch, n = 0 is the best level
+    const PriceLevel &level_from_best(size_t n) const { return levels[ladder[ladder.size() - 1 - n].level]; }
+
+    PriceLevel *find_level(Price price)
+    {
+        auto it = lower_bound(price);
+        return it != ladder.end() && it->price == price ? &levels[it->level] : nullptr;
+    }
+
+    const PriceLevel *find_level(Price price) const
+    {
+        return const_cast<BookSide *>(this)->find_level(price);
+    }
+
+    uint32_t find_or_insert_level(Price price)
+    {
+        auto it = lower_bound(price);
+        if (it != ladder.end() && it->price == price)
+        {
+            return it->level;
+        }
+
+        uint32_t index;
+        if (!free_levels.empty())
+        {
+            index = free_levels.back();
+            free_levels.pop_back();
+        }
+        else
+        {
+            index = static_cast<uint32_t>(levels.size());
+            levels.emplace_back();
+        }
+
+        PriceLevel &level = levels[index];
+        level.price = price;
+        level.total_quantity = 0;
+        level.order_count = 0;
+        level.head = NULL_NODE;
+        level.tail = NULL_NODE;
+        ladder.insert(it, LadderEntry{price, index});
+        return index;
+    }
+
+    void remove_best_level()
+    {
+        release_level(ladder.back().level);
+        ladder.pop_back();
+    }
+
+    void remove_level(Price price)
+    {
+        if (!ladder.empty() && ladder.back().price == price)
+        {
+            remove_best_level();
+            return;
+        }
+
+        auto it = lower_bound(price);
+        if (it != ladder.end() && it->price == price)
+        {
+            release_level(it->level);
+            ladder.erase(it);
+        }
+    }
+
+private:
+    struct LadderEntry
+    {
+        Price price;
+        uint32_t level;
+    };
+
+    typename std::vector<LadderEntry>::iterator lower_bound(Price price)
+    {
+        return std::lower_bound(ladder.begin(), ladder.end(), price,
+                                [](const LadderEntry &entry, Price p)
+                                { return is_better(p, entry.price); });
+    }
+
+    void release_level(uint32_t index)
+    {
+        free_levels.push_back(index);
+    }
+
+    std::vector<LadderEntry> ladder;
+    std::vector<PriceLevel> levels;
+    std::vector<uint32_t> free_levels;
+};
+
+/*
+    Hands out unique, monotonically increasing order ids without locking or
+    scanning the book, so order construction never contends with matching.
+*/
+class OrderIdSequencer
+{
+public:
+    explicit OrderIdSequencer(OrderId first_id = 1) : next_id(first_id) {}
+
+    OrderId next() { return next_id.fetch_add(1, std::memory_order_relaxed); }
+
+    OrderId peek() const { return next_id.load(std::memory_order_relaxed); }
+
+    // makes sure `order_id` is never handed out again, used while restoring
+    void advance_past(OrderId order_id)
+    {
+        if (next_id.load(std::memory_order_relaxed) <= order_id)
+        {
+            next_id.store(order_id + 1, std::memory_order_relaxed);
+        }
+    }
+
+private:
+    alignas(64) std::atomic<OrderId> next_id;
+};
+
+/*
+    USD balances shared by every shard. Each balance sits on its own cache line
+    and is only ever changed with atomic read-modify-writes, so shards trading
+    for the same account never take a lock or wait on each other's thread.
+*/
+class CashLedger
+{
+public:
+    explicit CashLedger(size_t capacity) : balances(new Balance[capacity]), balance_count(capacity) {}
+
+    size_t capacity() const { return balance_count; }
+
+    Cash balance(AccountId account_id) const { return balances[account_id].value.load(std::memory_order_acquire); }
+
+    // amounts are never negative, a credit that took cash away would skip the balance check try_debit makes
+    void credit(AccountId account_id, Cash amount)
+    {
+        assert(amount >= 0);
+        balances[account_id].value.fetch_add(amount, std::memory_order_acq_rel);
+    }
+
+    void debit(AccountId account_id, Cash amount)
+    {
+        assert(amount >= 0);
+        balances[account_id].value.fetch_sub(amount, std::memory_order_acq_rel);
+    }
+
+    // takes `amount` only if the balance covers it, a negative amount is refused
+    bool try_debit(AccountId account_id, Cash amount)
+    {
+        if (amount < 0)
+        {
+            return false;
+        }
+        auto &value = balances[account_id].value;
+        Cash current = value.load(std::memory_order_acquire);
+        while (current >= amount)
+        {
+            if (value.compare_exchange_weak(current, current - amount, std::memory_order_acq_rel, std::memory_order_acquire))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    struct alignas(CACHE_LINE_SIZE) Balance
+    {
+        std::atomic<Cash> value{0};
+    };
+
+    std::unique_ptr<Balance[]> balances;
+    size_t balance_count;
+};
+
+/*
+    One shard's access to the shared ledger. Next to every change it keeps the
+    shard's own net change per account: the ledger is only ever added to, so it
+    is the sum of what every shard has done to it, and a shard can snapshot and
+    restore its share without stopping the others.
+*/
+class ShardLedger
+{
+public:
+    explicit ShardLedger(CashLedger &cash_ledger) : cash_ledger(cash_ledger) {}
+
+    void open_account(AccountId account_id)
+    {
+        if (account_id >= net_changes.size())
+        {
+            net_changes.resize(account_id + 1, 0);
+        }
+    }
+
+    void credit(AccountId account_id, Cash amount)
+    {
+        cash_ledger.credit(account_id, amount);
+        net_changes[account_id] += amount;
+    }
+
+    void debit(AccountId account_id, Cash amount)
+    {
+        cash_ledger.debit(account_id, amount);
+        net_changes[account_id] -= amount;
+    }
+
+    bool try_debit(AccountId account_id, Cash amount)
+    {
+        if (!cash_ledger.try_debit(account_id, amount))
+        {
+            return false;
+        }
+        net_changes[account_id] -= amount;
+        return true;
+    }
+
+    const std::vector<Cash> &changes() const { return net_changes; }
+
+    // re-applies a snapshotted share to the shared ledger
+    void restore(const std::vector<Cash> &changes)
+    {
+        net_changes = changes;
+        for (size_t account_id = 0; account_id < changes.size(); account_id++)
+        {
+            if (changes[account_id] > 0)
+            {
+                cash_ledger.credit(static_cast<AccountId>(account_id), changes[account_id]);
+            }
+            else if (changes[account_id] < 0)
+            {
+                cash_ledger.debit(static_cast<AccountId>(account_id), -changes[account_id]);
+            }
+        }
+    }
+
+private:
+    CashLedger &cash_ledger;
+    std::vector<Cash> net_changes; // indexed by AccountId
+};
+
+/*
+    Append-only journal of fixed-size records for one shard. Records are written
+    straight into memory-mapped segment files, so the log never reallocates and
+    survives a restart; without a path the segments are anonymous memory.
+    Segments that only hold records a snapshot already covers can be released,
+    so the table is a window over the last JOURNAL_MAX_SEGMENTS segments and a
+    log that is released behind its snapshots never fills up.
+    Appends are group-committed: the engine syncs the dirty range once per
+    drained batch according to the fsync policy. Records are never rewritten
+    while the engine runs, so a reader that learned the record count from the
+    engine thread can read them from the mapping directly without copying.
+*/
+template <typename Record>
+class MappedLog
+{
+public:
+    MappedLog() : segments(new Record *[JOURNAL_MAX_SEGMENTS]()) {}
+
+    MappedLog(const MappedLog &) = delete;
+    MappedLog &operator=(const MappedLog &) = delete;
+
+    ~MappedLog()
+    {
+        for (size_t segment = first_segment; segment < segment_count; segment++)
+        {
+            munmap(segments[segment % JOURNAL_MAX_SEGMENTS], segment_bytes());
+        }
+    }
+
+    // maps any existing segments under `path_prefix`, from the oldest one not released, and carries on after their last record
+    bool open(const std::string &journal_path_prefix, FsyncPolicy policy)
+    {
+        path_prefix = journal_path_prefix;
+        fsync_policy = path_prefix.empty() ? FsyncPolicy::none : policy;
+        first_segment = segment_count = path_prefix.empty() ? 0 : oldest_segment_on_disk();
+        record_count = first();
+        while (!path_prefix.empty() && access(segment_path(segment_count).c_str(), F_OK) == 0)
+        {
+            if (!map_segment(segment_count))
+            {
+                return false;
+            }
+        }
+
+        // records are numbered from 1 and a segment is zero-filled past its last record
+        while (record_count < segment_count * JOURNAL_SEGMENT_RECORDS && (*this)[record_count].id == static_cast<decltype(Record::id)>(record_count) + 1)
+        {
+            record_count++;
+        }
+        synced_count = record_count;
+        return true;
+    }
+
+    bool persistent() const { return !path_prefix.empty(); }
+
+    size_t size() const { return record_count; }
+
+    // the index of the oldest record still held, records before it have been released
+    size_t first() const { return first_segment * JOURNAL_SEGMENT_RECORDS; }
+
+    const Record &operator[](size_t index) const { return segments[(index / JOURNAL_SEGMENT_RECORDS) % JOURNAL_MAX_SEGMENTS][index % JOURNAL_SEGMENT_RECORDS]; }
+
+    /*
+        Engine thread only, the returned record stays in place until the log is
+        truncated. Null when the log cannot grow, its window is full or a new
+        segment could not be mapped; the record is then lost and counted in
+        failed_appends for the engine to report, the engine carries on.
+    */
+    Record *append(const Record &record)
+    {
+        if (record_count == segment_count * JOURNAL_SEGMENT_RECORDS && !map_segment(segment_count))
+        {
+            failed_append_count++;
+            return nullptr;
+        }
+        auto &slot = record_at(record_count);
+        slot = record;
+        record_count++;
+        return &slot;
+    }
+
+    size_t failed_appends() const { return failed_append_count; }
+
+    // drops every record from `count` on, so a replay can write them again; only before the engine starts
+    void truncate(size_t count)
+    {
+        for (size_t index = count; index < record_count; index++)
+        {
+            std::memset(&record_at(index), 0, sizeof(Record));
+        }
+        if (count < record_count)
+        {
+            sync(count, record_count);
+            record_count = count;
+        }
+        synced_count = std::min(synced_count, record_count);
+    }
+
+    // called by the engine once per drained batch
+    void commit(Timestamp now)
+    {
+        if (synced_count == record_count || fsync_policy == FsyncPolicy::none)
+        {
+            return;
+        }
+        if (fsync_policy == FsyncPolicy::interval && now - last_sync < JOURNAL_FSYNC_INTERVAL_MS * NS_PER_MS)
+        {
+            return;
+        }
+        sync(synced_count, record_count);
+        synced_count = record_count;
+        last_sync = now;
+    }
+
+    void flush()
+    {
+        if (fsync_policy != FsyncPolicy::none && synced_count != record_count)
+        {
+            sync(synced_count, record_count);
+            synced_count = record_count;
+        }
+    }
+
+    /*
+        Unmaps, and deletes the files of, the segments that only hold records
+        before `count`; the segment being appended to always stays. Only for a
+        log that no other thread reads, after the records have been flushed.
+    */
+    void release_before(size_t count)
+    {
+        while (first_segment + 1 < segment_count && (first_segment + 1) * JOURNAL_SEGMENT_RECORDS <= count)
+        {
+            munmap(segments[first_segment % JOURNAL_MAX_SEGMENTS], segment_bytes());
+            segments[first_segment % JOURNAL_MAX_SEGMENTS] = nullptr;
+            if (!path_prefix.empty())
+            {
+                unlink(segment_path(first_segment).c_str());
+            }
+            first_segment++;
+        }
+    }
+
+private:
+    static size_t segment_bytes() { return JOURNAL_SEGMENT_RECORDS * sizeof(Record); }
+
+    Record &record_at(size_t index) { return segments[(index / JOURNAL_SEGMENT_RECORDS) % JOURNAL_MAX_SEGMENTS][index % JOURNAL_SEGMENT_RECORDS]; }
+
+    std::string segment_path(size_t segment) const
+    {
+        std::ostringstream path;
+        path << path_prefix << "." << std::setw(6) << std::setfill('0') << segment << ".journal";
+        return path.str();
+    }
+
+    // glob sorts the zero-padded numbers, so the first match is the oldest segment
+    size_t oldest_segment_on_disk() const
+    {
+        glob_t matches;
+        size_t segment = 0;
+        if (glob((path_prefix + ".[0-9][0-9][0-9][0-9][0-9][0-9].journal").c_str(), 0, nullptr, &matches) == 0)
+        {
+            segment = std::strtoull(matches.gl_pathv[0] + path_prefix.size() + 1, nullptr, 10);
+            globfree(&matches);
+        }
+        return segment;
+    }
+
+    bool map_segment(size_t segment)
+    {
+        if (segment - first_segment >= JOURNAL_MAX_SEGMENTS)
+        {
+            return false;
+        }
+
+        void *memory;
+        if (path_prefix.empty())
+        {
+            memory = mmap(nullptr, segment_bytes(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        }
+        else
+        {
+            int fd = ::open(segment_path(segment).c_str(), O_RDWR | O_CREAT, 0644);
+            if (fd < 0)
+            {
+                return false;
+            }
+            if (ftruncate(fd, static_cast<off_t>(segment_bytes())) != 0)
+            {
+                close(fd);
+                return false;
+            }
+            memory = mmap(nullptr, segment_bytes(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            close(fd);
+        }
+        if (memory == MAP_FAILED)
+        {
+            return false;
+        }
+        segments[segment % JOURNAL_MAX_SEGMENTS] = static_cast<Record *>(memory);
+        segment_count++;
+        return true;
+    }
+
+    // msync wants a page-aligned start, so each segment's dirty range is widened down to its page
+    void sync(size_t first, size_t last)
+    {
+        static const uintptr_t page_mask = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE)) - 1;
+        while (first < last)
+        {
+            size_t segment = first / JOURNAL_SEGMENT_RECORDS;
+            size_t end = std::min(last, (segment + 1) * JOURNAL_SEGMENT_RECORDS);
+            auto begin_address = reinterpret_cast<uintptr_t>(&record_at(first));
+            auto end_address = reinterpret_cast<uintptr_t>(segments[segment % JOURNAL_MAX_SEGMENTS]) + (end - segment * JOURNAL_SEGMENT_RECORDS) * sizeof(Record);
+            auto page_address = begin_address & ~page_mask;
+            msync(reinterpret_cast<void *>(page_address), end_address - page_address, MS_SYNC);
+            first = end;
+        }
+    }
+
+    std::string path_prefix;
+    FsyncPolicy fsync_policy = FsyncPolicy::none;
+    std::unique_ptr<Record *[]> segments; // fixed table so readers never see it move, segment n is at n % JOURNAL_MAX_SEGMENTS
+    size_t first_segment = 0;             // the oldest segment still mapped
+    size_t segment_count = 0;             // one past the newest
+    size_t record_count = 0;
+    size_t synced_count = 0;
+    size_t failed_append_count = 0;
+    Timestamp last_sync = 0;
+};
+
+using TradeJournal = MappedLog<Transaction>;
+using InputLog = MappedLog<InputRecord>;
+
+/*
+    Outbound execution reports of one shard, written by its matching thread and
+    drained by the report output thread. The engine only ever tries to push: a
+    full ring drops the report and counts it, so slow formatting or slow clients
+    never hold matching up. Every report is numbered per session before it is
+    pushed, so whoever receives a session's reports can tell one went missing.
+    Replay disables the channel, its reports went out when the inputs first ran.
+*/
+class ReportChannel
+{
+public:
+    ReportChannel(uint32_t shard, size_t capacity) : shard(shard), reports(capacity) {}
+
+    void publish(const Order &order, ReportType type, RejectReason reason, Quantity last_quantity, Price last_price, Timestamp timestamp)
+    {
+        if (!enabled)
+        {
+            return;
+        }
+        ExecutionReport report{order.id, order.account_id, order.session, shard, type, reason, order.is_buy ? Side::buy : Side::sell, last_quantity, last_price, order.quantity, timestamp, ++session_sequences[order.session]};
+        if (!reports.try_push(std::move(report)))
+        {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    size_t drain(ExecutionReport *values, size_t max_count) { return reports.try_pop_batch(values, max_count); }
+
+    // for a drained report that was lost further on, so the count covers every report that did not arrive
+    void count_dropped() { dropped.fetch_add(1, std::memory_order_relaxed); }
+
+    uint64_t dropped_count() const { return dropped.load(std::memory_order_relaxed); }
+
+    void set_enabled(bool value) { enabled = value; }
+
+private:
+    uint32_t shard;
+    SpscRing<ExecutionReport> reports;
+    FlatHashMap<uint32_t, uint64_t> session_sequences; // the last sequence given to each session, matching thread only
+    std::atomic<uint64_t> dropped{0};
+    bool enabled = true;
+};
+
+class OrderBook
+{
+public:
+    explicit OrderBook(OrderId first_order_id = 1) : order_index(ORDER_INDEX_RESERVE), order_pool(ORDER_POOL_RESERVE), order_id_sequencer(first_order_id) {}
+
+    void set_self_trade_prevention(SelfTradePrevention mode) { self_trade_prevention = mode; }
+
+    void set_risk_limits(const RiskLimits &value) { risk_limits = value; }
+
+    // fills and self-trade cancels found while matching are reported here
+    void set_report_channel(ReportChannel *channel) { reports = channel; }
+
+    void add_order(Order &order)
+    {
+        if (order.is_buy)
+        {
+            add_order_on(buy_side, order);
+        }
+        else
+        {
+            add_order_on(sell_side, order);
+        }
+    }
+
+    void remove_order(const OrderId &order_id)
+    {
+        if (order_id == 0)
+        {
+            return;
+        }
+        auto handle = order_index.find(order_id);
+        if (handle == nullptr)
+        {
+            return;
+        }
+
+        if (handle->is_buy)
+        {
+            unlink_order(buy_side, buy_side.level(handle->level), handle->node);
+        }
+        else
+        {
+            unlink_order(sell_side, sell_side.level(handle->level), handle->node);
+        }
+    }
+
+    // reduces a resting order in place, keeping its queue position
+    bool reduce_order(const OrderId &order_id, Quantity quantity)
+    {
+        auto handle = order_index.find(order_id);
+        if (handle == nullptr)
+        {
+            return false;
+        }
+
+        auto &level = handle->is_buy ? buy_side.level(handle->level) : sell_side.level(handle->level);
+        auto &order = order_pool[handle->node].order;
+        if (quantity <= 0 || quantity > order.quantity)
+        {
+            return false;
+        }
+        level.total_quantity -= order.quantity - quantity;
+        resting_changed(order, quantity - order.quantity);
+        order.quantity = quantity;
+        level_changed(order.is_buy, order.price);
+        return true;
+    }
+
+    // ids of the account's resting orders within `scope`, found through the account's own list rather than a scan of the book
+    void collect_account_orders(AccountId account_id, CancelScope scope, uint32_t session, std::vector<OrderId> &order_ids) const
+    {
+        order_ids.clear();
+        if (account_id >= account_orders.size())
+        {
+            return;
+        }
+        for (auto node = account_orders[account_id].first_order; node != NULL_NODE; node = order_pool[node].account_next)
+        {
+            auto &order = order_pool[node].order;
+            if ((scope == CancelScope::buys && !order.is_buy) || (scope == CancelScope::sells && order.is_buy) || (scope == CancelScope::session && order.session != session))
+            {
+                continue;
+            }
+            order_ids.push_back(order.id);
+        }
+    }
+
+    bool find_order(const OrderId &order_id, Order &order) const
+    {
+        auto handle = order_index.find(order_id);
+        if (handle == nullptr)
+        {
+            return false;
+        }
+
+        order = order_pool[handle->node].order;
+        return true;
+    }
+
+    // the buyer paid out of the cash its order reserved when it was admitted, so only the seller is credited here
+    Cash settle_accounts(AccountId buyer, AccountId seller, Quantity quantity, Price price, Side aggressor, Timestamp timestamp, ShardLedger &ledger, std::vector<Quantity> &coin_balances, TradeJournal &journal, std::vector<uint32_t> &last_transactions)
+    {
+        Cash cash = notional(quantity, price);
+        ledger.credit(seller, cash);
+        record_fill(buyer, seller, quantity, price, aggressor, timestamp, coin_balances, journal, last_transactions);
+        return cash;
+    }
+
+    // returns the cash that changed hands
+    Cash match_order(Order &order, Timestamp timestamp, ShardLedger &ledger, std::vector<Quantity> &coin_balances, TradeJournal &journal, std::vector<uint32_t> &last_transactions)
+    {
+        return order.is_buy ? match_order_on(sell_side, order, timestamp, ledger, coin_balances, journal, last_transactions) : match_order_on(buy_side, order, timestamp, ledger, coin_balances, journal, last_transactions);
+    }
+
+    /*
+        The single price a call auction uncrosses the book at: the one that
+        executes the most volume, then leaves the smallest imbalance, then the
+        highest for a buy surplus and the lowest otherwise. One sweep over the
+        aggregated levels that cross; false when the book does not cross.
+    */
+    bool find_uncrossing_price(Price &price, Quantity &volume) const
+    {
+        if (buy_side.empty() || sell_side.empty() || buy_side.level_from_best(0).price < sell_side.level_from_best(0).price)
+        {
+            return false;
+        }
+
+        // the crossing levels of each side in ascending price, nothing outside [best ask, best bid] can trade
+        Price best_bid = buy_side.level_from_best(0).price;
+        Price best_ask = sell_side.level_from_best(0).price;
+        std::vector<Level_Summary> bids;
+        std::vector<Level_Summary> asks;
+        Quantity demand = 0;
+        for (size_t n = 0; n < buy_side.level_count() && buy_side.level_from_best(n).price >= best_ask; n++)
+        {
+            auto &level = buy_side.level_from_best(n);
+            bids.push_back(Level_Summary{level.price, level.total_quantity, level.order_count});
+            demand += level.total_quantity;
+        }
+        std::reverse(bids.begin(), bids.end());
+        for (size_t n = 0; n < sell_side.level_count() && sell_side.level_from_best(n).price <= best_bid; n++)
+        {
+            auto &level = sell_side.level_from_best(n);
+            asks.push_back(Level_Summary{level.price, level.total_quantity, level.order_count});
+        }
+
+        // walking the candidate prices upwards, demand only loses the bids below and supply only gains the asks at or below
+        volume = 0;
+        Quantity best_imbalance = 0;
+        Quantity supply = 0;
+        size_t bid = 0;
+        size_t ask = 0;
+        while (bid < bids.size() || ask < asks.size())
+        {
+            Price candidate = ask == asks.size() || (bid < bids.size() && bids[bid].price < asks[ask].price) ? bids[bid].price : asks[ask].price;
+            while (ask < asks.size() && asks[ask].price == candidate)
+            {
+                supply += asks[ask++].quantity;
+            }
+            Quantity executable = std::min(demand, supply);
+            Quantity imbalance = demand > supply ? demand - supply : supply - demand;
+            if (executable > volume || (executable == volume && (imbalance < best_imbalance || (imbalance == best_imbalance && demand > supply))))
+            {
+                price = candidate;
+                volume = executable;
+                best_imbalance = imbalance;
+            }
+            while (bid < bids.size() && bids[bid].price == candidate)
+            {
+                demand -= bids[bid++].quantity;
+            }
+        }
+        return volume > 0;
+    }
+
+    /*
+        Executes every cross of a call auction at the uncrossing price, best
+        prices first and each level in time priority. Each buyer pays out of
+        the cash reserved at its limit and gets the difference back, and each
+        account's USD moves are netted into one ledger change at the end. An
+        account crossing its own orders has both reduced without a trade,
+        whatever the self-trade prevention mode. Returns the volume traded.
+    */
+    Quantity uncross(Timestamp timestamp, ShardLedger &ledger, std::vector<Quantity> &coin_balances, TradeJournal &journal, std::vector<uint32_t> &last_transactions, Price &price)
+    {
+        Quantity remaining;
+        if (!find_uncrossing_price(price, remaining))
+        {
+            return 0;
+        }
+
+        Quantity traded = 0;
+        std::vector<Cash> cash_changes(coin_balances.size(), 0);
+        while (remaining > 0 && !buy_side.empty() && !sell_side.empty() && buy_side.best().price >= price && sell_side.best().price <= price)
+        {
+            auto &bid_level = buy_side.best();
+            auto &ask_level = sell_side.best();
+            auto bid_node = bid_level.head;
+            auto ask_node = ask_level.head;
+            auto &bid = order_pool[bid_node].order;
+            auto &ask = order_pool[ask_node].order;
+            bool self_trade = bid.account_id == ask.account_id;
+            Quantity fill_quantity = self_trade ? std::min(bid.quantity, ask.quantity) : std::min({remaining, bid.quantity, ask.quantity});
+            if (!self_trade)
+            {
+                // the later of the two orders is recorded as the aggressor
+                record_fill(bid.account_id, ask.account_id, fill_quantity, price, bid.id > ask.id ? Side::buy : Side::sell, timestamp, coin_balances, journal, last_transactions);
+                cash_changes[bid.account_id] -= notional(fill_quantity, price);
+                cash_changes[ask.account_id] += notional(fill_quantity, price);
+                remaining -= fill_quantity;
+                traded += fill_quantity;
+            }
+            cash_changes[bid.account_id] += notional(fill_quantity, bid.price);
+
+            bid.quantity -= fill_quantity;
+            ask.quantity -= fill_quantity;
+            bid_level.total_quantity -= fill_quantity;
+            ask_level.total_quantity -= fill_quantity;
+            resting_changed(bid, -fill_quantity);
+            resting_changed(ask, -fill_quantity);
+            level_changed(true, bid_level.price);
+            level_changed(false, ask_level.price);
+            for (auto order : {&bid, &ask})
+            {
+                if (self_trade)
+                {
+                    if (order->quantity == 0)
+                    {
+                        report(*order, ReportType::cancelled, RejectReason::self_trade, 0, 0, timestamp);
+                    }
+                }
+                else
+                {
+                    report(*order, order->quantity == 0 ? ReportType::filled : ReportType::partially_filled, RejectReason::none, fill_quantity, price, timestamp);
+                }
+            }
+            if (bid.quantity == 0)
+            {
+                unlink_order(buy_side, bid_level, bid_node);
+            }
+            if (ask.quantity == 0)
+            {
+                unlink_order(sell_side, ask_level, ask_node);
+            }
+        }
+
+        for (size_t account_id = 0; account_id < cash_changes.size(); account_id++)
+        {
+            if (cash_changes[account_id] > 0)
+            {
+                ledger.credit(static_cast<AccountId>(account_id), cash_changes[account_id]);
+            }
+            else if (cash_changes[account_id] < 0)
+            {
+                ledger.debit(static_cast<AccountId>(account_id), -cash_changes[account_id]);
+            }
+        }
+        return traded;
+    }
+
+    /*
+        The USD side of a buy is checked when its cash is reserved in the
+        shared ledger. Coin and the account limits are checked against what the
+        account's resting orders already hold, net of the resting order a
+        cancel-replace with the same id takes over. Fill-or-kill and post-only
+        orders are decided here from the level aggregates, so neither ever
+        needs its fills rolled back; a fill-or-kill order facing its own
+        account's resting orders is rejected since self-trade prevention could
+        stop it short.
+    */
+    bool is_allowed_order(Order &order, std::vector<Quantity> &coin_balances, RejectReason &reason) const
+    {
+        return order.is_buy ? is_allowed_order_on(sell_side, order, coin_balances, reason) : is_allowed_order_on(buy_side, order, coin_balances, reason);
+    }
+
+    // counts a new order or amend in the account's one-second window, false once the window is over its limit
+    bool count_message(AccountId account_id, Timestamp timestamp)
+    {
+        if (account_id >= account_orders.size())
+        {
+            account_orders.resize(account_id + 1);
+        }
+        auto &account = account_orders[account_id];
+        if (timestamp - account.rate_window_start >= NS_PER_SECOND)
+        {
+            account.rate_window_start = timestamp;
+            account.rate_window_messages = 0;
+        }
+        account.rate_window_messages++;
+        return risk_limits.max_messages_per_second == 0 || account.rate_window_messages <= risk_limits.max_messages_per_second;
+    }
+
+    Cash reserved_cash(AccountId account_id) const { return account_id < account_orders.size() ? account_orders[account_id].buy_notional : 0; }
+
+    Quantity reserved_coin(AccountId account_id) const { return account_id < account_orders.size() ? account_orders[account_id].sell_quantity : 0; }
+
+    // the worst price a market order needs to sweep its quantity off the visible book, 0 when the other side is empty
+    Price market_price(const Order &order) const
+    {
+        Price last_price = 0;
+        bool own_orders;
+        opposite_quantity(order, order.is_buy ? std::numeric_limits<Price>::max() : std::numeric_limits<Price>::min(), last_price, own_orders);
+        return last_price;
+    }
+
+    const Order construct_order(AccountId account_id, Side side, Quantity quantity, Price price, Timestamp timestamp, OrderType type = OrderType::limit) const
+    {
+        Order order{};
+        order.id = order_id_sequencer.next();
+        order.account_id = account_id;
+        order.is_buy = side == Side::buy;
+        order.type = type;
+        order.quantity = quantity;
+        order.price = price;
+        order.timestamp = timestamp;
+        order.session = 0;
+        return order;
+    }
+
+    // aggregated levels from the best price outwards
+    void snapshot_levels(bool is_buy, std::vector<Level_Summary> &levels) const
+    {
+        if (is_buy)
+        {
+            summarize_levels(buy_side, levels);
+        }
+        else
+        {
+            summarize_levels(sell_side, levels);
+        }
+    }
+
+    // the best MARKET_DEPTH_LEVELS of each side
+    void snapshot_depth(DepthSnapshot &depth) const
+    {
+        depth.bid_count = static_cast<int>(std::min<size_t>(buy_side.level_count(), MARKET_DEPTH_LEVELS));
+        depth.ask_count = static_cast<int>(std::min<size_t>(sell_side.level_count(), MARKET_DEPTH_LEVELS));
+        for (int n = 0; n < depth.bid_count; n++)
+        {
+            auto &level = buy_side.level_from_best(n);
+            depth.bids[n] = Level_Summary{level.price, level.total_quantity, level.order_count};
+        }
+        for (int n = 0; n < depth.ask_count; n++)
+        {
+            auto &level = sell_side.level_from_best(n);
+            depth.asks[n] = Level_Summary{level.price, level.total_quantity, level.order_count};
+        }
+    }
+
+    // one update per level whose aggregate changed since the last call, in no particular order
+    void collect_level_updates(std::vector<LevelUpdate> &updates)
+    {
+        updates.clear();
+        std::sort(changed_levels.begin(), changed_levels.end());
+        changed_levels.erase(std::unique(changed_levels.begin(), changed_levels.end()), changed_levels.end());
+        for (auto &changed : changed_levels)
+        {
+            bool is_buy = changed.first;
+            auto level = is_buy ? buy_side.find_level(changed.second) : sell_side.find_level(changed.second);
+            updates.push_back(LevelUpdate{0, 0, is_buy ? Side::buy : Side::sell, changed.second, level == nullptr ? 0 : level->total_quantity, level == nullptr ? 0 : level->order_count});
+        }
+        changed_levels.clear();
+    }
+
+    // every resting order, each side from the best level outwards in queue order, so adding them back restores priority
+    void snapshot_orders(std::vector<Order> &orders) const
+    {
+        orders.clear();
+        for_each_resting([this, &orders](uint32_t node)
+                         { orders.push_back(order_pool[node].order); });
+    }
+
+    OrderId next_order_id() const { return order_id_sequencer.peek(); }
+
+    // sessions belong to the process that accepted them, so restored orders report to nobody
+    void clear_sessions()
+    {
+        for_each_resting([this](uint32_t node)
+                         { order_pool[node].order.session = 0; });
+    }
+
+    void report(const Order &order, ReportType type, RejectReason reason, Quantity last_quantity, Price last_price, Timestamp timestamp)
+    {
+        if (reports != nullptr)
+        {
+            reports->publish(order, type, reason, last_quantity, last_price, timestamp);
+        }
+    }
+
+    void advance_order_id_past(OrderId order_id) { order_id_sequencer.advance_past(order_id); }
+
+private:
+    void level_changed(bool is_buy, Price price) { changed_levels.emplace_back(is_buy, price); }
+
+    template <Side S>
+    void add_order_on(BookSide<S> &order_book_side, Order &order)
+    {
+        constexpr bool is_buy = SideTraits<S>::is_buy;
+        auto level_index = order_book_side.find_or_insert_level(order.price);
+        auto &level = order_book_side.level(level_index);
+        auto node = order_pool.acquire(order);
+        order_index[order.id] = Order_Handle{is_buy, level_index, node};
+        order_pool[node].prev = level.tail;
+        if (level.tail != NULL_NODE)
+        {
+            order_pool[level.tail].next = node;
+        }
+        else
+        {
+            level.head = node;
+        }
+        level.tail = node;
+        level.total_quantity += order.quantity;
+        level.order_count++;
+        level_changed(is_buy, order.price);
+        account_orders_at_price(order.account_id, is_buy)[order.price]++;
+        auto &orders = account_orders[order.account_id];
+        orders.open_orders++;
+        order_pool[node].account_next = orders.first_order;
+        if (orders.first_order != NULL_NODE)
+        {
+            order_pool[orders.first_order].account_prev = node;
+        }
+        orders.first_order = node;
+        resting_changed(order, order.quantity);
+    }
+
+    // matches an incoming order against the resting side S, which is never the order's own side
+    template <Side S>
+    Cash match_order_on(BookSide<S> &order_book_side, Order &order, Timestamp timestamp, ShardLedger &ledger, std::vector<Quantity> &coin_balances, TradeJournal &journal, std::vector<uint32_t> &last_transactions)
+    {
+        constexpr bool resting_is_buy = SideTraits<S>::is_buy;
+        Cash traded = 0;
+        while (order.quantity > 0 && !order_book_side.empty())
+        {
+            auto &level = order_book_side.best();
+            if (order_book_side.is_better(order.price, level.price))
+            {
+                break;
+            }
+
+            // resting orders are filled and partially filled in place, keeping their queue position
+            auto resting_node = level.head;
+            auto &resting = order_pool[resting_node].order;
+            if (order.account_id == resting.account_id)
+            {
+                if (self_trade_prevention == SelfTradePrevention::cancel_newest)
+                {
+                    order.quantity = 0;
+                    report(order, ReportType::cancelled, RejectReason::self_trade, 0, 0, timestamp);
+                    break;
+                }
+
+                Quantity overlap = self_trade_prevention == SelfTradePrevention::decrement ? std::min(order.quantity, resting.quantity) : 0;
+                order.quantity -= overlap;
+                resting.quantity -= overlap;
+                level.total_quantity -= overlap;
+                resting_changed(resting, -overlap);
+                level_changed(resting_is_buy, level.price);
+                bool cancelled = self_trade_prevention == SelfTradePrevention::cancel_oldest || resting.quantity == 0;
+                if (resting_is_buy)
+                {
+                    // what a resting buy loses without trading goes back to its account
+                    ledger.credit(resting.account_id, notional(overlap + (cancelled ? resting.quantity : 0), resting.price));
+                }
+                if (cancelled)
+                {
+                    report(resting, ReportType::cancelled, RejectReason::self_trade, 0, 0, timestamp);
+                    unlink_order(order_book_side, level, resting_node);
+                }
+                if (order.quantity == 0)
+                {
+                    report(order, ReportType::cancelled, RejectReason::self_trade, 0, 0, timestamp);
+                }
+                continue;
+            }
+
+            Quantity fill_quantity = std::min(order.quantity, resting.quantity);
+            auto buyer = resting_is_buy ? resting.account_id : order.account_id;
+            auto seller = resting_is_buy ? order.account_id : resting.account_id;
+            traded += settle_accounts(buyer, seller, fill_quantity, resting.price, resting_is_buy ? Side::sell : Side::buy, timestamp, ledger, coin_balances, journal, last_transactions);
+
+            order.quantity -= fill_quantity;
+            resting.quantity -= fill_quantity;
+            level.total_quantity -= fill_quantity;
+            resting_changed(resting, -fill_quantity);
+            level_changed(resting_is_buy, level.price);
+            report(resting, resting.quantity == 0 ? ReportType::filled : ReportType::partially_filled, RejectReason::none, fill_quantity, resting.price, timestamp);
+            report(order, order.quantity == 0 ? ReportType::filled : ReportType::partially_filled, RejectReason::none, fill_quantity, resting.price, timestamp);
+            if (resting.quantity == 0)
+            {
+                unlink_order(order_book_side, level, resting_node);
+            }
+        }
+        return traded;
+    }
+
+    template <Side S>
+    bool is_allowed_order_on(const BookSide<S> &opposite_side, Order &order, std::vector<Quantity> &coin_balances, RejectReason &reason) const
+    {
+        Price last_price;
+        bool own_orders;
+        int open_orders;
+        Quantity sell_quantity;
+        Cash open_notional;
+        exposure(order, open_orders, sell_quantity, open_notional);
+        if (order.account_id >= coin_balances.size())
+        {
+            reason = RejectReason::unknown_account;
+        }
+        // a market order has no price of its own until the book gives it one, an empty book is rejected below instead
+        else if (order.quantity <= 0 || (!(order.type == OrderType::market && opposite_side.empty()) && !valid_order_size(order.quantity, order.price)))
+        {
+            reason = RejectReason::invalid_order;
+        }
+        else if (SideTraits<S>::is_buy && coin_balances[order.account_id] - sell_quantity < order.quantity)
+        {
+            reason = RejectReason::insufficient_coin;
+        }
+        else if (risk_limits.max_open_orders > 0 && open_orders >= risk_limits.max_open_orders)
+        {
+            reason = RejectReason::too_many_orders;
+        }
+        else if (risk_limits.max_open_notional > 0 && open_notional + notional(order.quantity, order.price) > risk_limits.max_open_notional)
+        {
+            reason = RejectReason::notional_limit;
+        }
+        else if (order.type == OrderType::market && opposite_side.empty())
+        {
+            reason = RejectReason::no_liquidity;
+        }
+        else if (order.type == OrderType::post_only && !opposite_side.empty() && !opposite_side.is_better(order.price, opposite_side.level_from_best(0).price))
+        {
+            reason = RejectReason::would_cross;
+        }
+        else if (order.type == OrderType::fok && (opposite_quantity_on(opposite_side, order, order.price, last_price, own_orders) < order.quantity || own_orders))
+        {
+            reason = RejectReason::would_not_fill;
+        }
+        // the other modes resolve self-trades while matching instead of rejecting up front
+        else if (self_trade_prevention == SelfTradePrevention::cancel_newest && resting_orders_at_price(order.account_id, SideTraits<S>::is_buy, order.price) > 0)
+        {
+            reason = RejectReason::self_trade;
+        }
+        else
+        {
+            reason = RejectReason::none;
+        }
+        return reason == RejectReason::none;
+    }
+
+    // aggregated levels from the best price outwards
+    template <Side S>
+    static void summarize_levels(const BookSide<S> &order_book_side, std::vector<Level_Summary> &levels)
+    {
+        levels.clear();
+        for (size_t n = 0; n < order_book_side.level_count(); n++)
+        {
+            auto &level = order_book_side.level_from_best(n);
+            levels.push_back(Level_Summary{level.price, level.total_quantity, level.order_count});
+        }
+    }
+
+    // calls `visit` with the node of every resting order, each side from the best level outwards in queue order
+    template <typename Visit>
+    void for_each_resting(Visit visit) const
+    {
+        auto visit_side = [this, &visit](const auto &order_book_side)
+        {
+            for (size_t n = 0; n < order_book_side.level_count(); n++)
+            {
+                for (auto node = order_book_side.level_from_best(n).head; node != NULL_NODE; node = order_pool[node].next)
+                {
+                    visit(node);
+                }
+            }
+        };
+        visit_side(buy_side);
+        visit_side(sell_side);
+    }
+
+    // keeps the account's exposure in step with a change of `quantity` to one of its resting orders
+    void resting_changed(const Order &order, Quantity quantity)
+    {
+        auto &account = account_orders[order.account_id];
+        if (order.is_buy)
+        {
+            account.buy_notional += notional(quantity, order.price);
+        }
+        else
+        {
+            account.sell_quantity += quantity;
+            account.sell_notional += notional(quantity, order.price);
+        }
+    }
+
+    // the account's resting exposure without the resting order `order` would replace
+    void exposure(const Order &order, int &open_orders, Quantity &sell_quantity, Cash &open_notional) const
+    {
+        open_orders = 0;
+        sell_quantity = 0;
+        open_notional = 0;
+        if (order.account_id < account_orders.size())
+        {
+            auto &account = account_orders[order.account_id];
+            open_orders = account.open_orders;
+            sell_quantity = account.sell_quantity;
+            open_notional = account.buy_notional + account.sell_notional;
+        }
+        auto handle = order_index.find(order.id);
+        if (handle != nullptr)
+        {
+            auto &replaced = order_pool[handle->node].order;
+            open_orders--;
+            sell_quantity -= replaced.is_buy ? 0 : replaced.quantity;
+            open_notional -= notional(replaced.quantity, replaced.price);
+        }
+    }
+
+    /*
+        One pass over the other side from the touch: the quantity resting at
+        prices no worse than `limit`, stopping once the order's quantity is
+        covered. `last_price` is the last level it reached and `own_orders`
+        whether the order's account rests at any of those levels.
+    */
+    Quantity opposite_quantity(const Order &order, Price limit, Price &last_price, bool &own_orders) const
+    {
+        return order.is_buy ? opposite_quantity_on(sell_side, order, limit, last_price, own_orders) : opposite_quantity_on(buy_side, order, limit, last_price, own_orders);
+    }
+
+    template <Side S>
+    Quantity opposite_quantity_on(const BookSide<S> &opposite_side, const Order &order, Price limit, Price &last_price, bool &own_orders) const
+    {
+        Quantity available = 0;
+        own_orders = false;
+        for (size_t n = 0; n < opposite_side.level_count() && available < order.quantity; n++)
+        {
+            auto &level = opposite_side.level_from_best(n);
+            if (opposite_side.is_better(limit, level.price))
+            {
+                break;
+            }
+            available += level.total_quantity;
+            last_price = level.price;
+            own_orders = own_orders || resting_orders_at_price(order.account_id, SideTraits<S>::is_buy, level.price) > 0;
+        }
+        return available;
+    }
+
+    // the coin side of a fill and its journal record
+    void record_fill(AccountId buyer, AccountId seller, Quantity quantity, Price price, Side aggressor, Timestamp timestamp, std::vector<Quantity> &coin_balances, TradeJournal &journal, std::vector<uint32_t> &last_transactions)
+    {
+        coin_balances[buyer] += quantity;
+        coin_balances[seller] -= quantity;
+
+        // each fill links back to both accounts' previous fills, so an account's history is a walk through the journal
+        auto position = static_cast<uint32_t>(journal.size()) + 1;
+        Transaction transaction = {static_cast<int>(position), quantity, price, timestamp, buyer, seller, aggressor, last_transactions[buyer], last_transactions[seller]};
+        if (journal.append(transaction) == nullptr)
+        {
+            // the fill stands, the accounts' histories just end before it
+            return;
+        }
+        last_transactions[buyer] = position;
+        last_transactions[seller] = position;
+    }
+
+    FlatHashMap<Price, int> &account_orders_at_price(AccountId account_id, bool is_buy)
+    {
+        if (account_id >= account_orders.size())
+        {
+            account_orders.resize(account_id + 1);
+        }
+        auto &orders = account_orders[account_id];
+        return is_buy ? orders.buy_orders_at_price : orders.sell_orders_at_price;
+    }
+
+    int resting_orders_at_price(AccountId account_id, bool is_buy, Price price) const
+    {
+        if (account_id >= account_orders.size())
+        {
+            return 0;
+        }
+        auto &orders_at_price = is_buy ? account_orders[account_id].buy_orders_at_price : account_orders[account_id].sell_orders_at_price;
+        auto count = orders_at_price.find(price);
+        return count == nullptr ? 0 : *count;
+    }
+
+    // takes a resting order out of every index and its level's queue, and returns its node to the pool
+    template <Side S>
+    void unlink_order(BookSide<S> &order_book_side, PriceLevel &level, uint32_t node)
+    {
+        auto &order_node = order_pool[node];
+        auto &order = order_node.order;
+        order_index.erase(order.id);
+        auto &orders_at_price = account_orders_at_price(order.account_id, SideTraits<S>::is_buy);
+        if (--orders_at_price[order.price] == 0)
+        {
+            orders_at_price.erase(order.price);
+        }
+
+        (order_node.prev != NULL_NODE ? order_pool[order_node.prev].next : level.head) = order_node.next;
+        (order_node.next != NULL_NODE ? order_pool[order_node.next].prev : level.tail) = order_node.prev;
+        (order_node.account_prev != NULL_NODE ? order_pool[order_node.account_prev].account_next : account_orders[order.account_id].first_order) = order_node.account_next;
+        if (order_node.account_next != NULL_NODE)
+        {
+            order_pool[order_node.account_next].account_prev = order_node.account_prev;
+        }
+
+        level.total_quantity -= order.quantity;
+        resting_changed(order, -order.quantity);
+        account_orders[order.account_id].open_orders--;
+        level.order_count--;
+        level_changed(SideTraits<S>::is_buy, level.price);
+        order_pool.release(node);
+        if (level.order_count == 0)
+        {
+            order_book_side.remove_level(level.price);
+        }
+    }
+
+    BookSide<Side::buy> buy_side;
+    BookSide<Side::sell> sell_side;
+    FlatHashMap<OrderId, Order_Handle> order_index;
+    OrderPool order_pool;
+    std::vector<Account_Orders> account_orders;       // indexed by AccountId
+    std::vector<std::pair<bool, Price>> changed_levels; // (is_buy, price) touched since the last collect_level_updates
+    SelfTradePrevention self_trade_prevention = SelfTradePrevention::cancel_newest;
+    RiskLimits risk_limits;
+    mutable OrderIdSequencer order_id_sequencer;
+    ReportChannel *reports = nullptr;
+};
+
+/*
+    Broadcast ring of market-data records in shared memory, written by one
+    shard's matching thread and read in place by any number of processes.
+    Readers never hold the writer back: each slot is a seqlock stamped with its
+    record's sequence, so a reader that falls a whole ring behind sees a newer
+    sequence than it asked for and skips ahead instead of reading torn data.
+*/
+class MarketDataRing
+{
+public:
+    MarketDataRing() = default;
+
+    MarketDataRing(const MarketDataRing &) = delete;
+    MarketDataRing &operator=(const MarketDataRing &) = delete;
+
+    ~MarketDataRing()
+    {
+        if (header != nullptr)
+        {
+            munmap(header, mapped_bytes);
+        }
+        if (owner && !name.empty())
+        {
+            shm_unlink(name.c_str());
+        }
+    }
+
+    // creates the ring as shared memory object `shm_name`, or as memory private to this process when it is empty
+    bool create(const std::string &shm_name, size_t capacity)
+    {
+        capacity = round_up_to_power_of_two(capacity);
+        size_t bytes = slots_offset() + capacity * sizeof(Slot);
+        void *memory;
+        if (shm_name.empty())
+        {
+            memory = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        }
+        else
+        {
+            int fd = shm_open(shm_name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0)
+            {
+                return false;
+            }
+            if (ftruncate(fd, static_cast<off_t>(bytes)) != 0)
+            {
+                close(fd);
+                shm_unlink(shm_name.c_str());
+                return false;
+            }
+            memory = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            close(fd);
+        }
+        if (memory == MAP_FAILED)
+        {
+            return false;
+        }
+
+        name = shm_name;
+        owner = true;
+        mapped_bytes = bytes;
+        header = new (memory) Header;
+        slots = reinterpret_cast<Slot *>(static_cast<char *>(memory) + slots_offset());
+        for (size_t i = 0; i < capacity; i++)
+        {
+            new (&slots[i]) Slot;
+        }
+        mask = capacity - 1;
+        header->capacity = capacity;
+        header->published.store(0, std::memory_order_relaxed);
+        header->magic = MARKET_DATA_RING_MAGIC;
+        return true;
+    }
+
+    // maps a ring another process created, read only
+    bool open(const std::string &shm_name)
+    {
+        int fd = shm_open(shm_name.c_str(), O_RDONLY, 0);
+        if (fd < 0)
+        {
+            return false;
+        }
+        Header stored;
+        bool readable = pread(fd, &stored, sizeof(Header), 0) == static_cast<ssize_t>(sizeof(Header)) && stored.magic == MARKET_DATA_RING_MAGIC;
+        size_t bytes = slots_offset() + stored.capacity * sizeof(Slot);
+        void *memory = readable ? mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+        close(fd);
+        if (memory == MAP_FAILED)
+        {
+            return false;
+        }
+
+        name = shm_name;
+        mapped_bytes = bytes;
+        header = static_cast<Header *>(memory);
+        slots = reinterpret_cast<Slot *>(static_cast<char *>(memory) + slots_offset());
+        mask = stored.capacity - 1;
+        return true;
+    }
+
+    size_t capacity() const { return mask + 1; }
+
+    // sequence of the newest record, 0 before the first
+    uint64_t published() const { return header->published.load(std::memory_order_acquire); }
+
+    // writer only, stamps the record with the next sequence
+    void publish(MarketDataRecord record)
+    {
+        uint64_t sequence = header->published.load(std::memory_order_relaxed) + 1;
+        record.sequence = sequence;
+        slots[(sequence - 1) & mask].store(record);
+        header->published.store(sequence, std::memory_order_release);
+    }
+
+    /*
+        Reads the record at `position` and moves past it. Returns false when
+        the reader has caught up. When the writer has lapped the reader,
+        `position` jumps to the oldest record still in the ring and the number
+        of records skipped is added to `lost`.
+    */
+    bool next(uint64_t &position, MarketDataRecord &record, uint64_t &lost) const
+    {
+        while (position <= published())
+        {
+            record = slots[(position - 1) & mask].load();
+            if (record.sequence == position)
+            {
+                position++;
+                return true;
+            }
+            uint64_t oldest = published() >= capacity() ? published() - capacity() + 1 : 1;
+            lost += oldest > position ? oldest - position : 0;
+            position = std::max(position, oldest);
+        }
+        return false;
+    }
+
+private:
+    struct Header
+    {
+        uint64_t magic;
+        uint64_t capacity;
+        alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> published;
+    };
+
+    using Slot = SeqLock<MarketDataRecord>;
+
+    static size_t slots_offset() { return (sizeof(Header) + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE; }
+
+    Header *header = nullptr;
+    Slot *slots = nullptr;
+    size_t mask = 0;
+    size_t mapped_bytes = 0;
+    std::string name;
+    bool owner = false;
+};
+
+/*
+    A subscriber's end of one shard's level updates. The engine never waits on
+    a slow subscriber: when the ring is full the update is dropped and `overrun`
+    is set, and the subscriber resyncs from the shard's depth snapshot.
+*/
+class MarketDataFeed
+{
+public:
+    explicit MarketDataFeed(size_t capacity = MARKET_DATA_FEED_CAPACITY) : updates(capacity) {}
+
+    bool try_pop(LevelUpdate &update) { return updates.try_pop(update); }
+
+    // true once if updates were dropped since the last call
+    bool take_overrun() { return overrun.exchange(false, std::memory_order_acq_rel); }
+
+    void publish(const LevelUpdate &update)
+    {
+        if (!updates.try_push(LevelUpdate(update)))
+        {
+            overrun.store(true, std::memory_order_release);
+        }
+    }
+
+private:
+    SpscRing<LevelUpdate> updates;
+    std::atomic<bool> overrun{false};
+};
+
+/*
+    L2 market data for one shard. Levels keep their aggregates as orders come
+    and go, so once per drained batch the engine only turns the levels that
+    changed into sequenced updates for the subscribers and refreshes the top of
+    book snapshot, which anyone can read without stopping the engine.
+*/
+class MarketDataPublisher
+{
+public:
+    explicit MarketDataPublisher(uint32_t shard) : shard(shard) {}
+
+    void subscribe(MarketDataFeed *feed) { feeds.push_back(feed); }
+
+    void unsubscribe(MarketDataFeed *feed) { feeds.erase(std::remove(feeds.begin(), feeds.end(), feed), feeds.end()); }
+
+    // fills from `first_transaction` on and every level update go to `market_data_ring` as well
+    void attach_ring(MarketDataRing *market_data_ring, size_t first_transaction)
+    {
+        ring = market_data_ring;
+        published_transactions = first_transaction;
+    }
+
+    void publish(OrderBook &order_book, const TradeJournal &journal)
+    {
+        // fills first, then the levels they left behind
+        for (; ring != nullptr && published_transactions < journal.size(); published_transactions++)
+        {
+            auto &transaction = journal[published_transactions];
+            ring->publish(MarketDataRecord{0, shard, MarketDataType::trade, transaction.aggressor, transaction.price, transaction.quantity, 0, transaction.timestamp});
+        }
+
+        order_book.collect_level_updates(updates);
+        if (updates.empty())
+        {
+            return;
+        }
+        for (auto &update : updates)
+        {
+            update.sequence = ++sequence;
+            update.shard = shard;
+            for (auto feed : feeds)
+            {
+                feed->publish(update);
+            }
+            if (ring != nullptr)
+            {
+                ring->publish(MarketDataRecord{0, shard, MarketDataType::level, update.side, update.price, update.quantity, update.order_count, 0});
+            }
+        }
+
+        DepthSnapshot depth;
+        order_book.snapshot_depth(depth);
+        depth.sequence = sequence;
+        depth.shard = shard;
+        depth_snapshot.store(depth);
+    }
+
+    // any thread
+    DepthSnapshot depth() const { return depth_snapshot.load(); }
+
+private:
+    uint32_t shard;
+    std::vector<MarketDataFeed *> feeds;
+    MarketDataRing *ring = nullptr;
+    size_t published_transactions = 0;
+    std::vector<LevelUpdate> updates;
+    uint64_t sequence = 0;
+    SeqLock<DepthSnapshot> depth_snapshot;
+};
+
+/*
+    Versioned immutable snapshots of a shard's state, published read-copy-update
+    style. The matching thread fills a slot no reader holds and then makes it
+    the current one; a reader pins the current slot with a count and formats it
+    for as long as it likes while newer versions go to the other slots. The
+    matching thread only copies its state when a reader has asked for it
+    through the queue. Neither side waits for the other: when readers hold
+    every spare slot the matching thread retries between batches instead of
+    parking, and once the slots' vectors have grown publishing does not
+    allocate.
+*/
+class StatePublisher
+{
+    struct alignas(CACHE_LINE_SIZE) Slot
+    {
+        std::atomic<int> readers{0};
+        StateSnapshot snapshot;
+    };
+
+public:
+    // a pinned snapshot, released when the reader goes away
+    class Reader
+    {
+    public:
+        Reader(Reader &&other) noexcept : slot(other.slot) { other.slot = nullptr; }
+
+        Reader(const Reader &) = delete;
+        Reader &operator=(const Reader &) = delete;
+
+        ~Reader()
+        {
+            if (slot != nullptr)
+            {
+                slot->readers.fetch_sub(1, std::memory_order_release);
+            }
+        }
+
+        const StateSnapshot &operator*() const { return slot->snapshot; }
+        const StateSnapshot *operator->() const { return &slot->snapshot; }
+
+    private:
+        friend class StatePublisher;
+
+        explicit Reader(Slot *slot) : slot(slot) {}
+
+        Slot *slot;
+    };
+
+    // any thread
+    Reader read() const
+    {
+        while (true)
+        {
+            auto index = current.load(std::memory_order_seq_cst);
+            auto &slot = slots[index];
+            slot.readers.fetch_add(1, std::memory_order_seq_cst);
+            // still current after the pin, so the matching thread cannot pick it to write until we let go
+            if (current.load(std::memory_order_seq_cst) == index)
+            {
+                return Reader(&slot);
+            }
+            slot.readers.fetch_sub(1, std::memory_order_release);
+        }
+    }
+
+    // matching thread only: a snapshot to fill in for publish, or nullptr while readers hold every other slot
+    StateSnapshot *prepare()
+    {
+        auto published = current.load(std::memory_order_relaxed);
+        for (size_t i = 1; i < STATE_SNAPSHOT_SLOTS; i++)
+        {
+            auto index = (published + i) % STATE_SNAPSHOT_SLOTS;
+            if (slots[index].readers.load(std::memory_order_seq_cst) == 0)
+            {
+                prepared = index;
+                return &slots[index].snapshot;
+            }
+        }
+        return nullptr;
+    }
+
+    // makes what prepare returned the current snapshot
+    void publish()
+    {
+        slots[prepared].snapshot.version = ++version;
+        current.store(prepared, std::memory_order_seq_cst);
+    }
+
+private:
+    mutable Slot slots[STATE_SNAPSHOT_SLOTS];
+    std::atomic<size_t> current{0};
+    size_t prepared = 0;
+    uint64_t version = 0;
+};
+
+struct Shard;
+
+// false when the thread could not be pinned, it then keeps running wherever the scheduler puts it
+bool pin_current_thread(int core);
+
+// whether the process is allowed to run on `core`, and so whether a thread can be pinned there
+bool core_available(int core);
+
+/*
+    Runs `work` on a thread pinned to `core` and waits for it, or in place for
+    core -1. Pages are placed on the NUMA node of the thread that first touches
+    them, so whatever `work` allocates and fills lands next to that core. False
+    when the pin failed; `work` has run anyway, just without that placement.
+*/
+template <typename Work>
+bool run_on_core(int core, Work work)
+{
+    if (core < 0)
+    {
+        work();
+        return true;
+    }
+    bool pinned = false;
+    std::thread thread([core, &work, &pinned]()
+                       {
+                           pinned = pin_current_thread(core);
+                           work();
+                       });
+    thread.join();
+    return pinned;
+}
+
+// one order of a bulk submission
+struct OrderRequest
+{
+    AccountId account_id;
+    Side side;
+    Quantity quantity;
+    Price price;
+    OrderType type = OrderType::limit;
+};
+
+// how far a shard is behind its clients, each counter read on its own
+struct ShardBacklog
+{
+    size_t queue_depth = 0;    // messages waiting for the matching thread
+    uint64_t full_waits = 0;   // pushes that found the queue full
+    uint64_t lost_reports = 0; // execution reports a full channel or a full client ring lost
+};
+
+/*
+    One engine instance: the shared USD ledger and a shard per instrument, each
+    drained by its own matching thread once started. Everything it owns
+    belongs to the instance, so several engines can run side by side in one
+    process. Clients queue orders and queries through it, in process and
+    without the text protocol, and read replies, execution reports and market
+    data from its shards. Tick and lot sizes are still set once per process by
+    configure_fixed_point.
+*/
+class MatchingEngine
+{
+public:
+    explicit MatchingEngine(size_t max_accounts = MAX_ACCOUNTS);
+
+    MatchingEngine(const MatchingEngine &) = delete;
+    MatchingEngine &operator=(const MatchingEngine &) = delete;
+
+    // stops the matching threads if they are still running
+    ~MatchingEngine();
+
+    // only before start; the shard is built on `matching.core`, which its matching thread is then pinned to, so its book, pools and rings are local to that core's NUMA node
+    bool add_instrument(const std::string &symbol, ThreadConfig matching = {});
+
+    const std::vector<std::unique_ptr<Shard>> &shards() const { return instruments; }
+
+    // null for an unknown symbol
+    Shard *find_instrument(const std::string &symbol) const;
+
+    // order ids carry the index of the shard that issued them in their top bits
+    Shard *find_order_shard(OrderId order_id) const;
+
+    const std::string &symbol(const Shard &shard) const;
+
+    // counters and histograms kept by the matching thread, safe to read while it runs
+    const ShardStats &stats(const Shard &shard) const;
+    ShardBacklog backlog(const Shard &shard) const;
+
+    // top of book as last published, read without a round trip through the matching thread
+    DepthSnapshot depth(const Shard &shard) const;
+
+    // a fill of the shard's mapped journal; only positions a published state already counts while it runs
+    const Transaction &transaction(const Shard &shard, size_t position) const;
+
+    size_t max_accounts() const { return cash_ledger.capacity(); }
+
+    // only before start: the shard's trade journal, input log and snapshot under `journal_dir`, nothing is persisted for an empty one
+    bool open_journals(Shard &shard, const std::string &journal_dir, FsyncPolicy fsync_policy);
+
+    // only before start, for every shard
+    void set_risk_controls(SelfTradePrevention self_trade_prevention, const RiskLimits &risk_limits);
+
+    // only before start: rebuilds the shard from its journals on its own core and opens the accounts below `account_count` it never saw, the inputs replayed go to `replayed`
+    // false, with the journals left untouched, when the input log starts past every usable snapshot
+    bool restore(Shard &shard, size_t account_count, size_t &replayed);
+
+    // only before start: publishes the shard's fills and levels from here on into a new ring, shared under `shm_name` unless it is empty
+    bool publish_market_data(Shard &shard, const std::string &shm_name);
+
+    const MarketDataRing &market_data_ring(const Shard &shard) const;
+
+    Cash balance(AccountId account_id) const { return cash_ledger.balance(account_id); }
+
+    // one matching thread per shard, pinned to the shard's core when it has one
+    void start();
+
+    // queues a shutdown behind everything already queued and waits for every shard to drain it
+    void stop();
+
+    void broadcast(const Message &message);
+
+    // queues a message the caller built, an account change or a recorded input, behind everything already queued
+    void submit(Shard &shard, const Message &message);
+
+    // order entry, shared by every client: orders are built and routed to their shard the same way
+    OrderId submit_order(Shard &shard, AccountId account_id, Side side, Quantity quantity, Price price, OrderType type = OrderType::limit, uint32_t session = 0);
+
+    // false when the id cannot belong to any shard; a gateway session can only cancel or amend the orders it entered
+    bool submit_cancel(OrderId order_id, uint32_t session = 0);
+
+    bool submit_amend(OrderId order_id, Quantity quantity, Price price, uint32_t session = 0);
+
+    // queues the orders as one unbroken run, so the shard takes them in a single batch; `order_ids` gets their ids in the same order
+    void submit_orders(Shard &shard, const std::vector<OrderRequest> &orders, std::vector<OrderId> &order_ids, uint32_t session = 0);
+
+    // one run per shard, returns how many of the ids could belong to a shard and were queued
+    size_t submit_cancels(const std::vector<OrderId> &order_ids, uint32_t session = 0);
+
+    // cancels the account's resting orders within `scope` on every shard, or only on `shard`
+    void submit_mass_cancel(AccountId account_id, CancelScope scope = CancelScope::all, uint32_t session = 0, Shard *shard = nullptr);
+
+    // pushes a message carrying `reply` to one shard and waits for it to be filled in
+    void request(Shard &shard, const Message &message, EngineReply &reply);
+
+    // sends the same query to every shard, one reply per shard
+    std::vector<EngineReply> request_all(MessageType type, AccountId account_id = 0);
+
+    // every shard's published state once it covers all the messages queued before the call, asking a shard to publish when its state is older; waits for the matching threads without ever holding them up
+    std::vector<StatePublisher::Reader> read_state() const;
+
+    // one consumer for every shard: takes up to `max_count` of the shard's execution reports
+    size_t drain_reports(Shard &shard, ExecutionReport *reports, size_t max_count);
+
+    // a drained report the consumer could not deliver, counted with the ones the channel lost
+    void count_lost_report(Shard &shard);
+
+private:
+    CashLedger cash_ledger;
+    std::vector<std::unique_ptr<Shard>> instruments;
+    std::unordered_map<std::string, uint32_t> instrument_shards; // symbol -> shard index
+    std::vector<std::thread> threads;
+};
+
+#endif
@@ -0,0 +1,69 @@
+/*
+    Author : Nad
+    Date : 2023-01-15
+    Description : A simple C++ Matching Engine
+*/
+
+/*
+    The shard behind each instrument of a MatchingEngine. Only the library
+    itself builds on these; clients go through the MatchingEngine.
+*/
+
+#ifndef MATCHING_ENGINE_SHARD_H
+#define MATCHING_ENGINE_SHARD_H
+
+#include "matching_engine.h"
+
+/*
+    One instrument. Its book, trade log and coin balances are owned by a single
+    matching thread fed through the shard's own queue; once that thread is
+    running nothing else reads or writes them. USD balances are shared by every
+    shard through the CashLedger.
+*/
+struct Shard
+{
+    Shard(uint32_t index, const std::string &symbol, CashLedger &cash_ledger, WaitStrategy wait_strategy = WaitStrategy::spin_then_park)
+        : index(index), symbol(symbol), order_book((static_cast<OrderId>(index) << ORDER_ID_SHARD_SHIFT) + 1), ledger(cash_ledger), market_data(index), reports(index, REPORT_CHANNEL_CAPACITY), message_queue(MESSAGE_QUEUE_CAPACITY, wait_strategy)
+    {
+        order_book.set_report_channel(&reports);
+    }
+
+    uint32_t index;
+    std::string symbol;
+    OrderBook order_book;
+    std::vector<Quantity> coin_balances;     // indexed by AccountId
+    std::vector<uint32_t> last_transactions; // journal position + 1 of each account's newest fill, indexed by AccountId
+    ShardLedger ledger;
+    TradeJournal journal;
+    InputLog input_log;
+    std::string snapshot_path;       // empty when nothing is persisted
+    size_t snapshot_input_count = 0; // inputs covered by the last snapshot
+    size_t journal_errors_reported = 0; // failed appends to either log already reported
+    Timestamp journal_error_reported_at = 0;
+    bool replaying = false;
+    bool in_auction = false; // orders rest without matching until the next uncross
+    MarketDataPublisher market_data;
+    MarketDataRing market_data_ring;
+    StatePublisher state;
+    uint64_t applied_inputs = 0; // messages taken off the queue, matching thread only
+    bool state_requested = false; // a reader is waiting for a publish, matching thread only
+    ReportChannel reports;
+    ShardStats stats;
+    MessageQueue message_queue;
+    std::vector<OrderId> mass_cancel_ids; // reused by every mass cancel
+    int core = -1; // cpu the matching thread is pinned to, -1 for none
+};
+
+// opens an account on one shard with `coin_balance`; only while its matching thread is not running
+void open_account(Shard &shard, AccountId account_id, Quantity coin_balance);
+
+// rebuilds a shard from its snapshot and the inputs logged after it into `replayed`; only before start, false when no snapshot covers the released inputs
+bool restore_shard(Shard &shard, size_t &replayed);
+
+// publishes the shard's balances and book for readers, from its matching thread or before it starts; false while readers hold every spare slot
+bool publish_state(Shard &shard);
+
+// the matching thread of one shard, runs until it handles a shutdown
+void matching_engine(Shard &shard);
+
+#endif
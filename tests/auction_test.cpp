@@ -0,0 +1,191 @@
+/*
+    Unit tests for the call auction: the price find_uncrossing_price picks
+    when several prices execute the same volume, and the fills, cash and coin
+    uncross leaves behind at that price. Orders rest straight on the book, with
+    each buy's notional reserved at its limit the way the engine admits it.
+*/
+
+#include "matching_engine.h"
+#include "test_check.h"
+
+const AccountId AUCTION_TEST_ACCOUNTS = 4;
+const Cash AUCTION_TEST_FUNDING = 1000000;
+const Quantity AUCTION_TEST_COIN = 1000;
+const AccountId BUYER = 0;
+const AccountId SELLER = 1;
+const AccountId LATE_SELLER = 2;
+
+// a shard's book and balances without its matching thread
+struct AuctionBook
+{
+    AuctionBook() : cash_ledger(AUCTION_TEST_ACCOUNTS), ledger(cash_ledger), coin_balances(AUCTION_TEST_ACCOUNTS, AUCTION_TEST_COIN), last_transactions(AUCTION_TEST_ACCOUNTS, 0)
+    {
+        journal.open("", FsyncPolicy::none);
+        for (AccountId account_id = 0; account_id < AUCTION_TEST_ACCOUNTS; account_id++)
+        {
+            ledger.open_account(account_id);
+            ledger.credit(account_id, AUCTION_TEST_FUNDING);
+        }
+    }
+
+    void rest(AccountId account_id, Side side, Quantity quantity, Price price)
+    {
+        auto order = order_book.construct_order(account_id, side, quantity, price, 0);
+        if (side == Side::buy)
+        {
+            ledger.debit(account_id, notional(quantity, price));
+        }
+        order_book.add_order(order);
+    }
+
+    // the uncrossing price and volume, or 0 for both when the book does not cross
+    std::pair<Price, Quantity> uncrossing() const
+    {
+        Price price = 0;
+        Quantity volume = 0;
+        if (!order_book.find_uncrossing_price(price, volume))
+        {
+            return {0, 0};
+        }
+        return {price, volume};
+    }
+
+    Quantity uncross(Price &price) { return order_book.uncross(0, ledger, coin_balances, journal, last_transactions, price); }
+
+    OrderBook order_book;
+    CashLedger cash_ledger;
+    ShardLedger ledger;
+    std::vector<Quantity> coin_balances;
+    std::vector<uint32_t> last_transactions;
+    TradeJournal journal;
+};
+
+void book_that_does_not_cross_has_no_price()
+{
+    AuctionBook book;
+    CHECK(book.uncrossing() == (std::pair<Price, Quantity>{0, 0}));
+    book.rest(BUYER, Side::buy, 10, 100);
+    CHECK(book.uncrossing() == (std::pair<Price, Quantity>{0, 0}));
+    book.rest(SELLER, Side::sell, 10, 101);
+    CHECK(book.uncrossing() == (std::pair<Price, Quantity>{0, 0}));
+
+    Price price = 0;
+    CHECK(book.uncross(price) == 0);
+    CHECK(book.journal.size() == 0);
+}
+
+// 15 trades at 102 and at 103 but only 10 above, so the volume rules out 104 and 105 even though they leave a larger imbalance
+void most_volume_wins()
+{
+    AuctionBook book;
+    book.rest(BUYER, Side::buy, 10, 105);
+    book.rest(BUYER, Side::buy, 10, 103);
+    book.rest(SELLER, Side::sell, 15, 102);
+    book.rest(SELLER, Side::sell, 10, 104);
+    CHECK(book.uncrossing() == (std::pair<Price, Quantity>{103, 15}));
+}
+
+// 10 trades at 101, 102 and 104, and only 104 leaves nothing over
+void equal_volume_goes_to_the_smallest_imbalance()
+{
+    AuctionBook book;
+    book.rest(BUYER, Side::buy, 10, 104);
+    book.rest(BUYER, Side::buy, 5, 102);
+    book.rest(SELLER, Side::sell, 10, 101);
+    CHECK(book.uncrossing() == (std::pair<Price, Quantity>{104, 10}));
+}
+
+// 10 trades at 100 and at 104 with 10 left over either way
+void equal_buy_surplus_goes_to_the_highest_price()
+{
+    AuctionBook book;
+    book.rest(BUYER, Side::buy, 20, 104);
+    book.rest(SELLER, Side::sell, 10, 100);
+    CHECK(book.uncrossing() == (std::pair<Price, Quantity>{104, 10}));
+}
+
+void equal_sell_surplus_goes_to_the_lowest_price()
+{
+    AuctionBook book;
+    book.rest(BUYER, Side::buy, 10, 104);
+    book.rest(SELLER, Side::sell, 20, 100);
+    CHECK(book.uncrossing() == (std::pair<Price, Quantity>{100, 10}));
+}
+
+void balanced_tie_goes_to_the_lowest_price()
+{
+    AuctionBook book;
+    book.rest(BUYER, Side::buy, 10, 104);
+    book.rest(SELLER, Side::sell, 10, 100);
+    CHECK(book.uncrossing() == (std::pair<Price, Quantity>{100, 10}));
+}
+
+// every fill is at the uncrossing price, the buyer gets back what it reserved above it, and the earlier sell at the level goes first
+void uncross_fills_at_the_uncrossing_price()
+{
+    AuctionBook book;
+    book.rest(BUYER, Side::buy, 10, 104);
+    book.rest(SELLER, Side::sell, 10, 100);
+    book.rest(LATE_SELLER, Side::sell, 10, 100);
+
+    Price price = 0;
+    CHECK(book.uncross(price) == 10);
+    CHECK(price == 100);
+    if (!CHECK(book.journal.size() == 1))
+    {
+        return;
+    }
+    auto &fill = book.journal[0];
+    CHECK(fill.buyer == BUYER && fill.seller == SELLER);
+    CHECK(fill.quantity == 10 && fill.price == 100);
+    // the later order of the two is the aggressor
+    CHECK(fill.aggressor == Side::sell);
+
+    CHECK(book.cash_ledger.balance(BUYER) == AUCTION_TEST_FUNDING - notional(10, 100));
+    CHECK(book.cash_ledger.balance(SELLER) == AUCTION_TEST_FUNDING + notional(10, 100));
+    CHECK(book.cash_ledger.balance(LATE_SELLER) == AUCTION_TEST_FUNDING);
+    CHECK(book.coin_balances[BUYER] == AUCTION_TEST_COIN + 10);
+    CHECK(book.coin_balances[SELLER] == AUCTION_TEST_COIN - 10);
+    CHECK(book.coin_balances[LATE_SELLER] == AUCTION_TEST_COIN);
+
+    // the late sell rests on, with nothing left to cross it
+    std::vector<Level_Summary> asks;
+    book.order_book.snapshot_levels(false, asks);
+    CHECK(asks.size() == 1 && asks[0].price == 100 && asks[0].quantity == 10 && asks[0].order_count == 1);
+    CHECK(book.order_book.reserved_cash(BUYER) == 0);
+    CHECK(book.uncrossing() == (std::pair<Price, Quantity>{0, 0}));
+}
+
+// a surplus left at the uncrossing price keeps its reservation at its own limit
+void uncross_leaves_the_surplus_resting()
+{
+    AuctionBook book;
+    book.rest(BUYER, Side::buy, 20, 104);
+    book.rest(SELLER, Side::sell, 10, 100);
+
+    Price price = 0;
+    CHECK(book.uncross(price) == 10);
+    CHECK(price == 104);
+    CHECK(book.journal.size() == 1 && book.journal[0].price == 104);
+    CHECK(book.cash_ledger.balance(BUYER) == AUCTION_TEST_FUNDING - notional(10, 104) - notional(10, 104));
+    CHECK(book.cash_ledger.balance(SELLER) == AUCTION_TEST_FUNDING + notional(10, 104));
+
+    std::vector<Level_Summary> bids;
+    book.order_book.snapshot_levels(true, bids);
+    CHECK(bids.size() == 1 && bids[0].price == 104 && bids[0].quantity == 10);
+    CHECK(book.order_book.reserved_cash(BUYER) == notional(10, 104));
+}
+
+int main()
+{
+    return run_tests({
+        {"auction book that does not cross has no price", book_that_does_not_cross_has_no_price},
+        {"auction most volume wins", most_volume_wins},
+        {"auction equal volume goes to the smallest imbalance", equal_volume_goes_to_the_smallest_imbalance},
+        {"auction equal buy surplus goes to the highest price", equal_buy_surplus_goes_to_the_highest_price},
+        {"auction equal sell surplus goes to the lowest price", equal_sell_surplus_goes_to_the_lowest_price},
+        {"auction balanced tie goes to the lowest price", balanced_tie_goes_to_the_lowest_price},
+        {"auction uncross fills at the uncrossing price", uncross_fills_at_the_uncrossing_price},
+        {"auction uncross leaves the surplus resting", uncross_leaves_the_surplus_resting},
+    });
+}
@@ -0,0 +1,157 @@
+/*
+    Unit tests for FlatHashMap, the open-addressing map behind the order index
+    and the per-account price counts. Erase shifts the rest of a probe run
+    back instead of leaving tombstones, so the tests keep tables small and
+    half full, where most keys share a cluster with others and runs wrap past
+    the end of the slot array.
+*/
+
+#include "matching_engine.h"
+#include "test_check.h"
+
+#include <random>
+
+const size_t MAP_TEST_CAPACITY = 4; // eight slots, the table grows past four keys
+const int64_t MAP_TEST_KEY_RANGE = 64;
+const int MAP_TEST_ROUNDS = 200000;
+const uint64_t MAP_TEST_SEED = 42;
+
+// every key the reference holds is found with its value, and nothing else is
+bool matches(FlatHashMap<int64_t, int> &map, const std::map<int64_t, int> &reference)
+{
+    if (map.size() != reference.size())
+    {
+        return false;
+    }
+    for (int64_t key = 0; key < MAP_TEST_KEY_RANGE; key++)
+    {
+        auto found = map.find(key);
+        auto expected = reference.find(key);
+        if ((found == nullptr) != (expected == reference.end()) || (found != nullptr && *found != expected->second))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void finds_what_was_inserted()
+{
+    FlatHashMap<int64_t, int> map(MAP_TEST_CAPACITY);
+    CHECK(map.find(1) == nullptr);
+    map[1] = 10;
+    map[2] = 20;
+    CHECK(map.size() == 2);
+    CHECK(map.find(1) != nullptr && *map.find(1) == 10);
+    CHECK(map.find(2) != nullptr && *map.find(2) == 20);
+    CHECK(map.find(3) == nullptr);
+
+    // a key already there is not added again
+    map[1]++;
+    CHECK(map.size() == 2);
+    CHECK(*map.find(1) == 11);
+
+    // a missing key starts value-initialised
+    CHECK(map[3] == 0);
+    CHECK(map.size() == 3);
+}
+
+void erasing_a_missing_key_changes_nothing()
+{
+    FlatHashMap<int64_t, int> map(MAP_TEST_CAPACITY);
+    CHECK(!map.erase(0));
+    map[1] = 10;
+    map[2] = 20;
+    CHECK(!map.erase(3));
+    CHECK(map.erase(1));
+    CHECK(!map.erase(1));
+    CHECK(map.size() == 1);
+    CHECK(map.find(1) == nullptr);
+    CHECK(map.find(2) != nullptr && *map.find(2) == 20);
+}
+
+// every key of a cluster erased in turn, from each end and from the middle, with the rest still reachable
+void erase_keeps_the_rest_of_a_cluster_reachable()
+{
+    // with eight slots 16 and 32 both hash to the last one, 0 and 2 to the first and 4 to the second, so these runs wrap past the end
+    std::vector<std::vector<int64_t>> key_sets = {{16, 32, 0, 2}, {16, 32, 4, 0}};
+    // four keys in eight slots, most of these sets share a run too
+    for (int64_t first = 0; first < MAP_TEST_KEY_RANGE; first += 4)
+    {
+        key_sets.push_back({first, first + 1, first + 2, first + 3});
+    }
+    const std::vector<std::vector<size_t>> erase_orders = {{0, 1, 2, 3}, {3, 2, 1, 0}, {1, 3, 0, 2}, {2, 0, 3, 1}};
+    for (auto &keys : key_sets)
+    {
+        for (auto &erase_order : erase_orders)
+        {
+            FlatHashMap<int64_t, int> map(MAP_TEST_CAPACITY);
+            std::map<int64_t, int> reference;
+            for (auto key : keys)
+            {
+                map[key] = static_cast<int>(key);
+                reference[key] = static_cast<int>(key);
+            }
+            for (auto n : erase_order)
+            {
+                CHECK(map.erase(keys[n]));
+                reference.erase(keys[n]);
+                CHECK(matches(map, reference));
+            }
+        }
+    }
+}
+
+// random inserts and erases against std::map, staying at the load where the table is about to grow
+void matches_a_reference_map_through_random_erases()
+{
+    FlatHashMap<int64_t, int> map(MAP_TEST_CAPACITY);
+    std::map<int64_t, int> reference;
+    std::mt19937_64 random(MAP_TEST_SEED);
+    std::uniform_int_distribution<int64_t> keys(0, MAP_TEST_KEY_RANGE - 1);
+    bool matched = true;
+    for (int round = 0; round < MAP_TEST_ROUNDS && matched; round++)
+    {
+        auto key = keys(random);
+        if (reference.size() < MAP_TEST_CAPACITY)
+        {
+            map[key] = round;
+            reference[key] = round;
+        }
+        else
+        {
+            matched = map.erase(key) == (reference.erase(key) == 1);
+        }
+        matched = matched && matches(map, reference);
+    }
+    CHECK(matched);
+}
+
+void grow_keeps_every_entry()
+{
+    FlatHashMap<int64_t, int> map(MAP_TEST_CAPACITY);
+    std::map<int64_t, int> reference;
+    for (int64_t key = 0; key < MAP_TEST_KEY_RANGE; key++)
+    {
+        map[key] = static_cast<int>(key * 3);
+        reference[key] = static_cast<int>(key * 3);
+    }
+    CHECK(matches(map, reference));
+    for (int64_t key = 0; key < MAP_TEST_KEY_RANGE; key += 2)
+    {
+        CHECK(map.erase(key));
+        reference.erase(key);
+    }
+    CHECK(matches(map, reference));
+}
+
+int main()
+{
+    return run_tests({
+        {"flat hash map finds what was inserted", finds_what_was_inserted},
+        {"flat hash map erasing a missing key changes nothing", erasing_a_missing_key_changes_nothing},
+        {"flat hash map erase keeps the rest of a cluster reachable", erase_keeps_the_rest_of_a_cluster_reachable},
+        {"flat hash map matches a reference map through random erases", matches_a_reference_map_through_random_erases},
+        {"flat hash map grow keeps every entry", grow_keeps_every_entry},
+    });
+}
@@ -0,0 +1,177 @@
+/*
+    Unit tests for the shared-memory market-data ring: the gapless sequence
+    every record is stamped with, readers that catch up, readers the writer
+    laps and skips forward, a reader in another mapping of the same ring, and
+    a reader racing the writer that must see every record once or count it
+    lost.
+*/
+
+#include "matching_engine.h"
+#include "test_check.h"
+
+#include <thread>
+#include <unistd.h>
+
+const size_t MARKET_DATA_TEST_CAPACITY = 8;
+const uint64_t MARKET_DATA_TEST_RACE_RECORDS = 200000;
+
+// a level update whose price says which one it was
+MarketDataRecord make_level_record(uint64_t index)
+{
+    MarketDataRecord record{};
+    record.type = MarketDataType::level;
+    record.side = Side::buy;
+    record.price = static_cast<Price>(index);
+    record.quantity = 1;
+    record.order_count = 1;
+    return record;
+}
+
+void rounds_capacity_up_to_a_power_of_two()
+{
+    MarketDataRing ring;
+    if (!CHECK(ring.create("", MARKET_DATA_TEST_CAPACITY - 1)))
+    {
+        return;
+    }
+    CHECK(ring.capacity() == MARKET_DATA_TEST_CAPACITY);
+    CHECK(ring.published() == 0);
+}
+
+void records_are_sequenced_and_read_in_order()
+{
+    MarketDataRing ring;
+    if (!CHECK(ring.create("", MARKET_DATA_TEST_CAPACITY)))
+    {
+        return;
+    }
+    uint64_t position = 1;
+    uint64_t lost = 0;
+    MarketDataRecord record{};
+    CHECK(!ring.next(position, record, lost));
+
+    for (uint64_t i = 1; i <= MARKET_DATA_TEST_CAPACITY; i++)
+    {
+        ring.publish(make_level_record(i));
+        CHECK(ring.published() == i);
+    }
+    for (uint64_t i = 1; i <= MARKET_DATA_TEST_CAPACITY; i++)
+    {
+        CHECK(ring.next(position, record, lost));
+        CHECK(record.sequence == i);
+        CHECK(record.price == static_cast<Price>(i));
+    }
+    CHECK(position == MARKET_DATA_TEST_CAPACITY + 1);
+    CHECK(lost == 0);
+
+    // caught up, until the writer publishes the next record
+    CHECK(!ring.next(position, record, lost));
+    ring.publish(make_level_record(MARKET_DATA_TEST_CAPACITY + 1));
+    CHECK(ring.next(position, record, lost));
+    CHECK(record.sequence == MARKET_DATA_TEST_CAPACITY + 1);
+    CHECK(!ring.next(position, record, lost));
+}
+
+void lapped_reader_skips_to_the_oldest_record()
+{
+    MarketDataRing ring;
+    if (!CHECK(ring.create("", MARKET_DATA_TEST_CAPACITY)))
+    {
+        return;
+    }
+    const uint64_t published = 3 * MARKET_DATA_TEST_CAPACITY + 2;
+    for (uint64_t i = 1; i <= published; i++)
+    {
+        ring.publish(make_level_record(i));
+    }
+
+    uint64_t position = 1;
+    uint64_t lost = 0;
+    MarketDataRecord record{};
+    const uint64_t oldest = published - MARKET_DATA_TEST_CAPACITY + 1;
+    CHECK(ring.next(position, record, lost));
+    CHECK(record.sequence == oldest);
+    CHECK(record.price == static_cast<Price>(oldest));
+    CHECK(lost == oldest - 1);
+    for (uint64_t sequence = oldest + 1; sequence <= published; sequence++)
+    {
+        CHECK(ring.next(position, record, lost));
+        CHECK(record.sequence == sequence);
+    }
+    CHECK(!ring.next(position, record, lost));
+    CHECK(lost == oldest - 1);
+}
+
+void reader_maps_a_ring_by_name()
+{
+    std::string shm_name = "/matching_engine_market_data_test." + std::to_string(getpid());
+    MarketDataRing writer;
+    if (!CHECK(writer.create(shm_name, MARKET_DATA_TEST_CAPACITY)))
+    {
+        return;
+    }
+    MarketDataRing reader;
+    if (!CHECK(reader.open(shm_name)))
+    {
+        return;
+    }
+    CHECK(reader.capacity() == MARKET_DATA_TEST_CAPACITY);
+
+    uint64_t position = 1;
+    uint64_t lost = 0;
+    MarketDataRecord record{};
+    writer.publish(make_level_record(1));
+    writer.publish(make_level_record(2));
+    CHECK(reader.published() == 2);
+    CHECK(reader.next(position, record, lost) && record.sequence == 1 && record.price == 1);
+    CHECK(reader.next(position, record, lost) && record.sequence == 2 && record.price == 2);
+    CHECK(!reader.next(position, record, lost));
+    CHECK(lost == 0);
+}
+
+void racing_reader_sees_each_record_once_or_counts_it_lost()
+{
+    MarketDataRing ring;
+    if (!CHECK(ring.create("", MARKET_DATA_TEST_CAPACITY)))
+    {
+        return;
+    }
+    std::thread writer([&]()
+                       {
+                           for (uint64_t i = 1; i <= MARKET_DATA_TEST_RACE_RECORDS; i++)
+                           {
+                               ring.publish(make_level_record(i));
+                           } });
+
+    uint64_t position = 1;
+    uint64_t lost = 0;
+    uint64_t read = 0;
+    uint64_t last = 0;
+    bool ordered = true;
+    MarketDataRecord record{};
+    while (position <= MARKET_DATA_TEST_RACE_RECORDS)
+    {
+        if (ring.next(position, record, lost))
+        {
+            // a torn read would pair a sequence with another record's price
+            ordered = ordered && record.sequence > last && record.price == static_cast<Price>(record.sequence);
+            last = record.sequence;
+            read++;
+        }
+    }
+    writer.join();
+    CHECK(ordered);
+    CHECK(read + lost == MARKET_DATA_TEST_RACE_RECORDS);
+    CHECK(last == MARKET_DATA_TEST_RACE_RECORDS);
+}
+
+int main()
+{
+    return run_tests({
+        {"rounds capacity up to a power of two", rounds_capacity_up_to_a_power_of_two},
+        {"records are sequenced and read in order", records_are_sequenced_and_read_in_order},
+        {"lapped reader skips to the oldest record", lapped_reader_skips_to_the_oldest_record},
+        {"reader maps a ring by name", reader_maps_a_ring_by_name},
+        {"racing reader sees each record once or counts it lost", racing_reader_sees_each_record_once_or_counts_it_lost},
+    });
+}
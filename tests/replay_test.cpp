@@ -0,0 +1,335 @@
+/*
+    Unit tests for rebuilding an engine from its journals. The same flow of
+    orders, cancels, amends and an auction is run live across a restart, and
+    the balances, books and fills a client can see must come back the same
+    from the last snapshot, from the input log alone, and from an older
+    snapshot followed by the inputs logged after it. A log whose first
+    segments were released behind a snapshot that is gone is refused.
+*/
+
+#include "matching_engine.h"
+#include "test_check.h"
+
+#include <filesystem>
+
+const char *const REPLAY_TEST_SYMBOLS[] = {"BTC", "ETH"};
+const AccountId REPLAY_TEST_ACCOUNTS = 4;
+const size_t REPLAY_TEST_MAX_ACCOUNTS = 16;
+
+// what a client can see of one shard
+struct ShardView
+{
+    std::vector<Quantity> coin_balances;
+    std::vector<Cash> reserved_cash;
+    std::vector<Quantity> reserved_coin;
+    std::vector<uint32_t> last_transactions;
+    std::vector<Level_Summary> bids;
+    std::vector<Level_Summary> asks;
+    std::vector<Transaction> transactions;
+};
+
+struct EngineView
+{
+    std::vector<Cash> balances;
+    std::vector<ShardView> shards;
+};
+
+bool same_levels(const std::vector<Level_Summary> &a, const std::vector<Level_Summary> &b)
+{
+    return std::equal(a.begin(), a.end(), b.begin(), b.end(), [](const Level_Summary &x, const Level_Summary &y)
+                      { return x.price == y.price && x.quantity == y.quantity && x.order_count == y.order_count; });
+}
+
+bool same_transactions(const std::vector<Transaction> &a, const std::vector<Transaction> &b)
+{
+    return std::equal(a.begin(), a.end(), b.begin(), b.end(), [](const Transaction &x, const Transaction &y)
+                      { return x.id == y.id && x.quantity == y.quantity && x.price == y.price && x.timestamp == y.timestamp && x.buyer == y.buyer && x.seller == y.seller && x.aggressor == y.aggressor && x.buyer_previous == y.buyer_previous && x.seller_previous == y.seller_previous; });
+}
+
+// once everything queued so far is applied
+EngineView view(MatchingEngine &engine)
+{
+    EngineView result;
+    // the USD balances are read once the states say everything queued has been applied
+    auto states = engine.read_state();
+    for (AccountId account_id = 0; account_id < REPLAY_TEST_ACCOUNTS; account_id++)
+    {
+        result.balances.push_back(engine.balance(account_id));
+    }
+    for (size_t i = 0; i < states.size(); i++)
+    {
+        auto &state = *states[i];
+        ShardView shard{state.coin_balances, state.reserved_cash, state.reserved_coin, state.last_transactions, state.bids, state.asks, {}};
+        for (size_t position = 0; position < state.transaction_count; position++)
+        {
+            shard.transactions.push_back(engine.transaction(*engine.shards()[i], position));
+        }
+        result.shards.push_back(std::move(shard));
+    }
+    return result;
+}
+
+void check_same_view(const EngineView &replayed, const EngineView &live)
+{
+    CHECK(replayed.balances == live.balances);
+    if (!CHECK(replayed.shards.size() == live.shards.size()))
+    {
+        return;
+    }
+    for (size_t i = 0; i < live.shards.size(); i++)
+    {
+        auto &a = replayed.shards[i];
+        auto &b = live.shards[i];
+        CHECK(a.coin_balances == b.coin_balances);
+        CHECK(a.reserved_cash == b.reserved_cash);
+        CHECK(a.reserved_coin == b.reserved_coin);
+        CHECK(a.last_transactions == b.last_transactions);
+        CHECK(same_levels(a.bids, b.bids));
+        CHECK(same_levels(a.asks, b.asks));
+        CHECK(same_transactions(a.transactions, b.transactions));
+    }
+}
+
+// the engine journalled under `journal_dir`, rebuilt from what is already there and running
+std::unique_ptr<MatchingEngine> open_engine(const std::string &journal_dir, bool restore)
+{
+    auto engine = std::make_unique<MatchingEngine>(REPLAY_TEST_MAX_ACCOUNTS);
+    for (auto symbol : REPLAY_TEST_SYMBOLS)
+    {
+        engine->add_instrument(symbol);
+    }
+    for (auto &shard : engine->shards())
+    {
+        if (!CHECK(engine->open_journals(*shard, journal_dir, FsyncPolicy::none)))
+        {
+            return nullptr;
+        }
+        if (restore)
+        {
+            size_t replayed = 0;
+            CHECK(engine->restore(*shard, REPLAY_TEST_ACCOUNTS, replayed));
+        }
+    }
+    engine->start();
+    return engine;
+}
+
+// accounts, continuous matching on one shard and a call auction on the other; returns the id of an ask left resting
+OrderId run_first_session(MatchingEngine &engine)
+{
+    auto &btc = *engine.shards()[0];
+    auto &eth = *engine.shards()[1];
+    for (AccountId account_id = 0; account_id < REPLAY_TEST_ACCOUNTS; account_id++)
+    {
+        for (auto &shard : engine.shards())
+        {
+            engine.submit(*shard, make_account_message(MessageType::open_account, account_id, quantity_to_lots(100)));
+        }
+        engine.submit(btc, make_account_message(MessageType::fund, account_id, usd_to_cash(100000)));
+    }
+    // the USD goes in through one shard, it is in the shared ledger before the other shard's buys ask for it
+    engine.read_state();
+
+    auto bid = engine.submit_order(btc, 0, Side::buy, quantity_to_lots(5), price_to_ticks(100));
+    engine.submit_order(btc, 1, Side::sell, quantity_to_lots(3), price_to_ticks(99));
+    auto ask = engine.submit_order(btc, 2, Side::sell, quantity_to_lots(4), price_to_ticks(101));
+    engine.submit_order(btc, 3, Side::buy, quantity_to_lots(2), price_to_ticks(102));
+    engine.submit_cancel(bid);
+    engine.submit_order(btc, 0, Side::buy, quantity_to_lots(1), price_to_ticks(98));
+
+    EngineReply started;
+    engine.request(eth, make_auction_message(MessageType::auction_start, &started), started);
+    engine.submit_order(eth, 1, Side::buy, quantity_to_lots(10), price_to_ticks(50));
+    engine.submit_order(eth, 2, Side::sell, quantity_to_lots(6), price_to_ticks(48));
+    engine.submit_order(eth, 3, Side::sell, quantity_to_lots(6), price_to_ticks(49));
+    engine.submit_order(eth, 1, Side::buy, quantity_to_lots(2), price_to_ticks(49));
+    EngineReply uncrossed;
+    engine.request(eth, make_auction_message(MessageType::auction_uncross, &uncrossed), uncrossed);
+    CHECK(uncrossed.auction_volume > 0);
+    engine.submit_order(eth, 0, Side::sell, quantity_to_lots(2), price_to_ticks(51));
+    return ask;
+}
+
+// picks up where the first session left off after a restart
+void run_second_session(MatchingEngine &engine, OrderId resting_ask)
+{
+    auto &btc = *engine.shards()[0];
+    auto &eth = *engine.shards()[1];
+    engine.submit_amend(resting_ask, quantity_to_lots(1), price_to_ticks(100.5));
+    engine.submit_order(btc, 1, Side::buy, quantity_to_lots(3), price_to_ticks(101));
+    engine.submit_order(btc, 0, Side::buy, quantity_to_lots(2), price_to_ticks(97));
+    engine.submit_mass_cancel(0, CancelScope::all, 0, &btc);
+    engine.submit(btc, make_account_message(MessageType::withdraw, 3, usd_to_cash(500)));
+    engine.submit_order(eth, 3, Side::buy, quantity_to_lots(2), price_to_ticks(51));
+    engine.submit_order(eth, 2, Side::sell, quantity_to_lots(1), price_to_ticks(52));
+}
+
+// a journal directory of its own, removed with everything in it
+struct JournalDir
+{
+    JournalDir()
+    {
+        char path_template[] = "/tmp/matching_engine_replay_test.XXXXXX";
+        if (mkdtemp(path_template) != nullptr)
+        {
+            path = path_template;
+        }
+    }
+
+    ~JournalDir()
+    {
+        if (!path.empty())
+        {
+            std::error_code error;
+            std::filesystem::remove_all(path, error);
+        }
+    }
+
+    std::string snapshot(const char *symbol) const { return path + "/" + symbol + ".snapshot"; }
+
+    std::string path;
+};
+
+void replay_rebuilds_what_the_live_engine_saw()
+{
+    JournalDir journal_dir;
+    if (!CHECK(!journal_dir.path.empty()))
+    {
+        return;
+    }
+
+    OrderId resting_ask;
+    EngineView first_live;
+    {
+        auto engine = open_engine(journal_dir.path, false);
+        if (engine == nullptr)
+        {
+            return;
+        }
+        resting_ask = run_first_session(*engine);
+        first_live = view(*engine);
+    }
+    CHECK(!first_live.shards[0].transactions.empty() && !first_live.shards[1].transactions.empty());
+
+    // the snapshots each shard wrote as it shut down
+    std::string first_snapshots = journal_dir.path + "/first";
+    std::filesystem::create_directory(first_snapshots);
+    for (auto symbol : REPLAY_TEST_SYMBOLS)
+    {
+        std::filesystem::copy_file(journal_dir.snapshot(symbol), first_snapshots + "/" + symbol);
+    }
+
+    EngineView live;
+    {
+        auto engine = open_engine(journal_dir.path, true);
+        if (engine == nullptr)
+        {
+            return;
+        }
+        check_same_view(view(*engine), first_live);
+        run_second_session(*engine, resting_ask);
+        live = view(*engine);
+    }
+    CHECK(live.shards[0].transactions.size() > first_live.shards[0].transactions.size());
+    CHECK(live.shards[1].transactions.size() > first_live.shards[1].transactions.size());
+
+    // from the snapshots written at the second shutdown, with nothing after them
+    {
+        auto engine = open_engine(journal_dir.path, true);
+        if (engine != nullptr)
+        {
+            check_same_view(view(*engine), live);
+        }
+    }
+
+    // from the first snapshots and the second session's inputs
+    for (auto symbol : REPLAY_TEST_SYMBOLS)
+    {
+        std::filesystem::copy_file(first_snapshots + "/" + symbol, journal_dir.snapshot(symbol), std::filesystem::copy_options::overwrite_existing);
+    }
+    {
+        auto engine = open_engine(journal_dir.path, true);
+        if (engine != nullptr)
+        {
+            check_same_view(view(*engine), live);
+        }
+    }
+
+    // from every input logged since the first run
+    for (auto symbol : REPLAY_TEST_SYMBOLS)
+    {
+        std::filesystem::remove(journal_dir.snapshot(symbol));
+    }
+    {
+        auto engine = open_engine(journal_dir.path, true);
+        if (engine != nullptr)
+        {
+            check_same_view(view(*engine), live);
+        }
+    }
+}
+
+// whether every shard of a fresh engine rebuilds from `journal_dir`, the engine is never started
+bool restores(const std::string &journal_dir)
+{
+    MatchingEngine engine(REPLAY_TEST_MAX_ACCOUNTS);
+    for (auto symbol : REPLAY_TEST_SYMBOLS)
+    {
+        engine.add_instrument(symbol);
+    }
+    for (auto &shard : engine.shards())
+    {
+        size_t replayed = 0;
+        if (!engine.open_journals(*shard, journal_dir, FsyncPolicy::none) || !engine.restore(*shard, REPLAY_TEST_ACCOUNTS, replayed))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void replay_refuses_a_log_its_snapshot_no_longer_covers()
+{
+    JournalDir journal_dir;
+    if (!CHECK(!journal_dir.path.empty()))
+    {
+        return;
+    }
+
+    EngineView live;
+    {
+        auto engine = open_engine(journal_dir.path, false);
+        if (engine == nullptr)
+        {
+            return;
+        }
+        run_first_session(*engine);
+        // enough inputs for a snapshot that releases the log's first segment
+        auto &btc = *engine->shards()[0];
+        for (size_t i = 0; i < SNAPSHOT_INTERVAL_INPUTS + 16; i++)
+        {
+            engine->submit(btc, make_account_message(MessageType::fund, static_cast<AccountId>(i % REPLAY_TEST_ACCOUNTS), usd_to_cash(1)));
+        }
+        live = view(*engine);
+    }
+
+    std::string kept = journal_dir.path + "/kept";
+    std::filesystem::rename(journal_dir.snapshot("BTC"), kept);
+    CHECK(!restores(journal_dir.path));
+
+    // the refused restore left the fills in place, the snapshot still rebuilds everything
+    std::filesystem::rename(kept, journal_dir.snapshot("BTC"));
+    auto engine = open_engine(journal_dir.path, true);
+    if (engine != nullptr)
+    {
+        check_same_view(view(*engine), live);
+    }
+}
+
+int main()
+{
+    return run_tests({
+        {"replay rebuilds what the live engine saw", replay_rebuilds_what_the_live_engine_saw},
+        {"replay refuses a log its snapshot no longer covers", replay_refuses_a_log_its_snapshot_no_longer_covers},
+    });
+}
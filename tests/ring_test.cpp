@@ -0,0 +1,216 @@
+/*
+    Unit tests for the rings every message and report passes through: the
+    capacity they round up to, full and empty rings, indices that wrap around
+    the slot array, and the unbroken runs a batch push claims.
+*/
+
+#include "matching_engine.h"
+#include "test_check.h"
+
+const size_t RING_TEST_CAPACITY = 4;
+const int RING_TEST_LAPS = 10; // times the indices go round the slot array
+const int RING_TEST_PRODUCERS = 4;
+const uint64_t RING_TEST_MESSAGES_PER_PRODUCER = 10000;
+
+// a batch pop may stop at the consumer's cached view of the write index, so draining takes as many pops as it needs
+template <typename Ring>
+std::vector<uint64_t> drain(Ring &ring, size_t max_count)
+{
+    std::vector<uint64_t> values(max_count);
+    size_t count = 0;
+    for (size_t popped; count < max_count && (popped = ring.try_pop_batch(values.data() + count, max_count - count)) > 0;)
+    {
+        count += popped;
+    }
+    values.resize(count);
+    return values;
+}
+
+template <typename Ring>
+void rounds_capacity_up_to_a_power_of_two()
+{
+    Ring ring(RING_TEST_CAPACITY - 1);
+    for (uint64_t value = 0; value < RING_TEST_CAPACITY; value++)
+    {
+        CHECK(ring.try_push(uint64_t{value}));
+    }
+    CHECK(!ring.try_push(uint64_t{RING_TEST_CAPACITY}));
+    CHECK(ring.size() == RING_TEST_CAPACITY);
+}
+
+template <typename Ring>
+void empty_ring_pops_nothing()
+{
+    Ring ring(RING_TEST_CAPACITY);
+    uint64_t value = 7;
+    CHECK(ring.empty());
+    CHECK(!ring.try_pop(value));
+    CHECK(ring.try_pop_batch(&value, 1) == 0);
+    CHECK(value == 7);
+
+    ring.try_push(uint64_t{1});
+    CHECK(!ring.empty());
+    ring.try_pop(value);
+    CHECK(ring.empty());
+    CHECK(!ring.try_pop(value));
+}
+
+template <typename Ring>
+void full_ring_refuses_until_a_slot_is_freed()
+{
+    Ring ring(RING_TEST_CAPACITY);
+    for (uint64_t value = 0; value < RING_TEST_CAPACITY; value++)
+    {
+        CHECK(ring.try_push(uint64_t{value}));
+    }
+    CHECK(!ring.try_push(uint64_t{100}));
+    CHECK(!ring.try_push(uint64_t{101}));
+
+    uint64_t value = 0;
+    CHECK(ring.try_pop(value));
+    CHECK(value == 0);
+    CHECK(ring.try_push(uint64_t{102}));
+    CHECK(!ring.try_push(uint64_t{103}));
+
+    // the refused values never made it in
+    CHECK(drain(ring, RING_TEST_CAPACITY) == (std::vector<uint64_t>{1, 2, 3, 102}));
+}
+
+template <typename Ring>
+void keeps_order_across_wraparound()
+{
+    Ring ring(RING_TEST_CAPACITY);
+    uint64_t next_push = 0;
+    uint64_t next_pop = 0;
+    // three in flight and two taken at a time, so the batches start on every slot in turn
+    while (next_pop < RING_TEST_CAPACITY * RING_TEST_LAPS)
+    {
+        while (ring.size() < RING_TEST_CAPACITY - 1)
+        {
+            CHECK(ring.try_push(uint64_t{next_push}));
+            next_push++;
+        }
+        auto values = drain(ring, 2);
+        if (!CHECK(values.size() == 2))
+        {
+            return;
+        }
+        for (auto value : values)
+        {
+            CHECK(value == next_pop++);
+        }
+    }
+}
+
+template <typename Ring>
+void batch_pop_stops_at_what_was_pushed()
+{
+    Ring ring(RING_TEST_CAPACITY);
+    uint64_t value;
+    for (int lap = 0; lap < RING_TEST_LAPS; lap++)
+    {
+        ring.try_push(uint64_t{1});
+        ring.try_pop(value);
+    }
+    // the read index now sits in the middle of the slot array
+    ring.try_push(uint64_t{10});
+    ring.try_push(uint64_t{11});
+    ring.try_push(uint64_t{12});
+    CHECK(drain(ring, RING_TEST_CAPACITY * 2) == (std::vector<uint64_t>{10, 11, 12}));
+    CHECK(ring.empty());
+}
+
+void batch_push_claims_a_whole_run_or_nothing()
+{
+    MpscRing<uint64_t> ring(RING_TEST_CAPACITY);
+    const uint64_t run[] = {1, 2, 3};
+    ring.try_push(uint64_t{0});
+    ring.try_push(uint64_t{0});
+    // one slot short of the run, none of it goes in
+    CHECK(!ring.try_push_batch(run, 3));
+    CHECK(ring.size() == 2);
+
+    CHECK(drain(ring, 1) == (std::vector<uint64_t>{0}));
+    CHECK(ring.try_push_batch(run, 3));
+    CHECK(drain(ring, RING_TEST_CAPACITY) == (std::vector<uint64_t>{0, 1, 2, 3}));
+}
+
+void batch_push_wraps_around_the_slot_array()
+{
+    MpscRing<uint64_t> ring(RING_TEST_CAPACITY);
+    uint64_t value;
+    for (uint64_t offset = 0; offset < RING_TEST_CAPACITY * RING_TEST_LAPS; offset++)
+    {
+        // a full-capacity run, starting one slot further on each time
+        const uint64_t run[RING_TEST_CAPACITY] = {offset, offset + 1, offset + 2, offset + 3};
+        CHECK(ring.try_push_batch(run, RING_TEST_CAPACITY));
+        CHECK(!ring.try_push(uint64_t{0}));
+        CHECK(drain(ring, RING_TEST_CAPACITY) == std::vector<uint64_t>(run, run + RING_TEST_CAPACITY));
+        ring.try_push(uint64_t{0});
+        ring.try_pop(value);
+    }
+    CHECK(ring.pushed() == RING_TEST_CAPACITY * RING_TEST_LAPS * (RING_TEST_CAPACITY + 1));
+}
+
+// every producer's values reach the consumer once and in the order that producer pushed them, through a ring that is mostly full
+void message_queue_keeps_each_producers_order()
+{
+    WaitingRing<MpscRing<uint64_t>, uint64_t> queue(RING_TEST_CAPACITY, WaitStrategy::spin_then_park);
+    std::vector<std::thread> producers;
+    for (uint64_t producer = 0; producer < RING_TEST_PRODUCERS; producer++)
+    {
+        producers.emplace_back([&queue, producer]()
+                               {
+                                   for (uint64_t n = 0; n < RING_TEST_MESSAGES_PER_PRODUCER; n++)
+                                   {
+                                       queue.push(producer << 32 | n);
+                                   }
+                               });
+    }
+
+    std::vector<uint64_t> next(RING_TEST_PRODUCERS, 0);
+    bool in_order = true;
+    for (uint64_t received = 0; received < RING_TEST_PRODUCERS * RING_TEST_MESSAGES_PER_PRODUCER;)
+    {
+        uint64_t values[RING_TEST_CAPACITY];
+        size_t count = queue.pop_batch(values, RING_TEST_CAPACITY);
+        for (size_t i = 0; i < count; i++)
+        {
+            auto producer = values[i] >> 32;
+            if (producer >= next.size())
+            {
+                in_order = false;
+                continue;
+            }
+            in_order = in_order && (values[i] & 0xffffffff) == next[producer];
+            next[producer]++;
+        }
+        received += count;
+    }
+    for (auto &producer : producers)
+    {
+        producer.join();
+    }
+    CHECK(in_order);
+    CHECK(queue.empty());
+    CHECK(queue.pushed() == RING_TEST_PRODUCERS * RING_TEST_MESSAGES_PER_PRODUCER);
+}
+
+int main()
+{
+    return run_tests({
+        {"spsc ring rounds its capacity up to a power of two", rounds_capacity_up_to_a_power_of_two<SpscRing<uint64_t>>},
+        {"spsc ring pops nothing when empty", empty_ring_pops_nothing<SpscRing<uint64_t>>},
+        {"spsc ring refuses pushes while full", full_ring_refuses_until_a_slot_is_freed<SpscRing<uint64_t>>},
+        {"spsc ring keeps its order across wraparound", keeps_order_across_wraparound<SpscRing<uint64_t>>},
+        {"spsc ring batch pop stops at what was pushed", batch_pop_stops_at_what_was_pushed<SpscRing<uint64_t>>},
+        {"mpsc ring rounds its capacity up to a power of two", rounds_capacity_up_to_a_power_of_two<MpscRing<uint64_t>>},
+        {"mpsc ring pops nothing when empty", empty_ring_pops_nothing<MpscRing<uint64_t>>},
+        {"mpsc ring refuses pushes while full", full_ring_refuses_until_a_slot_is_freed<MpscRing<uint64_t>>},
+        {"mpsc ring keeps its order across wraparound", keeps_order_across_wraparound<MpscRing<uint64_t>>},
+        {"mpsc ring batch pop stops at what was pushed", batch_pop_stops_at_what_was_pushed<MpscRing<uint64_t>>},
+        {"mpsc ring batch push claims a whole run or nothing", batch_push_claims_a_whole_run_or_nothing},
+        {"mpsc ring batch push wraps around the slot array", batch_push_wraps_around_the_slot_array},
+        {"message queue keeps each producer's order", message_queue_keeps_each_producers_order},
+    });
+}
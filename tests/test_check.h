@@ -0,0 +1,47 @@
+/*
+    The few checks the unit tests need. Unlike assert they stay in a Release
+    build; a failed one is reported with its line and the test carries on, and
+    run_tests turns any failure into a non-zero exit status for ctest.
+*/
+
+#ifndef MATCHING_ENGINE_TEST_CHECK_H
+#define MATCHING_ENGINE_TEST_CHECK_H
+
+#include <initializer_list>
+#include <iostream>
+#include <utility>
+
+inline int &failed_checks()
+{
+    static int count = 0;
+    return count;
+}
+
+inline bool check(bool passed, const char *expression, const char *file, int line)
+{
+    if (!passed)
+    {
+        std::cerr << file << ":" << line << ": check failed: " << expression << "\n";
+        failed_checks()++;
+    }
+    return passed;
+}
+
+#define CHECK(expression) check(static_cast<bool>(expression), #expression, __FILE__, __LINE__)
+
+// runs every test in order, prints the ones with a failed check
+inline int run_tests(std::initializer_list<std::pair<const char *, void (*)()>> tests)
+{
+    int failed_tests = 0;
+    for (auto &test : tests)
+    {
+        int failed_before = failed_checks();
+        test.second();
+        bool passed = failed_checks() == failed_before;
+        std::cout << (passed ? "[ ok ] " : "[FAIL] ") << test.first << "\n";
+        failed_tests += passed ? 0 : 1;
+    }
+    return failed_tests == 0 ? 0 : 1;
+}
+
+#endif